@@ -0,0 +1,144 @@
+#ifndef BAM_H
+#define BAM_H
+
+#include "genomics/structures.hpp"
+#include "genomics/sequences.hpp"
+#include "genomics/sam.hpp"
+
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace genomics {
+    namespace {
+        template <class T>
+        void append_little_endian(std::string& out, T n) {
+            uint64_t bits = static_cast<uint64_t>(n);
+            for (size_t i = 0; i < sizeof(T); i++, bits >>= 8) {
+                out += static_cast<char>(bits & 0xff);
+            }
+        }
+
+        /* The 4 bit code of a base in BAM sequences. */
+        uint8_t bam_base_code(char base) {
+            switch (base) {
+            case 'A': return 1;
+            case 'C': return 2;
+            case 'G': return 4;
+            case 'T': return 8;
+            default: return 15;
+            }
+        }
+
+        /* The BAI bin of the interval [beg, end), as given in the SAM
+           specification. */
+        uint16_t bam_bin(uint32_t beg, uint32_t end) {
+            --end;
+            if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+            if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+            if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+            if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+            if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+            return 0;
+        }
+    };
+
+    /* Writes the BAM header: the SAM header as text followed by the
+       reference sequences. */
+    void write_bam_header(std::ostream& os, const genome_structure& gs, bool sorted = false) {
+        std::ostringstream text;
+        write_sam_header(text, gs, sorted);
+        std::string sam_header = text.str();
+
+        std::string header("BAM\1", 4);
+        append_little_endian<int32_t>(header, sam_header.size());
+        header += sam_header;
+        append_little_endian<int32_t>(header, gs.size());
+        for (const auto& chr : gs) {
+            append_little_endian<int32_t>(header, chr.name.length() + 1);
+            header.append(chr.name.c_str(), chr.name.length() + 1);
+            append_little_endian<int32_t>(header, chr.length);
+        }
+
+        os.write(header.data(), header.size());
+    }
+
+    /*
+      Encodes the records of sam_writer as BAM alignment records into a
+      reusable buffer. The fields are the same, with the off-target tag
+      kept as a hex string, so tools reading the database through htslib
+      see the same records either way.
+    */
+    class bam_writer {
+    public:
+        explicit bam_writer(const genome_structure& gs,
+                            off_target_encoding encoding = off_target_encoding::hex)
+            : sam(gs, encoding) {
+            for (size_t i = 0; i < gs.size(); i++) references[gs[i].name] = i;
+        }
+
+        void append_record(std::string& out, const kmer& k, const coordinates& coords,
+                           const std::vector<std::vector<int64_t>>& off_targets) const {
+            uint32_t length = k.sequence.length() + k.pam.length();
+            uint32_t position = coords.offset;
+
+            size_t start = out.size();
+            append_little_endian<int32_t>(out, 0);
+            append_little_endian<int32_t>(out, references.at(coords.chr.name));
+            append_little_endian<int32_t>(out, position);
+            append_little_endian<uint8_t>(out, length + 1);
+            append_little_endian<uint8_t>(out, 100);
+            append_little_endian<uint16_t>(out, bam_bin(position, position + length));
+            append_little_endian<uint16_t>(out, 1);
+            append_little_endian<uint16_t>(out, k.dir == direction::positive ? 0 : 16);
+            append_little_endian<int32_t>(out, length);
+            append_little_endian<int32_t>(out, -1);
+            append_little_endian<int32_t>(out, -1);
+            append_little_endian<int32_t>(out, 0);
+
+            out.append(k.sequence).append(k.pam);
+            out += '\0';
+            append_little_endian<uint32_t>(out, length << 4);
+
+            auto base = [&](size_t i) {
+                if (k.dir == direction::positive) {
+                    return i < k.sequence.length() ? k.sequence[i] : k.pam[i - k.sequence.length()];
+                }
+
+                size_t j = length - 1 - i;
+                return complement(j < k.sequence.length() ? k.sequence[j] : k.pam[j - k.sequence.length()]);
+            };
+
+            for (size_t i = 0; i < length; i += 2) {
+                uint8_t high = bam_base_code(base(i));
+                uint8_t low = i + 1 < length ? bam_base_code(base(i + 1)) : 0;
+                out += static_cast<char>(high << 4 | low);
+            }
+
+            out.append(length, '\xff');
+
+            bool no_off_targets = true;
+            for (const auto& v : off_targets) {
+                if (!v.empty()) no_off_targets = false;
+            }
+
+            if (!no_off_targets) {
+                out.append(sam.off_targets_tag()).append(1, 'H');
+                sam.append_off_targets(out, off_targets);
+                out += '\0';
+            }
+
+            uint32_t block_size = out.size() - start - 4;
+            for (size_t i = 0; i < 4; i++, block_size >>= 8) {
+                out[start + i] = static_cast<char>(block_size & 0xff);
+            }
+        }
+
+    private:
+        sam_writer sam;
+        std::unordered_map<std::string, int32_t> references;
+    };
+};
+
+#endif /* BAM_H */
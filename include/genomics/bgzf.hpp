@@ -0,0 +1,70 @@
+/*
+   Writes BGZF, the blocked gzip format BAM files are stored in,
+   compressing the blocks on several threads.
+*/
+
+#ifndef BGZF_H
+#define BGZF_H
+
+#include <deque>
+#include <future>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "genomics/pipeline.hpp"
+
+namespace genomics {
+
+    /*
+      Uncompressed bytes per BGZF block, small enough that a block
+      stays below 64KB once compressed.
+    */
+    const size_t bgzf_block_size = 0xff00;
+
+    /*
+      A stream buffer that cuts what is written to it into BGZF blocks
+      and writes them, compressed, to the underlying stream in order.
+      The blocks are compressed by a pool of threads, so the thread
+      writing to it only cuts and copies the data. Flushing ends the
+      current block and waits until every block is written, so the
+      underlying stream then ends on a block boundary. Closing adds
+      the empty block that marks the end of a BGZF file.
+    */
+    class bgzf_streambuf : public std::streambuf {
+    public:
+        bgzf_streambuf(std::ostream& os, size_t threads);
+        bgzf_streambuf(const bgzf_streambuf& other) = delete;
+        bgzf_streambuf& operator=(const bgzf_streambuf& other) = delete;
+        ~bgzf_streambuf();
+
+        void close();
+
+    protected:
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+        int_type overflow(int_type c) override;
+        int sync() override;
+
+    private:
+        struct compression_job {
+            std::string data;
+            std::promise<std::string> block;
+        };
+
+        std::ostream& os;
+        std::string block;
+        bool closed = false;
+
+        bounded_queue<compression_job> jobs;
+        std::deque<std::future<std::string>> pending;
+        std::vector<std::thread> workers;
+        size_t max_pending;
+
+        void submit_block();
+        void write_blocks(size_t keep);
+    };
+};
+
+#endif /* BGZF_H */
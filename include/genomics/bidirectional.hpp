@@ -0,0 +1,527 @@
+/*
+   Off-target search over both strands of a genome using the forward
+   FM-index together with the BWT of the reverse complement strand.
+   Together they form a bidirectional index: a pattern can be
+   extended on either side while its interval is tracked in both.
+*/
+
+#ifndef BIDIRECTIONAL_INDEX_H
+#define BIDIRECTIONAL_INDEX_H
+
+#include "genomics/index.hpp"
+#include "genomics/sequences.hpp"
+
+#include <sdsl/suffix_arrays.hpp>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace genomics {
+
+    /*
+      The reverse complement index is only ever used to count, never
+      to locate, so its SA and ISA samples are kept as sparse as sdsl
+      allows to make it cost little more than its BWT.
+    */
+    const uint32_t rc_sa_dens  = 1u << 30;
+    const uint32_t rc_isa_dens = 1u << 30;
+
+    /*
+      Searches with at least this many mismatches run on search
+      schemes rather than on a plain backtracking search.
+    */
+    const size_t min_scheme_mismatches = 2;
+
+    /*
+      A backward search meets the PAM last only when the PAM sits
+      left of the query in the text, which is the case for antisense
+      off-targets in the forward index and for sense off-targets in
+      the reverse complement index. Matching the PAM last lets all
+      PAMs share the traversal of the protospacer and keeps the
+      wildcard 'N' of the PAM from multiplying the top of the search
+      tree, where every branch is still alive.
+
+      Intervals found in the reverse complement index are relocated
+      to the forward index by spelling the match out with psi and
+      searching it exactly, so visitors see the same intervals as
+      with genome_index::inexact_search.
+
+      Backtracking from one end of the protospacer still allows
+      mismatches at its very first characters, where the intervals
+      are largest, and blows up with the number of mismatches. For
+      larger budgets the protospacer is therefore cut into
+      mismatches + 1 parts, one of which must match exactly, and
+      searched with pigeonhole search schemes: one search per part,
+      starting with that part exactly and extending it to both
+      sides with bounds on the mismatches spent so far. A pattern
+      is represented by its interval [f_sp, f_sp + size) in the
+      forward text together with the interval [r_sp, r_sp + size)
+      of its reverse complement in the reverse complement text.
+      Prepending a character is a backward step in the forward
+      index and appending one is a backward step in the reverse
+      complement index; in both cases the interval in the other
+      index narrows to a sub-interval offset by the occurrences of
+      characters whose complement sorts first.
+    */
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    class bidirectional_index {
+    public:
+        typedef genome_index<t_wt, t_dens, t_inv_dens> t_forward_index;
+        typedef genome_index<t_wt, rc_sa_dens, rc_isa_dens> t_reverse_index;
+        typedef typename t_reverse_index::t_csa t_rc_csa;
+
+        const t_forward_index& forward;
+        t_reverse_index reverse;
+
+        bidirectional_index(const t_forward_index& forward, t_rc_csa rc_csa)
+            : forward(forward), reverse(std::move(rc_csa), genome_structure())
+        {}
+        bidirectional_index(const bidirectional_index& other) = delete;
+        bidirectional_index& operator=(const bidirectional_index& other) = delete;
+
+        /*
+          Same contract as genome_index::inexact_search: the visitor
+          receives intervals of the forward index, so matches are
+          resolved through forward.resolve(...), and may end the
+          search by returning false.
+        */
+        template <class t_visitor>
+        bool inexact_search(const std::string& query,
+                            const std::vector<std::string> &pams,
+                            pam_side side, size_t mismatches,
+                            t_visitor& visitor, search_frontier* frontier = nullptr) const;
+
+        /*
+          Same contract as genome_index::extend_search. A larger
+          budget switches to search schemes that share nothing with
+          the search to the frontier, so the frontier only records its
+          budget and the search starts over, visiting only the matches
+          beyond it. Searching to the threshold first still pays off,
+          since it is cheap and discards most guides that are dropped.
+        */
+        template <class t_visitor>
+        bool extend_search(const std::string& query,
+                           const std::vector<std::string> &pams,
+                           pam_side side, size_t mismatches,
+                           const search_frontier& frontier, t_visitor& visitor) const;
+
+    private:
+        template <class t_visitor>
+        struct deeper_visitor {
+            size_t mismatches;
+            t_visitor& visitor;
+
+            bool operator()(size_t sp, size_t ep, size_t k) {
+                return k <= mismatches || visitor(sp, ep, k);
+            }
+        };
+
+        template <class t_visitor>
+        struct relocating_visitor {
+            const bidirectional_index& index;
+            size_t length;
+            t_visitor& visitor;
+
+            bool operator()(size_t sp, size_t, size_t k) {
+                size_t f_sp, f_ep;
+                index.relocate(sp, length, f_sp, f_ep);
+                return visitor(f_sp, f_ep, k);
+            }
+        };
+
+        /*
+          One character of a search: its position in the pattern as
+          it reads in the text, the side the pattern grows on, and
+          the most mismatches that may have been spent after it. A
+          step that closes a part which must hold a mismatch only
+          continues with mismatches if none was spent in the part.
+        */
+        struct search_step {
+            size_t position;
+            bool left;
+            bool pam;
+            bool part_begin;
+            bool needs_mismatch;
+            size_t upper;
+        };
+
+        struct search_plan {
+            std::array<search_step, search_stack_size / 4> steps;
+            size_t length;
+            size_t query_begin, pam_begin;
+        };
+
+        struct search_frame {
+            size_t f_sp, r_sp, size;
+            size_t step;
+            size_t k;      // mismatches spent on the query
+            size_t part_k; // mismatches spent before the current part
+            ssize_t pam;   // index into pams, or -1 before the PAM
+        };
+
+        /*
+          The symbols of a BWT interval together with their ranks at
+          both ends, as reported by the wavelet tree in a single
+          traversal. Every child of a frame is derived from it.
+        */
+        struct interval_symbols {
+            typename t_wt::size_type k;
+            std::vector<typename t_wt::value_type> cs;
+            std::vector<typename t_wt::size_type> rank_i, rank_j;
+
+            explicit interval_symbols(size_t sigma) : k(0), cs(sigma), rank_i(sigma), rank_j(sigma)
+            {}
+        };
+
+        void relocate(size_t rc_sp, size_t length, size_t& sp, size_t& ep) const;
+
+        template <class t_visitor>
+        bool relocating_search(const std::string& query,
+                               const std::vector<std::string> &pams,
+                               size_t mismatches, t_visitor& visitor) const;
+
+        template <class t_visitor>
+        bool scheme_search(const std::string& query,
+                           const std::vector<std::string> &pams,
+                           pam_side side, size_t mismatches,
+                           t_visitor& visitor) const;
+
+        search_plan plan_search(size_t query_length, size_t pam_length, pam_side side,
+                                size_t mismatches, size_t exact_part) const;
+
+        template <size_t t_mismatches, class t_visitor>
+        bool search_kernel(const search_plan& plan, const char* query,
+                           const std::vector<std::string>& pams,
+                           size_t mismatches, interval_symbols& symbols,
+                           t_visitor& visitor) const;
+
+        template <class t_csa>
+        static bool extend(const t_csa& csa, const interval_symbols& symbols,
+                           size_t& sp, size_t& other_sp, size_t& size, unsigned char c);
+
+        void split(const search_frame& f, bool left, interval_symbols& symbols) const;
+        bool extend(search_frame& f, bool left, const interval_symbols& symbols, char c) const;
+    };
+
+    /*
+      The suffix at rc_sp starts with the reverse complement of the
+      match, so reading it front to back with psi yields the match
+      back to front, complemented, which is the order a backward
+      search consumes it in.
+    */
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    void bidirectional_index<t_wt, t_dens, t_inv_dens>::relocate(size_t rc_sp, size_t length,
+                                                                 size_t& sp, size_t& ep) const {
+        const t_rc_csa& rc_csa = reverse.csa;
+
+        sp = 0;
+        ep = forward.csa.size() - 1;
+
+        size_t i = rc_sp;
+        for (size_t j = 0; j < length; j++) {
+            char c = complement(rc_csa.F[i]);
+            sdsl::backward_search(forward.csa, sp, ep, c, sp, ep);
+            i = rc_csa.psi[i];
+        }
+    }
+
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <class t_visitor>
+    bool bidirectional_index<t_wt, t_dens, t_inv_dens>::relocating_search(const std::string& query,
+                                                                          const std::vector<std::string> &pams,
+                                                                          size_t mismatches,
+                                                                          t_visitor& visitor) const {
+        std::string query_c = reverse_complement(query);
+        std::vector<std::string> pams_c;
+        for (const auto& pam : pams) {
+            pams_c.push_back(reverse_complement(pam));
+        }
+
+        relocating_visitor<t_visitor> relocator = {*this, query.length() + pams[0].length(), visitor};
+        return reverse.inexact_search(query_c, pams_c, pam_side::left, mismatches, relocator);
+    }
+
+    /*
+      Backward step by c in csa, moving the interval of the other
+      index along by the number of occurrences of symbols whose
+      complement sorts before the complement of c. The sentinel is
+      its own complement and sorts first in both texts.
+    */
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <class t_csa>
+    bool bidirectional_index<t_wt, t_dens, t_inv_dens>::extend(const t_csa& csa,
+                                                               const interval_symbols& symbols,
+                                                               size_t& sp, size_t& other_sp,
+                                                               size_t& size, unsigned char c) {
+        unsigned char c_c = complement(c);
+        size_t offset = 0;
+        bool found = false;
+
+        for (size_t p = 0; p < symbols.k; p++) {
+            unsigned char z = symbols.cs[p];
+            if (z == c) {
+                sp = csa.C[csa.char2comp[c]] + symbols.rank_i[p];
+                size = symbols.rank_j[p] - symbols.rank_i[p];
+                found = true;
+            } else if (static_cast<unsigned char>(complement(z)) < c_c) {
+                offset += symbols.rank_j[p] - symbols.rank_i[p];
+            }
+        }
+
+        if (found) other_sp += offset;
+        return found;
+    }
+
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    void bidirectional_index<t_wt, t_dens, t_inv_dens>::split(const search_frame& f, bool left,
+                                                              interval_symbols& symbols) const {
+        if (left) {
+            forward.csa.wavelet_tree.interval_symbols(f.f_sp, f.f_sp + f.size, symbols.k,
+                                                      symbols.cs, symbols.rank_i, symbols.rank_j);
+        } else {
+            reverse.csa.wavelet_tree.interval_symbols(f.r_sp, f.r_sp + f.size, symbols.k,
+                                                      symbols.cs, symbols.rank_i, symbols.rank_j);
+        }
+    }
+
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    bool bidirectional_index<t_wt, t_dens, t_inv_dens>::extend(search_frame& f, bool left,
+                                                               const interval_symbols& symbols,
+                                                               char c) const {
+        if (left) {
+            return extend(forward.csa, symbols, f.f_sp, f.r_sp, f.size, c);
+        }
+
+        return extend(reverse.csa, symbols, f.r_sp, f.f_sp, f.size, complement(c));
+    }
+
+    /*
+      Lays out the search that matches part exact_part of the
+      protospacer exactly. Since every other search covers the
+      patterns whose first exact part comes earlier, the parts left
+      of exact_part must each hold a mismatch, which also bounds the
+      mismatches the parts right of it may spend. Those are matched
+      first, then the parts on the left, and the PAM comes last.
+    */
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    auto bidirectional_index<t_wt, t_dens, t_inv_dens>::plan_search(size_t query_length,
+                                                                    size_t pam_length,
+                                                                    pam_side side,
+                                                                    size_t mismatches,
+                                                                    size_t exact_part) const -> search_plan {
+        search_plan plan;
+        plan.length = 0;
+        plan.query_begin = side == pam_side::left ? pam_length : 0;
+        plan.pam_begin = side == pam_side::left ? 0 : query_length;
+
+        size_t parts = mismatches + 1;
+        auto part_begin = [&](size_t part) {
+            return plan.query_begin + part * query_length / parts;
+        };
+
+        auto add = [&plan](size_t position, bool left, bool pam, bool begin,
+                           bool needs_mismatch, size_t upper) {
+            plan.steps[plan.length++] = {position, left, pam, begin, needs_mismatch, upper};
+        };
+
+        for (size_t i = part_begin(exact_part + 1); i > part_begin(exact_part); i--) {
+            add(i - 1, true, false, false, false, 0);
+        }
+
+        for (size_t part = exact_part + 1; part < parts; part++) {
+            for (size_t i = part_begin(part); i < part_begin(part + 1); i++) {
+                add(i, false, false, i == part_begin(part), false, mismatches - exact_part);
+            }
+        }
+
+        for (size_t part = exact_part; part > 0; part--) {
+            size_t begin = part_begin(part - 1), end = part_begin(part);
+            for (size_t i = end; i > begin; i--) {
+                add(i - 1, true, false, i == end, i - 1 == begin, mismatches - (part - 1));
+            }
+        }
+
+        for (size_t i = 0; i < pam_length; i++) {
+            if (side == pam_side::left) {
+                add(pam_length - 1 - i, true, true, false, false, mismatches);
+            } else {
+                add(query_length + i, false, true, false, false, mismatches);
+            }
+        }
+
+        return plan;
+    }
+
+    /*
+      Same traversal as genome_index::search_kernel, except that a
+      frame carries a pair of intervals and each step of the plan
+      may extend the match on either side. The first PAM step forks
+      a frame per PAM; PAM positions never spend mismatches and
+      honor the wildcard 'N'.
+    */
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <size_t t_mismatches, class t_visitor>
+    bool bidirectional_index<t_wt, t_dens, t_inv_dens>::search_kernel(const search_plan& plan,
+                                                                      const char* query,
+                                                                      const std::vector<std::string>& pams,
+                                                                      size_t mismatches,
+                                                                      interval_symbols& symbols,
+                                                                      t_visitor& visitor) const {
+        const size_t budget = t_mismatches == dynamic_mismatches ? mismatches : t_mismatches;
+        const char* search_alphabet = forward.search_alphabet;
+        const size_t search_alphabet_size = forward.search_alphabet_size;
+
+        std::array<search_frame, search_stack_size> stack;
+        size_t top = 0;
+        stack[top++] = {0, 0, forward.csa.size(), 0, 0, 0, -1};
+
+        while (top > 0) {
+            search_frame f = stack[--top];
+
+            if (f.step == plan.length) {
+                if (!visitor(f.f_sp, f.f_sp + f.size - 1, f.k)) return false;
+                continue;
+            }
+
+            const search_step& s = plan.steps[f.step];
+
+            if (s.pam && f.pam < 0) {
+                for (ssize_t p = pams.size() - 1; p >= 0; p--) {
+                    search_frame g = f;
+                    g.pam = p;
+                    stack[top++] = g;
+                }
+                continue;
+            }
+
+            if (s.part_begin) f.part_k = f.k;
+
+            char c = s.pam ? pams[f.pam][s.position - plan.pam_begin]
+                           : query[s.position - plan.query_begin];
+            bool wildcard = s.pam && c == 'N';
+
+            size_t cost = wildcard ? 0 : 1;
+            bool branch = wildcard || (!s.pam && f.k < std::min(s.upper, budget));
+            bool exact = !s.needs_mismatch || f.k > f.part_k;
+
+            if (!branch && !exact) continue;
+            split(f, s.left, symbols);
+
+            if (branch) {
+                for (ssize_t i = search_alphabet_size - 1; i >= 0; i--) {
+                    char a = search_alphabet[i];
+                    if (a == c) continue;
+
+                    search_frame g = f;
+                    if (extend(g, s.left, symbols, a)) {
+                        g.step++;
+                        g.k += cost;
+                        stack[top++] = g;
+                    }
+                }
+            }
+
+            if (exact && extend(f, s.left, symbols, c)) {
+                f.step++;
+                stack[top++] = f;
+            }
+        }
+
+        return true;
+    }
+
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <class t_visitor>
+    bool bidirectional_index<t_wt, t_dens, t_inv_dens>::scheme_search(const std::string& query,
+                                                                      const std::vector<std::string> &pams,
+                                                                      pam_side side, size_t mismatches,
+                                                                      t_visitor& visitor) const {
+        size_t depth = query.length() + pams[0].length();
+        if (4 * depth + pams.size() + 1 > search_stack_size) {
+            throw std::length_error("inexact_search: query too long for search stack");
+        }
+
+        static_assert(max_specialized_mismatches == 4,
+                      "scheme_search must cover every specialized budget");
+
+        interval_symbols symbols(std::max(forward.csa.wavelet_tree.sigma,
+                                          reverse.csa.wavelet_tree.sigma));
+
+        const char* q = query.data();
+        for (size_t part = 0; part <= mismatches; part++) {
+            search_plan plan = plan_search(query.length(), pams[0].length(), side, mismatches, part);
+
+            bool complete;
+            switch (mismatches) {
+            case 2: complete = search_kernel<2>(plan, q, pams, mismatches, symbols, visitor); break;
+            case 3: complete = search_kernel<3>(plan, q, pams, mismatches, symbols, visitor); break;
+            case 4: complete = search_kernel<4>(plan, q, pams, mismatches, symbols, visitor); break;
+            default:
+                complete = search_kernel<dynamic_mismatches>(plan, q, pams, mismatches, symbols, visitor);
+            }
+
+            if (!complete) return false;
+        }
+
+        return true;
+    }
+
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <class t_visitor>
+    bool bidirectional_index<t_wt, t_dens, t_inv_dens>::inexact_search(const std::string& query,
+                                                                       const std::vector<std::string> &pams,
+                                                                       pam_side side, size_t mismatches,
+                                                                       t_visitor& visitor,
+                                                                       search_frontier* frontier) const {
+        if (frontier) {
+            frontier->mismatches = mismatches;
+            frontier->frames.clear();
+        }
+
+        if (pams.empty()) return true;
+
+        bool schemes = mismatches >= min_scheme_mismatches && query.length() > mismatches;
+        if (side == pam_side::left && !schemes) {
+            return forward.inexact_search(query, pams, side, mismatches, visitor);
+        }
+
+        /* Both searches fork a frame per PAM at a fixed position of
+           the pattern, so PAMs of different lengths are searched one
+           length at a time. */
+        std::vector<bool> searched(pams.size(), false);
+        for (size_t i = 0; i < pams.size(); i++) {
+            if (searched[i]) continue;
+
+            std::vector<std::string> same_length;
+            for (size_t j = i; j < pams.size(); j++) {
+                if (pams[j].length() != pams[i].length()) continue;
+                same_length.push_back(pams[j]);
+                searched[j] = true;
+            }
+
+            bool complete = schemes
+                ? scheme_search(query, same_length, side, mismatches, visitor)
+                : relocating_search(query, same_length, mismatches, visitor);
+            if (!complete) return false;
+        }
+
+        return true;
+    }
+
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <class t_visitor>
+    bool bidirectional_index<t_wt, t_dens, t_inv_dens>::extend_search(const std::string& query,
+                                                                      const std::vector<std::string> &pams,
+                                                                      pam_side side, size_t mismatches,
+                                                                      const search_frontier& frontier,
+                                                                      t_visitor& visitor) const {
+        if (mismatches <= frontier.mismatches) return true;
+
+        deeper_visitor<t_visitor> deeper = {frontier.mismatches, visitor};
+        return inexact_search(query, pams, side, mismatches, deeper);
+    }
+};
+
+#endif /* BIDIRECTIONAL_INDEX_H */
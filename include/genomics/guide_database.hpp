@@ -0,0 +1,94 @@
+/*
+   A binary guide database, laid out in columns and read through mmap,
+   that finds the records of a protospacer without reading the rest of
+   the database.
+*/
+
+#ifndef GUIDE_DATABASE_H
+#define GUIDE_DATABASE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "genomics/off_targets.hpp"
+#include "genomics/structures.hpp"
+
+namespace genomics {
+
+    /* The layout of a guide database, at its start. */
+    struct guide_database_header;
+
+    /* A guide read from a guide database. */
+    struct guide_record {
+        kmer k;
+        coordinates coords;
+
+        /* Number of off-targets at each distance. */
+        std::vector<uint32_t> counts;
+        std::vector<std::vector<int64_t>> off_targets;
+    };
+
+    /*
+      Packs a SAM database written by build or merge into a guide
+      database, splitting each guide into its protospacer of the
+      given length and its PAM. The guides are sorted by protospacer and stored as
+      columns: the protospacers packed 2 bits per base, their
+      coordinates, their number of off-targets at each distance and
+      the offset of their off-targets, compact encoded, in a block at
+      the end of the file. A directory over the leading bases of the
+      protospacers narrows every lookup down to a few guides. The
+      guides are sorted in memory, taking about 50 bytes per guide,
+      while their off-targets are streamed to a temporary file next to
+      the output. Throws a std::runtime_error if the database is
+      malformed or a file cannot be read or written.
+    */
+    void pack_guide_database(const std::string& database, const std::string& output,
+                             size_t protospacer_length);
+
+    /*
+      A guide database mapped into memory. Opening it reads only its
+      header, genome and PAMs; lookups touch the pages of the guides
+      they find.
+    */
+    class guide_database {
+    public:
+        explicit guide_database(const std::string& filename);
+        guide_database(const guide_database& other) = delete;
+        guide_database& operator=(const guide_database& other) = delete;
+        ~guide_database();
+
+        const genome_structure& genome() const { return gs; }
+
+        /* The encoding of the off-targets in the packed SAM database. */
+        off_target_encoding encoding() const { return off_targets_encoding; }
+
+        size_t protospacer_length() const;
+        size_t size() const;
+
+        /*
+          Finds the guides with the given protospacer, or with the
+          first protospacer_length() bases of the sequence if it is
+          longer, such as a protospacer followed by its PAM. Throws a
+          std::runtime_error if the sequence is too short or not DNA.
+        */
+        std::vector<guide_record> find(const std::string& sequence) const;
+
+    private:
+        const char* data = nullptr;
+        size_t length = 0;
+        const guide_database_header* header = nullptr;
+
+        genome_structure gs;
+        std::vector<std::string> pams;
+        off_target_encoding off_targets_encoding;
+
+        template <class T>
+        const T* section(uint64_t offset, uint64_t count) const;
+
+        void read_header();
+        guide_record read_guide(size_t row) const;
+    };
+};
+
+#endif /* GUIDE_DATABASE_H */
@@ -2,12 +2,86 @@
 #define GENOME_INDEX_H
 
 #include "structures.hpp"
+#include "interval_table.hpp"
 
 #include <sdsl/suffix_arrays.hpp>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace genomics {
 
+    /*
+      Mismatch budgets at or below this value get their own
+      instantiation of the search kernel, letting the compiler fold
+      the budget checks. Larger budgets use the runtime value.
+    */
+    const size_t max_specialized_mismatches = 4;
+    const size_t dynamic_mismatches = static_cast<size_t>(-1);
+
+    /*
+      Capacity of the explicit stack used by inexact_search. Every
+      popped frame pushes at most five children (four for a regular
+      character, five for the wildcard 'N'), so a search over a
+      pattern of depth d never holds more than 4d + |pams| + 1
+      frames.
+    */
+    const size_t search_stack_size = 512;
+
+    /*
+      Position of the PAM relative to the query in the indexed
+      text. With pam_side::right the text reads query + PAM, so the
+      backward search matches the PAM before the query; with
+      pam_side::left it reads PAM + query and the PAM is matched
+      last.
+    */
+    enum class pam_side { left, right };
+
+    /*
+      Number of LF walks that genome_index::resolve advances in
+      lockstep, which keeps as many cache misses in flight.
+    */
+    const size_t locate_batch_size = 32;
+
+    /*
+      Hints that the BWT at position i is about to be read. Does
+      nothing unless overloaded for the wavelet tree, as wt_dna
+      does; the overload is found by argument dependent lookup.
+    */
+    template <class t_wt>
+    inline void prefetch_bwt(const t_wt&, size_t) {}
+
+    /*
+      A frame of the backtracking search: the interval of the string
+      matched so far and where the search goes on from there.
+    */
+    struct search_frame {
+        size_t sp, ep;
+        ssize_t position; // next character to match, right to left
+        size_t k;         // mismatches spent on the query
+        ssize_t pam;      // index into pams, or -1 for the query
+        uint64_t code;    // table code of the matched string, or uncoded
+        size_t matched;   // length of the matched string
+    };
+
+    /*
+      The frames at which a search ran out of mismatches while it
+      could still have spent one on the query. A search with a
+      larger budget can go on from them instead of starting over,
+      which is how a guide is first searched to the threshold, where
+      it is cheap to discard, and only then to the full budget.
+      The frontier is only complete if the search that recorded it
+      was not ended early by its visitor.
+    */
+    struct search_frontier {
+        size_t mismatches = 0;
+        std::vector<search_frame> frames;
+    };
+
     template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
     class genome_index {
     public:
@@ -16,13 +90,18 @@ namespace genomics {
         t_csa csa;
         genome_structure gs;
 
+        /* Optional, takes over the first table.depth() steps of
+           every backward search when it is not empty. */
+        interval_table table;
+
         const char* search_alphabet = "ATCG";
         size_t search_alphabet_size = strlen(search_alphabet);
 
         genome_index() {}
-        genome_index(t_csa csa, genome_structure gs) : csa(csa), gs(gs)
+        genome_index(t_csa csa, genome_structure gs, interval_table table = interval_table())
+            : csa(std::move(csa)), gs(std::move(gs)), table(std::move(table))
         {}
-        genome_index(const genome_index& other) : csa(other.csa), gs(other.gs)
+        genome_index(const genome_index& other) : csa(other.csa), gs(other.gs), table(other.table)
         {}
 
         friend void swap(genome_index& first, genome_index& second)
@@ -30,6 +109,7 @@ namespace genomics {
             using std::swap;
             swap(first.csa, second.csa);
             swap(first.gs, second.gs);
+            swap(first.table, second.table);
         }
 
         genome_index& operator=(genome_index other)
@@ -42,177 +122,340 @@ namespace genomics {
             return csa[bwt_position];
         }
 
-        /* 
+        /*
+          Resolves every BWT position in rows at once, storing the
+          text positions in the same order in positions. The LF walks
+          to the nearest sample are interleaved and each step
+          prefetches the BWT for the next one, so the memory latency
+          of different walks overlaps.
+        */
+        void resolve(const std::vector<size_t>& rows, std::vector<size_t>& positions) const;
+
+        /*
            Searches for all strings in the genome matching the given
            query, up to a certain number of mismatches and allowing
            the wildcard character 'N' in the query.
 
-           When a set of matches are found, the callback is called
-           with the start and end position in the BWT of the genome,
-           along with the number of mismatches, and a reference to
-           the passed in data.
+           When a set of matches are found, the visitor is called as
+           visitor(sp, ep, k) with the start and end position in the
+           BWT of the genome along with the number of mismatches. The
+           visitor is a template parameter so that it is inlined
+           into the search loop; any callable returning bool works.
+           Returning false ends the search on the spot, in which case
+           inexact_search returns false as well.
 
            To get the position of the matches in the original string,
            use the resolve(...) method of the class.
         */
-        template <class t_data>
-        void inexact_search(typename std::string::const_iterator begin,
-                            typename std::string::const_iterator end,
-                            size_t mismatches, 
-                            const std::function<void(size_t, size_t, size_t, t_data&)> &callback,
-                            t_data& data) const;
-
-        template <class t_data>
-        void inexact_search(typename std::string::const_iterator begin,
+        template <class t_visitor>
+        bool inexact_search(typename std::string::const_iterator begin,
                             typename std::string::const_iterator end,
-                            size_t sp, size_t ep, size_t mismatches, size_t k,
-                            const std::function<void(size_t, size_t, size_t, t_data&)> &callback,
-                            t_data& data) const;
+                            size_t mismatches, t_visitor& visitor) const;
 
         /*
-          PAM aware variant of inexact search where the PAM must match
-          exactly on the right end. 
+          PAM aware variant of inexact search where one of the PAMs
+          must match exactly on the given side of the query. The
+          wildcard 'N' is only honored inside the PAMs. If frontier
+          is given, it is replaced by the frontier of the search.
         */
-        template <class t_data>
-        void inexact_search(const std::string& query,
-                            ssize_t position,
-                            size_t sp, size_t ep,
+        template <class t_visitor>
+        bool inexact_search(const std::string& query,
                             const std::vector<std::string> &pams,
-                            size_t mismatches, size_t k,
-                            const std::function<void(size_t, size_t, size_t, t_data&)> &callback,
-                            t_data& data) const;
+                            pam_side side, size_t mismatches,
+                            t_visitor& visitor, search_frontier* frontier = nullptr) const;
 
-        template <class t_data>
-        void inexact_search(const std::string& query,
-                            const std::vector<std::string> &pams,
-                            size_t mismatches, 
-                            const std::function<void(size_t, size_t, size_t, t_data&)> &callback,
-                            t_data& data) const;
-    };
+        /*
+          Continues a PAM aware search from the frontier it recorded
+          up to a budget of mismatches, visiting only the matches with
+          more mismatches than the frontier's budget. The query, PAMs
+          and side must be those of the search.
+        */
+        template <class t_visitor>
+        bool extend_search(const std::string& query,
+                           const std::vector<std::string> &pams,
+                           pam_side side, size_t mismatches,
+                           const search_frontier& frontier, t_visitor& visitor) const;
 
-    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
-    template <class t_data>
-    void genome_index<t_wt, t_dens, t_inv_dens>::inexact_search(typename std::string::const_iterator begin,
-                                                                typename std::string::const_iterator end,
-                                                                size_t sp, size_t ep,
-                                                                size_t mismatches,
-                                                                size_t k,
-                                                                const std::function<void(size_t, size_t, size_t, t_data&)> &callback,
-                                                                t_data& data) const {
-        if (begin == end) {
-            callback(sp, ep, k, data);
-            return;
-        }
+    private:
+        static const uint64_t uncoded = static_cast<uint64_t>(-1);
 
-        char c = *(end - 1);
+        /*
+          Computes the interval of the string matched by f extended
+          on the left by c, returning false when it is empty. The
+          table answers while the matched string is shorter than its
+          depth and made of ACGT only; rank queries do the rest.
+        */
+        bool extend(const search_frame& f, char c,
+                    size_t& sp, size_t& ep, uint64_t& code) const {
+            uint8_t value = interval_table::code_of(c);
+            if (f.matched < table.depth() && f.code != uncoded && value != interval_table::no_code) {
+                code = f.code + (static_cast<uint64_t>(value) << (2 * f.matched));
+                return table.lookup(f.matched + 1, code, sp, ep);
+            }
 
-        size_t occ_before = csa.rank_bwt(sp, c);
-        size_t occ_within = csa.rank_bwt(ep + 1, c) - occ_before;
+            code = uncoded;
+            size_t occ_before = csa.rank_bwt(f.sp, c);
+            size_t occ_within = csa.rank_bwt(f.ep + 1, c) - occ_before;
+            if (occ_within == 0) return false;
 
-        if (occ_within > 0) {
-            size_t sp_prime = csa.C[csa.char2comp[c]] + occ_before;
-            size_t ep_prime = sp_prime + occ_within - 1;
-            inexact_search(begin, end - 1, sp_prime, ep_prime, mismatches,
-                           k, callback, data);
+            sp = csa.C[csa.char2comp[c]] + occ_before;
+            ep = sp + occ_within - 1;
+            return true;
         }
 
-        size_t cost = 1;
-        if (k >= mismatches && c != 'N') return;
-        if (c == 'N') cost = 0;
+        template <size_t t_mismatches, bool t_wildcard, class t_visitor>
+        bool search_kernel(const char* query, size_t length,
+                           const std::vector<std::string>* pams, pam_side side,
+                           size_t mismatches, t_visitor& visitor,
+                           search_frontier* frontier, const search_frontier* resume) const;
+
+        template <bool t_wildcard, class t_visitor>
+        bool dispatch_search(const char* query, size_t length,
+                             const std::vector<std::string>* pams, pam_side side,
+                             size_t mismatches, t_visitor& visitor,
+                             search_frontier* frontier = nullptr,
+                             const search_frontier* resume = nullptr) const;
+    };
 
-        for (size_t i = 0; i < search_alphabet_size; i++) {
-            if (search_alphabet[i] == c) continue;
+    /*
+      Depth first backward search driven by an explicit, fixed size
+      stack. Frames for the query and for the PAM stage share the
+      stack. Whichever stage comes first in the backward search
+      hands over to the other when its position drops below zero:
+      a finished query fans out into one frame per PAM, and a
+      finished PAM continues into the query. PAM frames are matched
+      exactly (modulo wildcards) without spending mismatches.
+
+      Children are pushed so that the exact character is popped
+      first, matching the order of the recursive formulation. Each
+      frame carries the table code of the string it has matched so
+      that the top levels come out of the interval table.
+
+      Frames that are out of mismatches on a query character are
+      added to the frontier, if any. A search resumed from a
+      frontier starts from the mismatching children of each of its
+      frames in turn, their exact children having been searched
+      already.
+    */
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <size_t t_mismatches, bool t_wildcard, class t_visitor>
+    bool genome_index<t_wt, t_dens, t_inv_dens>::search_kernel(const char* query, size_t length,
+                                                               const std::vector<std::string>* pams,
+                                                               pam_side side,
+                                                               size_t mismatches,
+                                                               t_visitor& visitor,
+                                                               search_frontier* frontier,
+                                                               const search_frontier* resume) const {
+        const size_t budget = t_mismatches == dynamic_mismatches ? mismatches : t_mismatches;
+
+        size_t depth = length;
+        size_t npams = 0;
+        if (pams != nullptr) {
+            npams = pams->size();
+            size_t longest = 0;
+            for (const auto& pam : *pams) longest = std::max(longest, pam.length());
+            depth += longest;
+        }
 
-            char a = search_alphabet[i];
+        if (4 * depth + npams + 1 > search_stack_size) {
+            throw std::length_error("inexact_search: query too long for search stack");
+        }
 
-            occ_before = csa.rank_bwt(sp, a);
-            occ_within = csa.rank_bwt(ep + 1, a) - occ_before;
+        std::array<search_frame, search_stack_size> stack;
+        size_t top = 0;
 
-            if (occ_within > 0) {
-                size_t sp_prime = csa.C[csa.char2comp[a]] + occ_before;
-                size_t ep_prime = sp_prime + occ_within - 1;
-                inexact_search(begin, end - 1, sp_prime, ep_prime, mismatches,
-                               k + cost, callback, data);
-            }
+        if (frontier) {
+            frontier->mismatches = budget;
+            frontier->frames.clear();
         }
-    }
 
-    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
-    template <class t_data>
-    void genome_index<t_wt, t_dens, t_inv_dens>::inexact_search(typename std::string::const_iterator begin,
-                                                                typename std::string::const_iterator end,
-                                                                size_t mismatches,
-                                                                const std::function<void(size_t, size_t, size_t, t_data&)> &callback,
-                                                                t_data& data) const {
+        size_t resumed = 0;
+        if (resume == nullptr) {
+            if (side == pam_side::right && npams > 0) {
+                for (ssize_t p = npams - 1; p >= 0; p--) {
+                    ssize_t last = (*pams)[p].length() - 1;
+                    stack[top++] = {0, csa.size() - 1, last, 0, p, 0, 0};
+                }
+            } else {
+                stack[top++] = {0, csa.size() - 1, static_cast<ssize_t>(length) - 1, 0, -1, 0, 0};
+            }
+        }
 
-        inexact_search(begin, end, 0, csa.size() - 1, mismatches, 0, callback, data);
-    }
+        while (true) {
+            search_frame f;
+            bool mismatches_only = false;
+            if (top > 0) {
+                f = stack[--top];
+            } else if (resume != nullptr && resumed < resume->frames.size()) {
+                f = resume->frames[resumed++];
+                mismatches_only = true;
+            } else {
+                break;
+            }
 
-    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
-    template <class t_data>
-    void genome_index<t_wt, t_dens, t_inv_dens>::inexact_search(const std::string& query,
-                                                                ssize_t position,
-                                                                size_t sp, size_t ep,
-                                                                const std::vector<std::string> &pams,
-                                                                size_t mismatches, 
-                                                                size_t k, 
-                                                                const std::function<void(size_t, size_t, size_t, t_data&)> &callback,
-                                                                t_data& data) const {
-        if (position < 0) {
-
-            std::function<void(size_t, size_t, size_t, t_data&)> matching_callback =
-                [k, callback](size_t sp, size_t ep, size_t mismatches, t_data& data) {
-                    return callback(sp, ep, k, data);
-                } ;
-
-            for (const auto& pam : pams) {
-                inexact_search(pam.begin(), pam.end(), sp, ep, 0, 0, matching_callback, data);
+            if (f.position < 0) {
+                bool query_done = f.pam < 0;
+
+                if (query_done && side == pam_side::left && npams > 0) {
+                    for (ssize_t p = npams - 1; p >= 0; p--) {
+                        ssize_t last = (*pams)[p].length() - 1;
+                        stack[top++] = {f.sp, f.ep, last, f.k, p, f.code, f.matched};
+                    }
+                    continue;
+                }
+
+                if (!query_done && side == pam_side::right) {
+                    stack[top++] = {f.sp, f.ep, static_cast<ssize_t>(length) - 1, f.k, -1,
+                                    f.code, f.matched};
+                    continue;
+                }
+
+                if (!visitor(f.sp, f.ep, f.k)) return false;
+                continue;
             }
 
-            return;
-        }
+            bool in_pam = f.pam >= 0;
+            char c = in_pam ? (*pams)[f.pam][f.position] : query[f.position];
+            bool wildcard = c == 'N' && (in_pam || t_wildcard);
 
-        char c = query[position];
+            size_t cost = wildcard ? 0 : 1;
+            bool branch = wildcard || (!in_pam && f.k < budget);
+            if (!branch && !in_pam && frontier != nullptr) frontier->frames.push_back(f);
 
-        size_t occ_before = csa.rank_bwt(sp, c);
-        size_t occ_within = csa.rank_bwt(ep + 1, c) - occ_before;
+            size_t sp_prime, ep_prime;
+            uint64_t code;
 
-        if (occ_within > 0) {
-            size_t sp_prime = csa.C[csa.char2comp[c]] + occ_before;
-            size_t ep_prime = sp_prime + occ_within - 1;
-            inexact_search(query, position - 1, sp_prime, ep_prime, pams,
-                           mismatches, k, callback, data);
-        }
+            if (branch) {
+                for (ssize_t i = search_alphabet_size - 1; i >= 0; i--) {
+                    char a = search_alphabet[i];
+                    if (a == c) continue;
 
-        size_t cost = 1;
-        if (k >= mismatches) return;
+                    if (extend(f, a, sp_prime, ep_prime, code)) {
+                        stack[top++] = {sp_prime, ep_prime, f.position - 1, f.k + cost, f.pam,
+                                        code, f.matched + 1};
+                    }
+                }
+            }
 
-        for (size_t i = 0; i < search_alphabet_size; i++) {
-            if (search_alphabet[i] == c) continue;
+            if (!mismatches_only && extend(f, c, sp_prime, ep_prime, code)) {
+                stack[top++] = {sp_prime, ep_prime, f.position - 1, f.k, f.pam,
+                                code, f.matched + 1};
+            }
+        }
 
-            char a = search_alphabet[i];
+        return true;
+    }
 
-            occ_before = csa.rank_bwt(sp, a);
-            occ_within = csa.rank_bwt(ep + 1, a) - occ_before;
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    void genome_index<t_wt, t_dens, t_inv_dens>::resolve(const std::vector<size_t>& rows,
+                                                         std::vector<size_t>& positions) const {
+        struct walk {
+            size_t row;
+            size_t steps;
+            size_t index; // into rows and positions
+        };
+
+        std::array<walk, locate_batch_size> walks;
+        size_t active = 0;
+        size_t next = 0;
+
+        positions.resize(rows.size());
+
+        while (active > 0 || next < rows.size()) {
+            while (active < locate_batch_size && next < rows.size()) {
+                walks[active++] = {rows[next], 0, next};
+                prefetch_bwt(csa.wavelet_tree, rows[next]);
+                next++;
+            }
 
-            if (occ_within > 0) {
-                size_t sp_prime = csa.C[csa.char2comp[a]] + occ_before;
-                size_t ep_prime = sp_prime + occ_within - 1;
-                inexact_search(query, position - 1, sp_prime, ep_prime, pams,
-                               mismatches, k + cost, callback, data);
+            for (size_t w = 0; w < active;) {
+                walk& k = walks[w];
+                if (csa.sa_sample.is_sampled(k.row)) {
+                    size_t position = csa.sa_sample[k.row] + k.steps;
+                    positions[k.index] = position < csa.size() ? position : position - csa.size();
+                    walks[w] = walks[--active];
+                    continue;
+                }
+
+                k.row = csa.lf[k.row];
+                k.steps++;
+                prefetch_bwt(csa.wavelet_tree, k.row);
+                w++;
             }
         }
     }
 
     template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
-    template <class t_data>
-    void genome_index<t_wt, t_dens, t_inv_dens>::inexact_search(const std::string& query,
+    template <bool t_wildcard, class t_visitor>
+    bool genome_index<t_wt, t_dens, t_inv_dens>::dispatch_search(const char* query, size_t length,
+                                                                 const std::vector<std::string>* pams,
+                                                                 pam_side side,
+                                                                 size_t mismatches,
+                                                                 t_visitor& visitor,
+                                                                 search_frontier* frontier,
+                                                                 const search_frontier* resume) const {
+        static_assert(max_specialized_mismatches == 4,
+                      "dispatch_search must cover every specialized budget");
+
+        switch (mismatches) {
+        case 0:
+            return search_kernel<0, t_wildcard>(query, length, pams, side, mismatches, visitor,
+                                                frontier, resume);
+        case 1:
+            return search_kernel<1, t_wildcard>(query, length, pams, side, mismatches, visitor,
+                                                frontier, resume);
+        case 2:
+            return search_kernel<2, t_wildcard>(query, length, pams, side, mismatches, visitor,
+                                                frontier, resume);
+        case 3:
+            return search_kernel<3, t_wildcard>(query, length, pams, side, mismatches, visitor,
+                                                frontier, resume);
+        case 4:
+            return search_kernel<4, t_wildcard>(query, length, pams, side, mismatches, visitor,
+                                                frontier, resume);
+        default:
+            return search_kernel<dynamic_mismatches, t_wildcard>(query, length, pams, side, mismatches,
+                                                                 visitor, frontier, resume);
+        }
+    }
+
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <class t_visitor>
+    bool genome_index<t_wt, t_dens, t_inv_dens>::inexact_search(typename std::string::const_iterator begin,
+                                                                typename std::string::const_iterator end,
+                                                                size_t mismatches,
+                                                                t_visitor& visitor) const {
+        if (begin == end) {
+            return visitor(0, csa.size() - 1, 0);
+        }
+
+        return dispatch_search<true>(&*begin, end - begin, nullptr, pam_side::left, mismatches, visitor);
+    }
+
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <class t_visitor>
+    bool genome_index<t_wt, t_dens, t_inv_dens>::inexact_search(const std::string& query,
                                                                 const std::vector<std::string> &pams,
-                                                                size_t mismatches, 
-                                                                const std::function<void(size_t, size_t, size_t, t_data&)> &callback,
-                                                                t_data& data) const {
-        inexact_search(query, query.length() - 1, 0, csa.size() - 1, pams,
-                       mismatches, 0, callback, data);
+                                                                pam_side side,
+                                                                size_t mismatches,
+                                                                t_visitor& visitor,
+                                                                search_frontier* frontier) const {
+        return dispatch_search<false>(query.data(), query.length(), &pams, side, mismatches, visitor,
+                                      frontier);
+    }
+
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    template <class t_visitor>
+    bool genome_index<t_wt, t_dens, t_inv_dens>::extend_search(const std::string& query,
+                                                               const std::vector<std::string> &pams,
+                                                               pam_side side,
+                                                               size_t mismatches,
+                                                               const search_frontier& frontier,
+                                                               t_visitor& visitor) const {
+        if (mismatches <= frontier.mismatches) return true;
+
+        return dispatch_search<false>(query.data(), query.length(), &pams, side, mismatches, visitor,
+                                      nullptr, &frontier);
     }
 
 };
@@ -0,0 +1,118 @@
+#ifndef INDEX_PROFILE_H
+#define INDEX_PROFILE_H
+
+#include <sdsl/io.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+namespace genomics {
+
+    /*
+      Trade-offs between the speed of locating a match and the memory
+      of the forward index, chosen at runtime. A profile fixes the
+      SA and ISA sample densities of the index: a match is located
+      in up to sa_dens LF steps, and the SA samples take n / sa_dens
+      words of log n bits.
+    */
+    enum class index_profile { compact, balanced, fast };
+
+    template <index_profile t_profile>
+    struct profile_densities;
+
+    template <>
+    struct profile_densities<index_profile::compact> {
+        static const uint32_t sa_dens = 256;
+        static const uint32_t isa_dens = 16384;
+    };
+
+    template <>
+    struct profile_densities<index_profile::balanced> {
+        static const uint32_t sa_dens = 64;
+        static const uint32_t isa_dens = 8192;
+    };
+
+    template <>
+    struct profile_densities<index_profile::fast> {
+        static const uint32_t sa_dens = 16;
+        static const uint32_t isa_dens = 8192;
+    };
+
+    inline std::string profile_name(index_profile profile) {
+        switch (profile) {
+        case index_profile::compact: return "compact";
+        case index_profile::balanced: return "balanced";
+        case index_profile::fast: return "fast";
+        }
+        return "unknown";
+    }
+
+    inline index_profile parse_index_profile(const std::string& name) {
+        if (name == "compact") return index_profile::compact;
+        if (name == "balanced") return index_profile::balanced;
+        if (name == "fast") return index_profile::fast;
+        throw std::runtime_error("unknown index profile \"" + name + "\"");
+    }
+
+    /*
+      Index files start with a tag, the profile they were built with
+      and its sample densities, followed by the serialized CSA. The
+      densities are checked against those of the CSA type on load,
+      since sdsl would otherwise read samples of another density
+      without complaint and locate every match at a wrong position.
+    */
+    const uint64_t index_file_tag = 0x31464f5250534741ULL; // "AGSPROF1"
+
+    template <class t_csa>
+    void store_index(const t_csa& csa, index_profile profile, const std::string& file) {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("could not create index file \"" + file + "\"");
+        }
+
+        uint64_t tag = index_file_tag;
+        uint32_t id = static_cast<uint32_t>(profile);
+        uint32_t sa_dens = t_csa::sa_sample_dens;
+        uint32_t isa_dens = t_csa::isa_sample_dens;
+        sdsl::write_member(tag, out);
+        sdsl::write_member(id, out);
+        sdsl::write_member(sa_dens, out);
+        sdsl::write_member(isa_dens, out);
+        csa.serialize(out);
+    }
+
+    /*
+      Returns false when the file does not exist, and throws when it
+      was not built with the given profile.
+    */
+    template <class t_csa>
+    bool load_index(t_csa& csa, index_profile profile, const std::string& file) {
+        std::ifstream in(file, std::ios::binary);
+        if (!in) return false;
+
+        uint64_t tag = 0;
+        uint32_t id = 0, sa_dens = 0, isa_dens = 0;
+        sdsl::read_member(tag, in);
+        sdsl::read_member(id, in);
+        sdsl::read_member(sa_dens, in);
+        sdsl::read_member(isa_dens, in);
+
+        if (!in || tag != index_file_tag) {
+            throw std::runtime_error("index file \"" + file + "\" does not record its profile,"
+                                     " remove it to rebuild");
+        }
+
+        if (id != static_cast<uint32_t>(profile) ||
+            sa_dens != t_csa::sa_sample_dens || isa_dens != t_csa::isa_sample_dens) {
+            throw std::runtime_error("index file \"" + file + "\" was not built with the "
+                                     + profile_name(profile) + " profile, remove it to rebuild");
+        }
+
+        csa.load(in);
+        return true;
+    }
+};
+
+#endif /* INDEX_PROFILE_H */
@@ -0,0 +1,129 @@
+#ifndef INTERVAL_TABLE_H
+#define INTERVAL_TABLE_H
+
+#include <sdsl/int_vector.hpp>
+#include <sdsl/suffix_arrays.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+namespace genomics {
+
+    /*
+      Suffix array intervals of every string over ACGT of length one
+      up to the depth of the table, so that the top levels of a
+      backward search are table lookups instead of rank queries.
+
+      Strings of length l are numbered by reading them right to left
+      in base four (A = 0, C = 1, G = 2, T = 3). A backward search
+      prepends characters, so the code of the extended string is
+      code + c * 4^l and is carried along cheaply. The strings of
+      each length are stored after those of all shorter lengths, and
+      every interval is kept as its start and size in bit-compressed
+      vectors, with a size of zero for strings absent from the text.
+    */
+    class interval_table {
+    public:
+        typedef sdsl::int_vector<>::size_type size_type;
+
+        /* Numeric value of a character in a code, or no_code for
+           characters outside of ACGT. */
+        static const uint8_t no_code = 4;
+
+        static uint8_t code_of(char c) {
+            switch (c) {
+            case 'A': return 0;
+            case 'C': return 1;
+            case 'G': return 2;
+            case 'T': return 3;
+            default: return no_code;
+            }
+        }
+
+        interval_table() {}
+
+        /* Number of characters covered; zero for an empty table. */
+        size_t depth() const { return depth_; }
+
+        /*
+          Looks up the interval of the string of the given length and
+          code, returning false when it does not occur in the text.
+        */
+        bool lookup(size_t length, uint64_t code, size_t& sp, size_t& ep) const {
+            uint64_t i = offset(length) + code;
+            size_t n = sizes[i];
+            if (n == 0) return false;
+            sp = starts[i];
+            ep = sp + n - 1;
+            return true;
+        }
+
+        template <class t_csa>
+        void construct(const t_csa& csa, size_t depth);
+
+        size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr,
+                            std::string name = "") const {
+            sdsl::structure_tree_node* child =
+                sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
+            size_type written = sdsl::write_member(depth_, out, child, "depth");
+            written += starts.serialize(out, child, "starts");
+            written += sizes.serialize(out, child, "sizes");
+            sdsl::structure_tree::add_size(child, written);
+            return written;
+        }
+
+        void load(std::istream& in) {
+            sdsl::read_member(depth_, in);
+            starts.load(in);
+            sizes.load(in);
+        }
+
+    private:
+        size_t depth_ = 0;
+        sdsl::int_vector<> starts;
+        sdsl::int_vector<> sizes;
+
+        /* Index of the first string of the given length, that is
+           4 + 16 + ... + 4^(length - 1). */
+        static uint64_t offset(size_t length) {
+            return ((uint64_t(1) << (2 * length)) - 4) / 3;
+        }
+    };
+
+    /*
+      Fills the table level by level, extending each string that
+      occurs in the text by one character to the left with a single
+      backward search step. Strings that do not occur are never
+      extended, and their extensions keep a size of zero.
+    */
+    template <class t_csa>
+    void interval_table::construct(const t_csa& csa, size_t depth) {
+        const char* alphabet = "ACGT";
+
+        depth_ = depth;
+        uint8_t width = sdsl::bits::hi(csa.size()) + 1;
+        starts = sdsl::int_vector<>(offset(depth + 1), 0, width);
+        sizes = sdsl::int_vector<>(offset(depth + 1), 0, width);
+
+        for (size_t length = 1; length <= depth; length++) {
+            uint64_t strings = uint64_t(1) << (2 * (length - 1));
+            for (uint64_t code = 0; code < strings; code++) {
+                size_t sp = 0, ep = csa.size() - 1;
+                if (length > 1 && !lookup(length - 1, code, sp, ep)) continue;
+
+                for (uint64_t c = 0; c < 4; c++) {
+                    size_t sp_prime, ep_prime;
+                    size_t n = sdsl::backward_search(csa, sp, ep, alphabet[c], sp_prime, ep_prime);
+                    if (n == 0) continue;
+
+                    uint64_t i = offset(length) + code + (c << (2 * (length - 1)));
+                    starts[i] = sp_prime;
+                    sizes[i] = n;
+                }
+            }
+        }
+    }
+};
+
+#endif /* INTERVAL_TABLE_H */
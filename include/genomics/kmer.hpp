@@ -20,6 +20,22 @@ namespace genomics {
         */
     public:
 	virtual size_t get_next_kmer(kmer& kmer) = 0;
+
+        /*
+           Replaces the contents of kmers with up to count of the next
+           kmers, returning how many there are; 0 if no kmers are
+           left.
+        */
+        virtual size_t get_next_kmers(std::vector<kmer>& kmers, size_t count) {
+            kmers.clear();
+
+            kmer k;
+            while (kmers.size() < count && get_next_kmer(k)) {
+                kmers.push_back(k);
+            }
+
+            return kmers.size();
+        }
     };
 
     /* 
@@ -32,21 +48,50 @@ namespace genomics {
        backward strand of it.
 
        The PAM supports the wildcard 'N' matching any nucleotide.
+
+       The sequence is read in large blocks and a window of k + |PAM|
+       characters slides over them. The PAM and its reverse complement
+       are compared in place, and strings are only built for the
+       windows that match.
+
+       A producer may be limited to the windows starting in [start,
+       end), which still read up to k + |PAM| - 1 characters past end.
+       Producers over consecutive ranges together yield the kmers of a
+       producer over the whole sequence, in the same order.
     */
     class seq_kmer_producer : public kmer_producer {
     private:
+        static const size_t block_size = 1 << 22;
+
 	std::unique_ptr<std::istream> sequence;
-        std::string pam;
+        std::string pam, pam_c;
         genome_structure gs;
         size_t k, min_chr_length;
 
+        /* Absolute position of the next window, and of the first
+           window not to produce. */
         size_t stream_position = 0;
-        std::vector<char> kmer_buffer;
+        size_t end_position;
+
+        /* Characters [buffer_start, buffer_start + buffer_length) of
+           the sequence. Refills keep the characters from the current
+           window on, so a window never straddles two reads. */
+        std::vector<char> buffer;
+        size_t buffer_start = 0;
+        size_t buffer_length = 0;
+
+        /* Chromosome holding stream_position and its absolute end. */
+        size_t chr = 0;
+        size_t chr_end = 0;
+
         std::queue<kmer> kmer_queue;
 
+        bool fill_buffer();
+
     public:
         seq_kmer_producer(const std::string& sequence_file, genome_structure gs,
-                          size_t k, const std::string &pam, size_t min_chr_length);
+                          size_t k, const std::string &pam, size_t min_chr_length,
+                          size_t start = 0, size_t end = static_cast<size_t>(-1));
         seq_kmer_producer() = delete;
 
         /* 
@@ -57,6 +102,38 @@ namespace genomics {
         size_t get_next_kmer(kmer& out_kmer);
     };
 
+    /*
+       Produces the kmers of one shard of the sequence, for building
+       a database over several jobs. The window starts are cut into
+       stripes of stripe_size, and shard i of n takes stripes i, i + n,
+       i + 2n, ... Spreading every shard over the whole genome keeps
+       their work balanced even where repeats cluster. Together the
+       shards yield every kmer of a seq_kmer_producer exactly once.
+    */
+    class shard_kmer_producer : public kmer_producer {
+    private:
+        std::string sequence_file;
+        std::string pam;
+        genome_structure gs;
+        size_t k, min_chr_length;
+        size_t shard, shards, stripe_size, sequence_length;
+
+        size_t next_stripe;
+        size_t kmers = 0;
+        std::unique_ptr<seq_kmer_producer> stripe;
+
+    public:
+        shard_kmer_producer(const std::string& sequence_file, genome_structure gs,
+                            size_t k, const std::string &pam, size_t min_chr_length,
+                            size_t shard, size_t shards, size_t stripe_size);
+        shard_kmer_producer() = delete;
+
+        size_t get_next_kmer(kmer& out_kmer);
+
+        /* Number of kmers produced so far. */
+        size_t produced() const { return kmers; }
+    };
+
     /* 
        A kmer_producer constructed on top of a kmers file that contains a
        list of kmers seperated by newlines.
@@ -0,0 +1,48 @@
+/*
+   Merges the SAM databases of a sharded build into one database.
+*/
+
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "genomics/off_targets.hpp"
+#include "genomics/structures.hpp"
+
+namespace genomics {
+    /* Reads the header lines of a SAM file, leaving the stream at its
+       first record. */
+    std::vector<std::string> read_sam_header(std::istream& sam_is);
+
+    /* The reference sequences listed in a SAM header, in order. */
+    genome_structure read_sam_genome(const std::vector<std::string>& header);
+
+    /*
+      Checks that the databases are the complete set of shards of one
+      build when any of them has a shard manifest, throwing a
+      std::runtime_error describing the first problem otherwise.
+      Databases without manifests are not checked.
+    */
+    void check_shard_manifests(const std::vector<std::string>& databases);
+
+    /*
+      Merges SAM databases with the same reference sequences into one
+      database sorted by coordinate, streaming through the inputs.
+      Records are sorted in runs of at most memory_budget bytes, runs
+      that do not fit are spilled to temporary files next to the
+      output, and the runs are then merged k-way. A region index of
+      the output is written next to it for view. If reencode is set,
+      the off-targets of every record are rewritten in the given
+      encoding. Throws a std::runtime_error if the headers disagree,
+      an off-target tag is malformed or a file cannot be read or
+      written.
+    */
+    void merge_sam_files(const std::vector<std::string>& databases, const std::string& output,
+                         size_t memory_budget, bool reencode = false,
+                         off_target_encoding encoding = off_target_encoding::hex);
+};
+
+#endif /* MERGE_H */
@@ -0,0 +1,74 @@
+/*
+   Encodes the off-targets of a guide as the value of a SAM tag, and
+   decodes them again.
+*/
+
+#ifndef OFF_TARGETS_H
+#define OFF_TARGETS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace genomics {
+
+    /*
+      The hex encoding, in the of tag, writes every off-target as its
+      8 bytes, followed at each distance by the distance and a
+      delimiter, 32 hex digits per off-target. The compact encoding,
+      in the oc tag, writes for each distance with off-targets, and
+      for the last distance, the distance, their number and their
+      positions, delta coded as varints with the strand in the lowest
+      bit. On a human genome that takes about 8 hex digits per
+      off-target. Both list the off-targets at a distance by position,
+      so converting from one encoding to the other and back gives the
+      same value.
+    */
+    enum class off_target_encoding { hex, compact };
+
+    /* The name of the SAM tag holding off-targets in the encoding. */
+    const char* off_target_tag(off_target_encoding encoding);
+
+    /*
+      Appends off-targets, grouped by distance, to a buffer as the hex
+      string value of their tag. The encoder keeps a scratch buffer,
+      so a copy should be used by each thread.
+    */
+    class off_target_encoder {
+    public:
+        off_target_encoder(int64_t delim, off_target_encoding encoding)
+            : delim(delim), encoding(encoding) {}
+
+        off_target_encoding get_encoding() const { return encoding; }
+
+        void append(std::string& out, const std::vector<std::vector<int64_t>>& off_targets) const;
+
+        /* Appends the compact encoding as raw bytes instead, for
+           binary formats. */
+        void append_binary(std::string& out, const std::vector<std::vector<int64_t>>& off_targets) const;
+
+    private:
+        int64_t delim;
+        off_target_encoding encoding;
+        mutable std::vector<uint64_t> keys;
+
+        void append_compact(std::string& out, const std::vector<std::vector<int64_t>>& off_targets,
+                            bool hex) const;
+
+        /* Sorts the positions into keys, by position and then strand. */
+        void sort_keys(const std::vector<int64_t>& positions) const;
+    };
+
+    /*
+      Decodes the value of an of or oc tag into the off-targets at each
+      distance, up to the last distance encoded. Throws a
+      std::runtime_error if the value is malformed.
+    */
+    std::vector<std::vector<int64_t>> decode_off_targets(const std::string& value,
+                                                         off_target_encoding encoding);
+
+    /* Decodes off-targets written by append_binary. */
+    std::vector<std::vector<int64_t>> decode_binary_off_targets(const char* data, size_t length);
+};
+
+#endif /* OFF_TARGETS_H */
@@ -0,0 +1,131 @@
+/*
+   Building blocks of the build pipeline: bounded queues between its
+   stages and the time each stage spends working or waiting on them.
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace genomics {
+
+    /*
+      A queue of at most capacity items between two stages. A stage
+      that runs ahead blocks on push until the next one catches up,
+      which bounds the memory held between stages. Closing the queue
+      lets the consumers drain it and then see its end.
+    */
+    template <class T>
+    class bounded_queue {
+    public:
+        explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+        bounded_queue(const bounded_queue& other) = delete;
+        bounded_queue& operator=(const bounded_queue& other) = delete;
+
+        /* Blocks while the queue is full. Returns false, dropping
+           the item, if the queue was closed. */
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(mtx);
+            not_full.wait(lock, [this]() { return closed || items.size() < capacity; });
+            if (closed) return false;
+
+            items.push_back(std::move(item));
+            not_empty.notify_one();
+            return true;
+        }
+
+        /* Blocks while the queue is empty. Returns false once it is
+           closed and drained. */
+        bool pop(T& item) {
+            std::unique_lock<std::mutex> lock(mtx);
+            not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+            if (items.empty()) return false;
+
+            item = std::move(items.front());
+            items.pop_front();
+            not_full.notify_one();
+            return true;
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+            not_full.notify_all();
+            not_empty.notify_all();
+        }
+
+    private:
+        size_t capacity;
+        std::deque<T> items;
+        bool closed = false;
+
+        std::mutex mtx;
+        std::condition_variable not_full;
+        std::condition_variable not_empty;
+    };
+
+    /*
+      Time the threads of a stage spent working, summed over its
+      threads, while waiting on other stages does not count.
+    */
+    class stage_stats {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        void add(clock::duration busy) {
+            busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count();
+            threads++;
+        }
+
+        /* Fraction of the elapsed time the threads of the stage spent
+           working, on average. */
+        double utilization(clock::duration elapsed) const {
+            double available = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+            available *= threads;
+            return available == 0 ? 0.0 : busy_ns / available;
+        }
+
+    private:
+        std::atomic<uint64_t> busy_ns{0};
+        std::atomic<size_t> threads{0};
+    };
+
+    /*
+      Times one thread of a stage from construction to destruction,
+      where it adds itself to the stats. Calls made through wait
+      count as waiting, everything else as working.
+    */
+    class stage_timer {
+    public:
+        explicit stage_timer(stage_stats& stats)
+            : stats(stats), start(stage_stats::clock::now()), waiting(0)
+        {}
+        stage_timer(const stage_timer& other) = delete;
+        stage_timer& operator=(const stage_timer& other) = delete;
+
+        ~stage_timer() {
+            stats.add(stage_stats::clock::now() - start - waiting);
+        }
+
+        template <class t_call>
+        auto wait(t_call call) -> decltype(call()) {
+            auto before = stage_stats::clock::now();
+            auto result = call();
+            waiting += stage_stats::clock::now() - before;
+            return result;
+        }
+
+    private:
+        stage_stats& stats;
+        stage_stats::clock::time_point start;
+        stage_stats::clock::duration waiting;
+    };
+};
+
+#endif /* PIPELINE_H */
@@ -1,6 +1,9 @@
 #ifndef PROCESS_H
 #define PROCESS_H
 
+#include <algorithm>
+#include <functional>
+#include <map>
 #include <set>
 #include <tuple>
 
@@ -8,17 +11,40 @@
 #include "genomics/kmer.hpp"
 #include "genomics/sequences.hpp"
 #include "genomics/sam.hpp"
+#include "genomics/bam.hpp"
+#include "genomics/scheduler.hpp"
+#include "genomics/sorted_output.hpp"
 
 namespace genomics {
+    /*
+      Number of guides a worker processes before handing their
+      records to the writer as one batch.
+    */
+    const size_t kmer_batch_size = 64;
+
+    /* Records of consecutive guides of one window, in SAM or BAM
+       format, passed from a worker to the writer, with the key of
+       each record for sorted output. */
+    struct record_batch {
+        size_t window, window_size, window_start;
+        size_t guides;
+        std::string records;
+        std::vector<record_key> keys;
+    };
+
     namespace {
-        void off_target_enumerator(size_t sp, size_t ep, size_t k,
-                                   std::vector<std::set<std::tuple<size_t, size_t>>> &off_targets_bwt) {
-            off_targets_bwt[k].insert(std::make_tuple(sp, ep));
-        }
+        typedef std::vector<std::set<std::tuple<size_t, size_t>>> bwt_intervals;
+
+        struct off_target_enumerator {
+            bwt_intervals &off_targets_bwt;
 
-        std::function<void(size_t, size_t, size_t, std::vector<std::set<std::tuple<size_t, size_t>>>&)> callback = off_target_enumerator;
+            bool operator()(size_t sp, size_t ep, size_t k) {
+                off_targets_bwt[k].insert(std::make_tuple(sp, ep));
+                return true;
+            }
+        };
 
-        size_t count_off_targets(size_t k, const std::vector<std::set<std::tuple<size_t, size_t>>> &off_targets_bwt) {
+        size_t count_off_targets(size_t k, const bwt_intervals &off_targets_bwt) {
             size_t count = 0;
             for (const auto& sp_ep : off_targets_bwt[k]) {
                 size_t sp = std::get<0>(sp_ep);
@@ -28,113 +54,205 @@ namespace genomics {
             return count;
         }
 
-        void off_target_counter(size_t sp, size_t ep, size_t k, size_t &count) {
-            count += ep - sp + 1;
+        /* Appends every BWT position in the intervals to rows, by
+           distance and then in interval order. */
+        void append_rows(const bwt_intervals &off_targets_bwt, std::vector<size_t> &rows) {
+            for (const auto& intervals : off_targets_bwt) {
+                for (const auto& sp_ep : intervals) {
+                    size_t sp = std::get<0>(sp_ep);
+                    size_t ep = std::get<1>(sp_ep);
+                    for (size_t j = sp; j <= ep; j++) rows.push_back(j);
+                }
+            }
         }
 
-        std::function<void(size_t, size_t, size_t, size_t&)> counting_callback = off_target_counter;
+        /* Records off-targets by distance like off_target_enumerator,
+           while counting the off-targets at a distance at or below
+           the threshold, which may lie beyond the distances kept.
+           With a positive threshold the search stops as soon as the
+           count exceeds one, since the guide is then discarded. */
+        struct off_target_collector {
+            bwt_intervals &off_targets_bwt;
+            int threshold;
+            size_t &count;
+
+            bool operator()(size_t sp, size_t ep, size_t k) {
+                if (k < off_targets_bwt.size()) {
+                    off_targets_bwt[k].insert(std::make_tuple(sp, ep));
+                }
+
+                if (static_cast<int>(k) <= threshold) {
+                    count += ep - sp + 1;
+                }
+
+                return threshold <= 0 || count <= 1;
+            }
+        };
     };
 
-    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
-    void process_kmer_to_stream(const genome_index<t_wt, t_dens, t_inv_dens>& gi_forward,
-                                const genome_index<t_wt, t_dens, t_inv_dens>& gi_reverse,
+    /* Off-targets are searched for with the searcher, either gi
+       itself or a bidirectional_index over it, and are resolved
+       through gi. The record of the guide, if it is kept, is
+       appended to output by the record writer, a sam_writer or a
+       bam_writer. */
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens, class t_searcher, class t_record_writer>
+    void process_kmer_to_buffer(const genome_index<t_wt, t_dens, t_inv_dens>& gi,
+                                const t_searcher& searcher,
                                 const std::vector<std::string> &pams, size_t mismatches,
                                 int threshold,
                                 const kmer& k,
-                                std::ostream& output,
-                                std::mutex& output_mtx) {
-        coordinates coords = resolve_absolute(gi_forward.gs, k.absolute_coords);
+                                const t_record_writer& records,
+                                std::string& output) {
+        coordinates coords = resolve_absolute(gi.gs, k.absolute_coords);
         size_t count = 0;
 
-        /* Because of the way inexact searching is implemented (from
-         * back-to-front) I search for the reverse complement of the
-         * kmer on the reverse complement strand (which is essentially
-         * searching forward) and I search for the reverse complement
-         * of the kmer on the forward strand.
+        /* Both strands are searched through the searcher. An
+         * off-target on the antisense strand reads as the reverse
+         * complement of kmer + PAM on the forward strand, so I search
+         * for the reverse complement of the kmer with the complemented
+         * PAMs on its left. An off-target on the sense strand reads as
+         * kmer + PAM and is searched for directly, one PAM length at a
+         * time so that every match can be mapped back to its last base.
          */
 
         std::vector<std::string> pams_c;
+        std::vector<std::vector<std::string>> sense_pams;
         for (const auto& pam : pams) {
             pams_c.push_back(genomics::reverse_complement(pam));
+
+            auto same_length = std::find_if(sense_pams.begin(), sense_pams.end(),
+                                            [&pam](const std::vector<std::string>& group) {
+                                                return group[0].length() == pam.length();
+                                            });
+            if (same_length == sense_pams.end()) {
+                sense_pams.push_back({pam});
+            } else {
+                same_length->push_back(pam);
+            }
         }
         
-        std::string kmer = genomics::reverse_complement(k.sequence);
-        if (threshold > 0) {
-            gi_forward.inexact_search(kmer, pams_c, threshold, counting_callback, count);
-            if (count > 1) return;
-            gi_reverse.inexact_search(kmer, pams_c, threshold, counting_callback, count);
-            if (count > 1) return;
-        }
+        std::string kmer_c = genomics::reverse_complement(k.sequence);
+
+        /*
+         * The collectors both enumerate the off-targets and count
+         * those at or below the threshold, ending the search as soon
+         * as the count goes above one, and the guide is dropped before
+         * anything is resolved. With a threshold, both strands are
+         * first searched to the threshold only, where a guide is
+         * cheap to drop. A guide that survives carries on from the
+         * frontier of that search to the full mismatch budget, so
+         * the shallow part of the search is not repeated.
+         */
+
+        size_t depth = threshold > 0 ? static_cast<size_t>(threshold) : mismatches;
+        bool deepen = depth < mismatches;
 
-        std::vector<std::set<std::tuple<size_t, size_t>>> forward_off_targets_bwt(mismatches + 1);
-        std::vector<std::set<std::tuple<size_t, size_t>>> reverse_off_targets_bwt(mismatches + 1);
-        gi_forward.inexact_search(kmer, pams_c, mismatches, callback, forward_off_targets_bwt);
-        gi_reverse.inexact_search(kmer, pams_c, mismatches, callback, reverse_off_targets_bwt);
+        bwt_intervals antisense_off_targets_bwt(mismatches + 1);
+        off_target_collector antisense_collector = {antisense_off_targets_bwt, threshold, count};
+        search_frontier antisense_frontier;
+        if (!searcher.inexact_search(kmer_c, pams_c, pam_side::left, depth, antisense_collector,
+                                     deepen ? &antisense_frontier : nullptr)) return;
 
-        size_t genome_length = 0;
-        for (int i = 0; i < gi_forward.gs.size(); i++) {
-            genome_length += gi_forward.gs[i].length;
+        std::vector<bwt_intervals> sense_off_targets_bwt(sense_pams.size(), bwt_intervals(mismatches + 1));
+        std::vector<off_target_collector> sense_collectors;
+        std::vector<search_frontier> sense_frontiers(sense_pams.size());
+        for (size_t p = 0; p < sense_pams.size(); p++) {
+            sense_collectors.push_back({sense_off_targets_bwt[p], threshold, count});
+            if (!searcher.inexact_search(k.sequence, sense_pams[p], pam_side::right, depth, sense_collectors[p],
+                                         deepen ? &sense_frontiers[p] : nullptr)) return;
         }
-        
+
+        if (deepen) {
+            searcher.extend_search(kmer_c, pams_c, pam_side::left, mismatches, antisense_frontier,
+                                   antisense_collector);
+            for (size_t p = 0; p < sense_pams.size(); p++) {
+                searcher.extend_search(k.sequence, sense_pams[p], pam_side::right, mismatches,
+                                       sense_frontiers[p], sense_collectors[p]);
+            }
+        }
+
         /*
          * This code resolves the position of the guide on the FORWARD
          * strand, making guides on the antisense strand negative so
-         * that they can be distinguished.
+         * that they can be distinguished. All positions are resolved
+         * in one batch and then read back in the order they were added.
          */
 
+        std::vector<size_t> rows, positions;
+        append_rows(antisense_off_targets_bwt, rows);
+        for (const auto& off_targets_bwt : sense_off_targets_bwt) {
+            append_rows(off_targets_bwt, rows);
+        }
+        gi.resolve(rows, positions);
+
         std::vector<std::vector<int64_t>> off_targets(mismatches + 1);
-        for (int i = 0; i < mismatches + 1; i++) {
-            for (const auto& sp_ep : forward_off_targets_bwt[i]) {
+        auto position = positions.cbegin();
+
+        for (size_t i = 0; i < mismatches + 1; i++) {
+            for (const auto& sp_ep : antisense_off_targets_bwt[i]) {
                 size_t sp = std::get<0>(sp_ep);
                 size_t ep = std::get<1>(sp_ep);
                 for (size_t j = sp; j <= ep; j++) {
-                    int64_t absolute_pos = -gi_forward.resolve(j);
+                    int64_t absolute_pos = -static_cast<int64_t>(*position++);
                     off_targets[i].push_back(absolute_pos);
                 }
             }
+        }
 
-            for (const auto& sp_ep : reverse_off_targets_bwt[i]) {
-                size_t sp = std::get<0>(sp_ep);
-                size_t ep = std::get<1>(sp_ep);
-                for (size_t j = sp; j <= ep; j++) {
-                    int64_t absolute_pos = genome_length - (gi_reverse.resolve(j) + 1);
-                    off_targets[i].push_back(absolute_pos);
+        for (size_t p = 0; p < sense_pams.size(); p++) {
+            size_t last_base = k.sequence.length() + sense_pams[p][0].length() - 1;
+            for (size_t i = 0; i < mismatches + 1; i++) {
+                for (const auto& sp_ep : sense_off_targets_bwt[p][i]) {
+                    size_t sp = std::get<0>(sp_ep);
+                    size_t ep = std::get<1>(sp_ep);
+                    for (size_t j = sp; j <= ep; j++) {
+                        int64_t absolute_pos = *position++ + last_base;
+                        off_targets[i].push_back(absolute_pos);
+                    }
                 }
             }
         }
 
-        std::string sam_line = genomics::get_sam_line(output, gi_forward, k, coords, off_targets);
-
-        output_mtx.lock();
-        output << sam_line << std::endl;
-        output_mtx.unlock();
+        records.append_record(output, k, coords, off_targets);
     }
 
 
     template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
-    nlohmann::json search_kmer(const genome_index<t_wt, t_dens, t_inv_dens>& gi_forward,
-                               const genome_index<t_wt, t_dens, t_inv_dens>& gi_reverse,
+    nlohmann::json search_kmer(const genome_index<t_wt, t_dens, t_inv_dens>& gi,
                                std::string kmer, size_t mismatches) {
         using json = nlohmann::json;
-        std::vector<std::set<std::tuple<size_t, size_t>>> forward_matches(mismatches + 1);
-        std::vector<std::set<std::tuple<size_t, size_t>>> reverse_matches(mismatches + 1);
 
-        gi_forward.inexact_search(kmer.begin(), kmer.end(), mismatches, callback, forward_matches);
-        gi_reverse.inexact_search(kmer.begin(), kmer.end(), mismatches, callback, reverse_matches);
+        /* Reverse strand matches are found by searching for the
+           reverse complement of the kmer and are reported at their
+           last base on the forward strand. */
+        std::string kmer_c = reverse_complement(kmer);
 
-        size_t genome_length = 0;
-        for (int i = 0; i < gi_forward.gs.size(); i++) {
-            genome_length += gi_forward.gs[i].length;
-        }
+        bwt_intervals forward_matches(mismatches + 1);
+        bwt_intervals reverse_matches(mismatches + 1);
+        off_target_enumerator forward_enumerator = {forward_matches};
+        off_target_enumerator reverse_enumerator = {reverse_matches};
+
+        gi.inexact_search(kmer.cbegin(), kmer.cend(), mismatches, forward_enumerator);
+        gi.inexact_search(kmer_c.cbegin(), kmer_c.cend(), mismatches, reverse_enumerator);
+
+        std::vector<size_t> forward_rows, forward_positions;
+        std::vector<size_t> reverse_rows, reverse_positions;
+        append_rows(forward_matches, forward_rows);
+        append_rows(reverse_matches, reverse_rows);
+        gi.resolve(forward_rows, forward_positions);
+        gi.resolve(reverse_rows, reverse_positions);
+
+        auto forward_position = forward_positions.cbegin();
+        auto reverse_position = reverse_positions.cbegin();
 
         json matches;
-        for (int i = 0; i < mismatches + 1; i++) {
+        for (size_t i = 0; i < mismatches + 1; i++) {
             for (const auto& sp_ep : forward_matches[i]) {
                 size_t sp = std::get<0>(sp_ep);
                 size_t ep = std::get<1>(sp_ep);
                 for (size_t j = sp; j <= ep; j++) {
-                    size_t absolute_pos = gi_forward.resolve(j);
-                    coordinates pos = resolve_absolute(gi_forward.gs, absolute_pos);
+                    size_t absolute_pos = *forward_position++;
+                    coordinates pos = resolve_absolute(gi.gs, absolute_pos);
                     json match = {
                         {"chr", pos.chr.name},
                         {"pos", pos.offset},
@@ -150,8 +268,8 @@ namespace genomics {
                 size_t sp = std::get<0>(sp_ep);
                 size_t ep = std::get<1>(sp_ep);
                 for (size_t j = sp; j <= ep; j++) {
-                    size_t absolute_pos = genome_length - (gi_reverse.resolve(j) + 1);
-                    coordinates pos = resolve_absolute(gi_forward.gs, absolute_pos);
+                    size_t absolute_pos = *reverse_position++ + kmer.length() - 1;
+                    coordinates pos = resolve_absolute(gi.gs, absolute_pos);
                     json match = {
                         {"chr", pos.chr.name},
                         {"absolute_pos", absolute_pos},
@@ -167,24 +285,203 @@ namespace genomics {
         return matches;
     }
 
-    /* Processes the kmers in the file, collecting all information
-       about off targets and outputting it to a stream in SAM format. */
+    /*
+      Estimates the cost of the off-target search of a guide as the
+      total number of occurrences, on both strands, of its substrings
+      of the length at which a random string is expected to be
+      unique. Copies of a repeat, even diverged ones, share some of
+      these substrings with the guide, and every copy widens its
+      mismatch tree.
+    */
     template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
-    void process_kmers_to_stream(const genome_index<t_wt, t_dens, t_inv_dens>& gi_forward,
-                                 const genome_index<t_wt, t_dens, t_inv_dens>& gi_reverse,
+    size_t estimate_search_cost(const genome_index<t_wt, t_dens, t_inv_dens>& gi,
+                                const std::string& sequence) {
+        size_t length = std::min<size_t>(sdsl::bits::hi(gi.csa.size()) / 2 + 1, sequence.length());
+
+        size_t cost = 0;
+        for (const std::string& strand : {sequence, reverse_complement(sequence)}) {
+            for (size_t end = length; end <= strand.length(); end++) {
+                size_t sp = 0, ep = gi.csa.size() - 1;
+                cost += sdsl::backward_search(gi.csa, sp, ep, strand.begin() + (end - length),
+                                              strand.begin() + end, sp, ep);
+            }
+        }
+
+        return cost;
+    }
+
+    /*
+      Workers kept busy by each thread that orders windows by cost.
+      At one mismatch, where searches are cheapest, estimating the
+      cost of a guide takes about a quarter of the time of its
+      search.
+    */
+    const size_t workers_per_window_thread = 4;
+
+    /*
+      A thread of the first stage of the build pipeline: reads
+      windows of kmers from the reader, orders each by decreasing
+      estimated cost and hands it on to the scheduler, until the
+      kmers run out.
+    */
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
+    void produce_kmer_windows(const genome_index<t_wt, t_dens, t_inv_dens>& gi,
+                              window_reader& reader, stage_stats& stats) {
+        {
+            stage_timer timer(stats);
+
+            std::vector<kmer> kmers;
+            size_t number;
+            while (reader.read(kmers, number)) {
+                std::vector<std::pair<size_t, size_t>> order;
+                for (size_t i = 0; i < kmers.size(); i++) {
+                    order.push_back(std::make_pair(estimate_search_cost(gi, kmers[i].sequence), i));
+                }
+
+                std::stable_sort(order.begin(), order.end(),
+                                 [](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) {
+                                     return a.first > b.first;
+                                 });
+
+                kmer_window window;
+                for (const auto& cost_i : order) {
+                    window.push_back(std::move(kmers[cost_i.second]));
+                }
+
+                if (!timer.wait([&]() { return reader.hand_on(number, std::move(window)); })) break;
+            }
+        }
+
+        reader.leave();
+    }
+
+    /* Second stage of the build pipeline: processes the kmers handed
+       out by the scheduler to the worker, collecting all information
+       about off targets and passing it on to the writer in batches of
+       records written by a copy of record_writer. A batch never spans
+       two windows. */
+    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens, class t_searcher, class t_record_writer>
+    void process_kmers_to_stream(const genome_index<t_wt, t_dens, t_inv_dens>& gi,
+                                 const t_searcher& searcher,
                                  const std::vector<std::string> &pams,
                                  size_t mismatches, int threshold,
-                                 std::unique_ptr<genomics::kmer_producer>& kmer_p, std::mutex& kmer_mtx,
-                                 std::ostream& output, std::mutex& output_mtx) {
-        kmer out_kmer;
-        while (true) {
-            kmer_mtx.lock();
-            bool kmers_left = kmer_p->get_next_kmer(out_kmer);
-            kmer_mtx.unlock();
-
-            if (!kmers_left) break;
-            process_kmer_to_stream(gi_forward, gi_reverse, pams, mismatches, threshold, out_kmer, output, output_mtx);
+                                 const t_record_writer& record_writer,
+                                 guide_scheduler& scheduler, size_t worker,
+                                 bounded_queue<record_batch>& batches,
+                                 stage_stats& stats) {
+        stage_timer timer(stats);
+
+        t_record_writer records(record_writer);
+        scheduled_kmer next;
+        record_batch batch = {0, 0, 0, 0, std::string(), std::vector<record_key>()};
+        size_t batch_capacity = 0;
+
+        /* The records are handed over with the batch, and the next batch
+           starts out as large as the largest one so far. */
+        auto flush = [&]() {
+            batch_capacity = std::max(batch_capacity, batch.records.size());
+            timer.wait([&]() { return batches.push(std::move(batch)); });
+            batch.records = std::string();
+            batch.records.reserve(batch_capacity);
+            batch.keys.clear();
+            batch.guides = 0;
+        };
+
+        while (timer.wait([&]() { return scheduler.next(worker, next); })) {
+            if (batch.guides > 0 && batch.window != next.window) flush();
+
+            batch.window = next.window;
+            batch.window_size = next.window_size;
+            batch.window_start = next.window_start;
+
+            size_t end = batch.records.size();
+            process_kmer_to_buffer(gi, searcher, pams, mismatches, threshold, next.k, records, batch.records);
+            if (batch.records.size() > end) batch.keys.push_back({next.k.absolute_coords, batch.records.size()});
+            if (++batch.guides == kmer_batch_size) flush();
         }
+
+        if (batch.guides > 0) flush();
+    }
+
+    /*
+      Last stage of the build pipeline: collects the batches of each
+      window and writes the windows to the output whole and in order,
+      starting from first_window, until the queue is closed and
+      drained. After each window is written, window_written is called
+      with the number of windows written so far, so the output always
+      holds a prefix of the windows once it is flushed. Windows that
+      finish early are held in memory until the ones before them are
+      written.
+
+      With a reorder buffer the windows go through the buffer instead,
+      which is released up to the start of the next window, the
+      smallest coordinate still to come when the kmers are read in
+      coordinate order. Since the buffer holds records of windows
+      already passed on, window_written is only called once it is
+      empty.
+    */
+    inline void write_batches(bounded_queue<record_batch>& batches, std::ostream& output,
+                              size_t first_window,
+                              const std::function<void(size_t)>& window_written,
+                              stage_stats& stats, reorder_buffer* reorder = nullptr) {
+        stage_timer timer(stats);
+
+        struct pending_window {
+            size_t guides = 0, size = 0, start = 0;
+            std::string records;
+            std::vector<record_key> keys;
+        };
+
+        std::map<size_t, pending_window> pending;
+        size_t next_window = first_window;
+        size_t reported_window = first_window;
+
+        record_batch batch;
+        while (timer.wait([&]() { return batches.pop(batch); })) {
+            pending_window& window = pending[batch.window];
+            window.guides += batch.guides;
+            window.size = batch.window_size;
+            window.start = batch.window_start;
+            if (reorder) {
+                for (const auto& key : batch.keys) {
+                    window.keys.push_back({key.coordinate, key.end + window.records.size()});
+                }
+            }
+
+            if (window.records.empty()) {
+                window.records = std::move(batch.records);
+            } else {
+                window.records += batch.records;
+            }
+
+            for (auto it = pending.begin();
+                 it != pending.end() && it->first == next_window && it->second.guides == it->second.size;
+                 it = pending.erase(it)) {
+                if (reorder) {
+                    reorder->add(std::move(it->second.records), it->second.keys);
+                    next_window++;
+                } else {
+                    output.write(it->second.records.data(), it->second.records.size());
+                    window_written(++next_window);
+                }
+            }
+
+            if (reorder) {
+                auto next = pending.find(next_window);
+                if (next != pending.end()) reorder->release(next->second.start);
+                if (reorder->empty() && next_window > reported_window) {
+                    window_written(next_window);
+                    reported_window = next_window;
+                }
+            }
+        }
+
+        if (reorder) {
+            reorder->release_all();
+            if (next_window > reported_window) window_written(next_window);
+        }
+
+        output.flush();
     }
 }
 
@@ -3,152 +3,105 @@
 
 #include "genomics/structures.hpp"
 #include "genomics/sequences.hpp"
+#include "genomics/off_targets.hpp"
 
 #include <iostream>
+#include <string>
 #include <vector>
 
 namespace genomics {
     namespace {
-	std::string byte_to_big_endian_hex(unsigned char n) {
-	    std::string out("");
-	    int lowest1 = n % 16;
-	    n           = n / 16;
-	    int lowest2 = n % 16;
-
-	    char c1 = 'f';
-	    switch(lowest1) {
-	    case 0:  c1 = '0'; break;
-	    case 1:  c1 = '1'; break;
-	    case 2:  c1 = '2'; break;
-	    case 3:  c1 = '3'; break;
-	    case 4:  c1 = '4'; break;
-	    case 5:  c1 = '5'; break;
-	    case 6:  c1 = '6'; break;
-	    case 7:  c1 = '7'; break;
-	    case 8:  c1 = '8'; break;
-	    case 9:  c1 = '9'; break;
-	    case 10: c1 = 'a'; break;
-	    case 11: c1 = 'b'; break;
-	    case 12: c1 = 'c'; break;
-	    case 13: c1 = 'd'; break;
-	    case 14: c1 = 'e'; break;
-	    case 15: c1 = 'f'; break;
-	    };
-
-	    char c2 = 'f';
-	    switch(lowest2) {
-	    case 0:  c2 = '0'; break;
-	    case 1:  c2 = '1'; break;
-	    case 2:  c2 = '2'; break;
-	    case 3:  c2 = '3'; break;
-	    case 4:  c2 = '4'; break;
-	    case 5:  c2 = '5'; break;
-	    case 6:  c2 = '6'; break;
-	    case 7:  c2 = '7'; break;
-	    case 8:  c2 = '8'; break;
-	    case 9:  c2 = '9'; break;
-	    case 10: c2 = 'a'; break;
-	    case 11: c2 = 'b'; break;
-	    case 12: c2 = 'c'; break;
-	    case 13: c2 = 'd'; break;
-	    case 14: c2 = 'e'; break;
-	    case 15: c2 = 'f'; break;
-	    };
-
-	    out += c2;
-	    out += c1;
-
-	    return out;
-	}
-
-	std::string num_to_little_endian_hex(uint64_t num) {
-	    std::string out("");
-
-	    for (int i = 0; i < sizeof(num); i++) {
-		unsigned char lowest = num % 256;
-		num                  = num / 256;
-		out += byte_to_big_endian_hex(lowest);
-	    }
-
-	    return out;
-	}
-
-	std::string vector_to_little_endian_hex(std::vector<uint64_t> v) {
-	    std::string out("");
-	    for (auto n : v) {
-		out += num_to_little_endian_hex(n);
-	    }
-	    return out;
-	}
-
-	int64_t get_delim(genome_structure gs) {
+	int64_t get_delim(const genome_structure& gs) {
 	    int64_t delim = 0;
 	    for (const auto& chr : gs) {
 		delim += chr.length;
 	    } 
 	    return -(delim + 1);
 	}
-
-	std::string off_target_string(genome_structure gs,
-				      const std::vector<std::vector<int64_t>>& off_targets) {
-	    uint64_t delim = get_delim(gs);
-	    std::vector<uint64_t> v;
-
-	    for (uint64_t k = 0; k < off_targets.size(); k++) {
-		v.insert(v.end(), off_targets[k].begin(), off_targets[k].end());
-		v.push_back(k);
-		v.push_back(delim);
-	    }
-
-	    return vector_to_little_endian_hex(v);
-	}
     };
 
-    void write_sam_header(std::ostream& os, genome_structure gs) {
-	os << "@HD\tVN:1.0\tSO:unknown" << std::endl;
+    /* The header declares the records sorted by coordinate if sorted
+       is set. */
+    void write_sam_header(std::ostream& os, const genome_structure& gs, bool sorted = false) {
+	os << "@HD\tVN:1.0\tSO:" << (sorted ? "coordinate" : "unknown") << std::endl;
 	for (const auto& chr : gs) {
 	    os << "@SQ\tSN:" << chr.name << "\tLN:" << chr.length << std::endl;
 	}
     }
 
-    template <class t_wt, uint32_t t_dens, uint32_t t_inv_dens>
-    std::string get_sam_line(std::ostream& os, genome_index<t_wt, t_dens, t_inv_dens> gi,
-			const kmer& k, const coordinates& coords,
-			const std::vector<std::vector<int64_t>>& off_targets) {
-	std::string sequence(k.sequence + k.pam);
-	std::string samline(sequence);
-
-	samline += "\t";
-	samline += k.dir == direction::positive ? "0" : "16";
-	samline += "\t" + coords.chr.name;
-
-	size_t position = coords.offset + 1;
-
-	samline += "\t" + std::to_string(position);
-	samline += "\t100";
-	samline += "\t" + std::to_string(sequence.length()) + "M";
-	samline += "\t*\t0\t0";
-
-	if (k.dir == direction::negative) {
-	    samline += "\t" + reverse_complement(sequence);
-	} else {
-	    samline += "\t" + sequence;
-	}
-
-	samline += "\t*";
-
-	bool no_off_targets = true;
-	for (const auto& v : off_targets) {
-	    if (!v.empty()) no_off_targets = false;
-	}
-
-	if (!no_off_targets) {
-	    std::string ots = off_target_string(gi.gs, off_targets);
-	    samline += "\tof:H:" + ots;
-	}
-
-        return samline;
-    }
+    /*
+      Formats SAM records straight into a buffer that the caller
+      reuses from one record to the next, so that writing a record
+      allocates nothing once the buffer has grown. The delimiter that
+      ends each group of off-targets depends only on the genome and is
+      computed once. Off-targets are written in the given encoding.
+    */
+    class sam_writer {
+    public:
+        explicit sam_writer(const genome_structure& gs,
+                            off_target_encoding encoding = off_target_encoding::hex)
+            : off_targets_encoder(get_delim(gs), encoding) {}
+
+        /* Appends the record of the guide, newline included, to out. */
+        void append_record(std::string& out, const kmer& k, const coordinates& coords,
+                           const std::vector<std::vector<int64_t>>& off_targets) const {
+            size_t length = k.sequence.length() + k.pam.length();
+
+            out.append(k.sequence).append(k.pam);
+            out.append(k.dir == direction::positive ? "\t0\t" : "\t16\t");
+            out.append(coords.chr.name);
+            out += '\t';
+            append_decimal(out, coords.offset + 1);
+            out.append("\t100\t");
+            append_decimal(out, length);
+            out.append("M\t*\t0\t0\t");
+
+            if (k.dir == direction::negative) {
+                for (auto it = k.pam.rbegin(); it != k.pam.rend(); ++it) out += complement(*it);
+                for (auto it = k.sequence.rbegin(); it != k.sequence.rend(); ++it) out += complement(*it);
+            } else {
+                out.append(k.sequence).append(k.pam);
+            }
+
+            out.append("\t*");
+
+            bool no_off_targets = true;
+            for (const auto& v : off_targets) {
+                if (!v.empty()) no_off_targets = false;
+            }
+
+            if (!no_off_targets) {
+                out += '\t';
+                out.append(off_targets_tag()).append(":H:");
+                append_off_targets(out, off_targets);
+            }
+
+            out += '\n';
+        }
+
+        /* Appends the value of the off-target tag, as a hex string. */
+        void append_off_targets(std::string& out, const std::vector<std::vector<int64_t>>& off_targets) const {
+            off_targets_encoder.append(out, off_targets);
+        }
+
+        const char* off_targets_tag() const {
+            return off_target_tag(off_targets_encoder.get_encoding());
+        }
+
+    private:
+        off_target_encoder off_targets_encoder;
+
+        static void append_decimal(std::string& out, uint64_t n) {
+            char digits[20];
+            size_t length = 0;
+            do {
+                digits[length++] = '0' + n % 10;
+                n /= 10;
+            } while (n > 0);
+
+            while (length > 0) out += digits[--length];
+        }
+    };
 };
 
 #endif /* SAM_H */
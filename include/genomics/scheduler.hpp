@@ -0,0 +1,131 @@
+/*
+   Distributes guides over the threads of the build command, most
+   expensive first.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "genomics/pipeline.hpp"
+#include "genomics/structures.hpp"
+
+namespace genomics {
+    class kmer_producer;
+
+    /*
+      Number of kmers read from the producer and ordered by cost at a
+      time. Only guides within a window are reordered.
+    */
+    const size_t schedule_window = 1 << 12;
+
+    /* A window of kmers, ordered by decreasing estimated cost. */
+    typedef std::vector<kmer> kmer_window;
+
+    /* A guide handed out by the scheduler, along with the number and
+       size of the window it was read in and the smallest absolute
+       coordinate of the kmers in that window. */
+    struct scheduled_kmer {
+        kmer k;
+        size_t window;
+        size_t window_size;
+        size_t window_start;
+    };
+
+    /*
+      Shares the kmers among the threads that order windows by cost,
+      the first stage of the build pipeline. Each thread reads a
+      window, orders it on its own and hands it on once the windows
+      read before it were, so windows leave in the order they were
+      read and a resumed build skips the same ones. The first
+      skip_windows windows are read but never handed out. The last
+      thread to leave closes the queue.
+    */
+    class window_reader {
+    public:
+        window_reader(kmer_producer& kmer_p, size_t skip_windows, size_t threads,
+                      bounded_queue<kmer_window>& windows);
+        window_reader(const window_reader& other) = delete;
+        window_reader& operator=(const window_reader& other) = delete;
+
+        /*
+          Replaces kmers with the next window and sets number to its
+          place in the order, returning false once the kmers ran out
+          or the queue was closed.
+        */
+        bool read(std::vector<kmer>& kmers, size_t& number);
+
+        /*
+          Waits for the windows read before the given one to be
+          handed on and pushes it, returning false if the queue was
+          closed.
+        */
+        bool hand_on(size_t number, kmer_window window);
+
+        void leave();
+
+    private:
+        kmer_producer& kmer_p;
+        size_t skip_windows;
+        size_t threads;
+        bounded_queue<kmer_window>& windows;
+
+        std::mutex mtx;
+        std::condition_variable turn;
+        size_t windows_read = 0;
+        size_t windows_handed_on = 0;
+        bool exhausted = false;
+        bool closed = false;
+    };
+
+    /*
+      The search cost of guides varies by orders of magnitude, and a
+      repetitive guide handed out last keeps one thread busy long
+      after the others ran dry. The scheduler takes windows of kmers
+      sorted by estimated cost and deals them round robin over one
+      queue per worker, so every worker starts on its share of the
+      expensive guides. A worker takes guides from the front of its
+      own queue and, once it is empty, steals from the back of the
+      others. The next window is taken when all queues are empty.
+
+      Guides are therefore not processed in the order the producer
+      yields them. Windows are numbered in the order they are taken,
+      starting from first_window.
+    */
+    class guide_scheduler {
+    public:
+        guide_scheduler(bounded_queue<kmer_window>& windows, size_t workers, size_t first_window = 0);
+        guide_scheduler(const guide_scheduler& other) = delete;
+        guide_scheduler& operator=(const guide_scheduler& other) = delete;
+
+        /*
+          Gets the next guide for the given worker, returning false
+          once every guide has been handed out.
+        */
+        bool next(size_t worker, scheduled_kmer& out_kmer);
+
+    private:
+        struct worker_queue {
+            std::mutex mtx;
+            std::deque<scheduled_kmer> kmers;
+        };
+
+        bounded_queue<kmer_window>& windows;
+        std::vector<std::unique_ptr<worker_queue>> queues;
+
+        /* Held while taking the next window. */
+        std::mutex refill_mtx;
+        bool exhausted = false;
+        size_t next_window;
+
+        bool take(size_t worker, scheduled_kmer& out_kmer);
+        void refill();
+    };
+};
+
+#endif /* SCHEDULER_H */
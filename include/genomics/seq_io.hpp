@@ -28,11 +28,28 @@ namespace genomics {
 	   0 otherwise. */
 	size_t parse_kmer(std::istream& kmers_stream, kmer& out_kmer);
 
+        /* Writes every kmer left in the producer to the stream, one
+           per line. */
+        void write_kmers(kmer_producer& kmer_p, std::ostream& kmers_os);
         void write_to_file(kmer_producer& kmer_p, const std::string& filename);
 
         void write_to_file(const genome_structure& gs, const std::string& filename);
         bool load_from_file(genome_structure& gs, const std::string& filename);
 
+        /* The manifest is written to a temporary file first and then
+           renamed, so a manifest that exists is always complete.
+           Throws a std::runtime_error if it cannot be written. */
+        void write_to_file(const shard_manifest& manifest, const std::string& filename);
+        bool load_from_file(shard_manifest& manifest, const std::string& filename);
+
+        /* Checkpoints are replaced the same way as manifests. */
+        void write_to_file(const build_checkpoint& checkpoint, const std::string& filename);
+        bool load_from_file(build_checkpoint& checkpoint, const std::string& filename);
+
+        /* Region indexes are replaced the same way as manifests. */
+        void write_to_file(const region_index& index, const std::string& filename);
+        bool load_from_file(region_index& index, const std::string& filename);
+
 	void write_to_file(const std::vector<kmer>& kmers, const std::string& filename);
 	bool load_from_file(std::vector<kmer>& kmers, const std::string& filename);
     };
@@ -0,0 +1,140 @@
+/*
+   Writes databases sorted by coordinate, along with an index of the
+   offsets of their records by region.
+*/
+
+#ifndef SORTED_OUTPUT_H
+#define SORTED_OUTPUT_H
+
+#include <deque>
+#include <istream>
+#include <ostream>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "genomics/structures.hpp"
+
+namespace genomics {
+
+    /*
+      Width in bases of the bins of a region index. A region lookup
+      reads on average half a bin of records before the region.
+    */
+    const size_t region_bin_size = 1 << 14;
+
+    /* The absolute coordinate of a record in a batch of records, and
+       the offset just past its end. */
+    struct record_key {
+        size_t coordinate;
+        size_t end;
+    };
+
+    /*
+      Builds the region index of a database from the absolute
+      coordinates and offsets of its records, which must come in
+      coordinate order.
+    */
+    class region_indexer {
+    public:
+        explicit region_indexer(const genome_structure& gs);
+
+        void add(size_t coordinate, uint64_t offset);
+
+        /* Completes the index of a database ending at end_offset. */
+        region_index finish(uint64_t end_offset);
+
+    private:
+        region_index index;
+        size_t bins;
+    };
+
+    /*
+      Sorts records by coordinate on their way to the output, holding
+      at most capacity records. Records are written once they come
+      before every record still to come, as given to release(), or to
+      make room. A record that comes before one already written means
+      the records were too far out of order for the buffer.
+      Records written to a SAM database are added to the indexer, if
+      any, at their offset in the output, starting from offset.
+    */
+    class reorder_buffer {
+    public:
+        reorder_buffer(std::ostream& output, size_t capacity,
+                       region_indexer* indexer = nullptr, uint64_t offset = 0);
+        reorder_buffer(const reorder_buffer& other) = delete;
+        reorder_buffer& operator=(const reorder_buffer& other) = delete;
+
+        /*
+          Adds the records, with their keys in the order they appear in
+          records. The buffer keeps the records, which are written
+          straight from it. Throws a std::runtime_error if one of them
+          comes before a record already written.
+        */
+        void add(std::string&& records, const std::vector<record_key>& keys);
+
+        /* Writes the records before the coordinate. */
+        void release(size_t coordinate);
+
+        void release_all();
+
+        bool empty() const { return heap.empty(); }
+
+    private:
+        /* The records added at once, kept until all are written. */
+        struct window {
+            std::string records;
+            size_t pending;
+        };
+
+        /* A record, as its range in the records of a window. */
+        struct entry {
+            size_t coordinate;
+            size_t window;
+            size_t begin, end;
+        };
+
+        /* Equal coordinates are ordered by record so that the output
+           does not depend on the order of the threads. */
+        struct later {
+            const reorder_buffer* buffer;
+            bool operator()(const entry& a, const entry& b) const;
+        };
+
+        std::ostream& output;
+        size_t capacity;
+        region_indexer* indexer;
+        uint64_t offset;
+
+        std::deque<window> windows;
+        size_t first_window = 0;
+
+        std::priority_queue<entry, std::vector<entry>, later> heap;
+        bool written = false;
+        size_t last_coordinate = 0;
+
+        const std::string& window_records(const entry& e) const {
+            return windows[e.window - first_window].records;
+        }
+
+        void write_next();
+    };
+
+    /*
+      Adds the records of a SAM database up to end_offset to the
+      indexer, to continue indexing a database whose writing was
+      interrupted.
+    */
+    void index_sam_records(std::istream& sam_is, const genome_structure& gs,
+                           uint64_t end_offset, region_indexer& indexer);
+
+    /*
+      Writes the records of a SAM database sorted by coordinate in the
+      region of the chromosome between start and end, 1-based and
+      inclusive, looking them up in its region index.
+    */
+    void write_region(std::istream& sam_is, const genome_structure& gs, const region_index& index,
+                      const std::string& chr, size_t start, size_t end, std::ostream& os);
+};
+
+#endif /* SORTED_OUTPUT_H */
@@ -1,6 +1,7 @@
 #ifndef GENOMIC_STRUCTURES_H
 #define GENOMIC_STRUCTURES_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -30,6 +31,49 @@ namespace genomics {
 
     typedef std::vector<chromosome> genome_structure;
 
+    /* 
+       Describes a database built over one shard of the genome's
+       kmers, along with everything that must agree between the
+       shards of one database. It is written next to the shard's
+       output once the shard is complete.
+    */
+    struct shard_manifest {
+        std::string genome;
+        size_t genome_length;
+        size_t shard, shards, stripe_size;
+
+        size_t kmer_length, min_chr_length;
+        std::string pam;
+        std::vector<std::string> alt_pams;
+        size_t mismatches;
+        int threshold;
+
+        /* Number of kmers the shard searched. */
+        size_t kmers;
+    };
+
+    /*
+      Progress of a build: the first windows windows of kmers have all
+      been written to the first offset bytes of its output, header
+      included. The options that determine the output are kept so
+      that only the same build is resumed from it.
+    */
+    struct build_checkpoint {
+        std::string build;
+        size_t windows;
+        size_t offset;
+    };
+
+    /*
+      Index of a database sorted by coordinate: offsets[i] is the
+      offset of its first record at an absolute coordinate of at least
+      i * bin_size, or of its end if there is none.
+    */
+    struct region_index {
+        size_t bin_size;
+        std::vector<uint64_t> offsets;
+    };
+
     coordinates resolve_absolute(const genome_structure& gs, size_t absolute_coords);
     size_t      resolve_relative(const genome_structure& gs, coordinates coords);
 };
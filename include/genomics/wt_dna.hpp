@@ -0,0 +1,566 @@
+#ifndef WT_DNA_H
+#define WT_DNA_H
+
+#include <sdsl/bits.hpp>
+#include <sdsl/int_vector.hpp>
+#include <sdsl/int_vector_buffer.hpp>
+#include <sdsl/sdsl_concepts.hpp>
+#include <sdsl/io.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace genomics {
+
+    /*
+      Occurrence table for DNA that stands in for a wavelet tree in
+      sdsl::csa_wt, answering rank over A, C, G and T with a single
+      cache line.
+
+      The sequence is cut into blocks of 192 characters. Each block
+      fills one 64 byte line: two words with the number of A, C, G
+      and T before the block, as 32 bit counts relative to its
+      superblock of 2^20 blocks, followed by the two bit codes of
+      its characters. These are split into planes of high and low
+      bits, a pair of words per 64 characters, so that counting a
+      code takes one popcount per pair. A rank query reads the
+      counts and popcounts the prefix of the block, so the four
+      ranks at one position cost one miss together.
+
+      Every other symbol, among them the sentinel and 'N', is packed
+      as an A and kept in a list of runs. Blocks holding any such
+      symbol are flagged, so only rank queries for A in those blocks
+      and queries for the other symbols search the runs. In a
+      genome these symbols are rare and cluster in the BWT.
+
+      The number of blocks per superblock is a parameter only so that
+      tests can cross superblock boundaries on small texts; indexes
+      use wt_dna.
+    */
+    template <uint64_t t_super_blocks = uint64_t(1) << 20>
+    class basic_wt_dna {
+    public:
+        typedef sdsl::int_vector<>::size_type size_type;
+        typedef uint8_t                      value_type;
+        typedef sdsl::wt_tag                 index_category;
+        typedef sdsl::byte_alphabet_tag      alphabet_category;
+        enum { lex_ordered = 0 };
+
+        static const size_type block_chars = 192;
+        static const size_type block_words = 8;
+        static const size_type super_blocks = t_super_blocks;
+
+    private:
+        size_type m_size = 0;
+        size_type m_sigma = 0;
+
+        /* Blocks start at m_words[m_first], which is 64 byte aligned. */
+        std::vector<uint64_t> m_words;
+        size_type m_first = 0;
+
+        /* Counts of A, C, G and T before each superblock. */
+        std::vector<uint64_t> m_super;
+
+        /* Runs of symbols outside of ACGT, sorted by start. */
+        std::vector<uint64_t> m_run_start;
+        std::vector<uint64_t> m_run_length;
+        std::vector<value_type> m_run_symbol;
+
+        /* Derived from the runs on construction and load: for each
+           run the number of exceptional symbols before it, overall
+           and of its own symbol, and the runs of every symbol. */
+        std::vector<uint64_t> m_run_before;
+        std::vector<uint64_t> m_run_symbol_before;
+        std::array<std::vector<uint64_t>, 256> m_symbol_runs;
+
+        /* Symbols in the text, in ascending order. */
+        std::vector<value_type> m_symbols;
+
+        static const uint8_t no_code = 4;
+        static const uint64_t exception_flag = uint64_t(1) << 31;
+
+        /* Leads the serialized table, telling it apart from an index
+           built over a different wavelet tree. */
+        static const uint64_t format_tag = 0x31304e4454444e41ULL;
+
+        static_assert(t_super_blocks > 0 && t_super_blocks * block_chars < exception_flag,
+                      "counts relative to a superblock must fit in 31 bits");
+
+        static uint8_t code_of(value_type c) {
+            switch (c) {
+            case 'A': return 0;
+            case 'C': return 1;
+            case 'G': return 2;
+            case 'T': return 3;
+            default: return no_code;
+            }
+        }
+
+        static value_type symbol_of(uint8_t code) {
+            return "ACGT"[code];
+        }
+
+        const uint64_t* block(size_type b) const {
+            return m_words.data() + m_first + b * block_words;
+        }
+
+        uint64_t* block(size_type b) {
+            return m_words.data() + m_first + b * block_words;
+        }
+
+        static uint64_t header_count(const uint64_t* b, uint8_t code) {
+            return (b[code >> 1] >> (32 * (code & 1))) & (exception_flag - 1);
+        }
+
+        static uint8_t code_at(const uint64_t* b, size_type offset) {
+            const uint64_t* planes = b + 2 + 2 * (offset / 64);
+            size_type bit = offset % 64;
+            return (((planes[0] >> bit) & 1) << 1) | ((planes[1] >> bit) & 1);
+        }
+
+        /* Characters equal to code among the 64 held by a pair of planes. */
+        static uint64_t match_code(const uint64_t* planes, uint8_t code) {
+            uint64_t high = (code & 2) ? planes[0] : ~planes[0];
+            uint64_t low = (code & 1) ? planes[1] : ~planes[1];
+            return high & low;
+        }
+
+        static size_type block_rank(const uint64_t* b, uint8_t code, size_type offset) {
+            size_type result = 0;
+            size_type pair = 0;
+            for (; pair < offset / 64; pair++) {
+                result += sdsl::bits::cnt(match_code(b + 2 + 2 * pair, code));
+            }
+            if (offset % 64) {
+                uint64_t mask = (uint64_t(1) << (offset % 64)) - 1;
+                result += sdsl::bits::cnt(match_code(b + 2 + 2 * pair, code) & mask);
+            }
+            return result;
+        }
+
+        /* Index of the last run starting before i in runs, a list of
+           run indices, or runs.size() if there is none. */
+        size_type last_run_before(const std::vector<uint64_t>& runs, size_type i) const {
+            auto it = std::lower_bound(runs.begin(), runs.end(), i,
+                                       [this](uint64_t run, size_type pos) {
+                                           return m_run_start[run] < pos;
+                                       });
+            if (it == runs.begin()) return runs.size();
+            return it - runs.begin() - 1;
+        }
+
+        /* Exceptional symbols of any kind in [0, i). */
+        size_type exceptions_before(size_type i) const {
+            auto it = std::lower_bound(m_run_start.begin(), m_run_start.end(), i);
+            if (it == m_run_start.begin()) return 0;
+            size_type r = it - m_run_start.begin() - 1;
+            return m_run_before[r] + std::min<uint64_t>(m_run_length[r], i - m_run_start[r]);
+        }
+
+        size_type exception_rank(size_type i, value_type c) const {
+            const std::vector<uint64_t>& runs = m_symbol_runs[c];
+            size_type p = last_run_before(runs, i);
+            if (p == runs.size()) return 0;
+            size_type r = runs[p];
+            return m_run_symbol_before[r] + std::min<uint64_t>(m_run_length[r], i - m_run_start[r]);
+        }
+
+        /* Run containing position i, or m_run_start.size(). */
+        size_type run_at(size_type i) const {
+            auto it = std::upper_bound(m_run_start.begin(), m_run_start.end(), i);
+            if (it == m_run_start.begin()) return m_run_start.size();
+            size_type r = it - m_run_start.begin() - 1;
+            if (i - m_run_start[r] < m_run_length[r]) return r;
+            return m_run_start.size();
+        }
+
+        size_type code_rank(size_type i, uint8_t code) const {
+            size_type b = i / block_chars;
+            const uint64_t* line = block(b);
+            size_type result = m_super[4 * (b / super_blocks) + code]
+                + header_count(line, code)
+                + block_rank(line, code, i % block_chars);
+
+            if (code == 0 && (line[0] & exception_flag)) {
+                result -= exceptions_before(i) - exceptions_before(b * block_chars);
+            }
+
+            return result;
+        }
+
+        /*
+          Ranks of A, C, G and T at i in one pass over the block. The
+          A are what remains of the prefix after the other three.
+        */
+        void code_ranks(size_type i, std::array<size_type, 4>& occ) const {
+            size_type b = i / block_chars;
+            const uint64_t* line = block(b);
+            const uint64_t* super = m_super.data() + 4 * (b / super_blocks);
+            size_type offset = i % block_chars;
+
+            size_type prefix = 0;
+            for (uint8_t code = 1; code < 4; code++) {
+                size_type count = block_rank(line, code, offset);
+                occ[code] = super[code] + header_count(line, code) + count;
+                prefix += count;
+            }
+
+            occ[0] = super[0] + header_count(line, 0) + offset - prefix;
+            if (line[0] & exception_flag) {
+                occ[0] -= exceptions_before(i) - exceptions_before(b * block_chars);
+            }
+        }
+
+        /* Words of block data, without the alignment slack. */
+        size_type words() const {
+            return m_words.empty() ? 0 : m_words.size() - (block_words - 1);
+        }
+
+        void allocate(size_type count) {
+            m_first = 0;
+            if (count == 0) {
+                m_words.clear();
+                return;
+            }
+
+            m_words.assign(count + block_words - 1, 0);
+            uintptr_t address = reinterpret_cast<uintptr_t>(m_words.data());
+            m_first = ((64 - address % 64) % 64) / sizeof(uint64_t);
+        }
+
+        void derive_runs() {
+            m_run_before.resize(m_run_start.size());
+            m_run_symbol_before.resize(m_run_start.size());
+            for (auto& runs : m_symbol_runs) runs.clear();
+
+            uint64_t before = 0;
+            std::array<uint64_t, 256> symbol_before = {};
+            for (size_type r = 0; r < m_run_start.size(); r++) {
+                value_type c = m_run_symbol[r];
+                m_run_before[r] = before;
+                m_run_symbol_before[r] = symbol_before[c];
+                m_symbol_runs[c].push_back(r);
+                before += m_run_length[r];
+                symbol_before[c] += m_run_length[r];
+            }
+        }
+
+        void copy(const basic_wt_dna& wt) {
+            m_size = wt.m_size;
+            m_sigma = wt.m_sigma;
+            allocate(wt.words());
+            std::copy(wt.m_words.begin() + wt.m_first,
+                      wt.m_words.begin() + wt.m_first + wt.words(),
+                      m_words.begin() + m_first);
+            m_super = wt.m_super;
+            m_run_start = wt.m_run_start;
+            m_run_length = wt.m_run_length;
+            m_run_symbol = wt.m_run_symbol;
+            m_run_before = wt.m_run_before;
+            m_run_symbol_before = wt.m_run_symbol_before;
+            m_symbol_runs = wt.m_symbol_runs;
+            m_symbols = wt.m_symbols;
+        }
+
+    public:
+        const size_type& sigma = m_sigma;
+
+        basic_wt_dna() {}
+
+        basic_wt_dna(const basic_wt_dna& wt) { copy(wt); }
+
+        basic_wt_dna(basic_wt_dna&& wt) { *this = std::move(wt); }
+
+        /*
+          Builds the table over the first size symbols of buf, the
+          BWT as sdsl::csa_wt hands it to its wavelet tree.
+        */
+        template <uint8_t t_width>
+        basic_wt_dna(sdsl::int_vector_buffer<t_width>& buf, size_type size) : m_size(size) {
+            size_type blocks = size / block_chars + 1;
+            allocate(blocks * block_words);
+            m_super.assign(4 * ((blocks - 1) / super_blocks + 1), 0);
+
+            std::array<uint64_t, 4> total = {};
+            std::array<uint64_t, 4> relative = {};
+            std::array<bool, 256> present = {};
+
+            auto begin_block = [&](size_type b) {
+                if (b % super_blocks == 0) {
+                    std::copy(total.begin(), total.end(), m_super.begin() + 4 * (b / super_blocks));
+                    relative.fill(0);
+                }
+                uint64_t* line = block(b);
+                line[0] = relative[0] | (relative[1] << 32);
+                line[1] = relative[2] | (relative[3] << 32);
+            };
+
+            for (size_type i = 0; i < size; i++) {
+                size_type b = i / block_chars;
+                uint64_t* line = block(b);
+                if (i % block_chars == 0) begin_block(b);
+
+                value_type c = buf[i];
+                present[c] = true;
+
+                uint8_t code = code_of(c);
+                if (code == no_code) {
+                    size_type r = m_run_start.size();
+                    if (r > 0 && m_run_symbol[r - 1] == c
+                        && m_run_start[r - 1] + m_run_length[r - 1] == i) {
+                        m_run_length[r - 1]++;
+                    } else {
+                        m_run_start.push_back(i);
+                        m_run_length.push_back(1);
+                        m_run_symbol.push_back(c);
+                    }
+                    line[0] |= exception_flag;
+                    continue;
+                }
+
+                size_type offset = i % block_chars;
+                uint64_t* planes = line + 2 + 2 * (offset / 64);
+                planes[0] |= uint64_t(code >> 1) << (offset % 64);
+                planes[1] |= uint64_t(code & 1) << (offset % 64);
+                total[code]++;
+                relative[code]++;
+            }
+
+            /* rank(size, c) reads the block holding position size,
+               which may hold no character at all. */
+            if (size % block_chars == 0) begin_block(size / block_chars);
+
+            for (size_type c = 0; c < 256; c++) {
+                if (present[c]) m_symbols.push_back(c);
+            }
+            m_sigma = m_symbols.size();
+
+            derive_runs();
+        }
+
+        basic_wt_dna& operator=(const basic_wt_dna& wt) {
+            if (this != &wt) copy(wt);
+            return *this;
+        }
+
+        basic_wt_dna& operator=(basic_wt_dna&& wt) {
+            if (this != &wt) {
+                m_size = wt.m_size;
+                m_sigma = wt.m_sigma;
+                m_words = std::move(wt.m_words);
+                m_first = wt.m_first;
+                m_super = std::move(wt.m_super);
+                m_run_start = std::move(wt.m_run_start);
+                m_run_length = std::move(wt.m_run_length);
+                m_run_symbol = std::move(wt.m_run_symbol);
+                m_run_before = std::move(wt.m_run_before);
+                m_run_symbol_before = std::move(wt.m_run_symbol_before);
+                m_symbol_runs = std::move(wt.m_symbol_runs);
+                m_symbols = std::move(wt.m_symbols);
+            }
+            return *this;
+        }
+
+        void swap(basic_wt_dna& wt) {
+            if (this != &wt) {
+                std::swap(m_size, wt.m_size);
+                std::swap(m_sigma, wt.m_sigma);
+                m_words.swap(wt.m_words);
+                std::swap(m_first, wt.m_first);
+                m_super.swap(wt.m_super);
+                m_run_start.swap(wt.m_run_start);
+                m_run_length.swap(wt.m_run_length);
+                m_run_symbol.swap(wt.m_run_symbol);
+                m_run_before.swap(wt.m_run_before);
+                m_run_symbol_before.swap(wt.m_run_symbol_before);
+                m_symbol_runs.swap(wt.m_symbol_runs);
+                m_symbols.swap(wt.m_symbols);
+            }
+        }
+
+        size_type size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+
+        value_type operator[](size_type i) const {
+            const uint64_t* line = block(i / block_chars);
+            uint8_t code = code_at(line, i % block_chars);
+            if (code == 0 && (line[0] & exception_flag)) {
+                size_type r = run_at(i);
+                if (r != m_run_start.size()) return m_run_symbol[r];
+            }
+            return symbol_of(code);
+        }
+
+        /* Fetches the line holding position i into the cache. */
+        void prefetch(size_type i) const {
+            __builtin_prefetch(block(i / block_chars));
+        }
+
+        /* Occurrences of c in [0, i). */
+        size_type rank(size_type i, value_type c) const {
+            uint8_t code = code_of(c);
+            if (code == no_code) return exception_rank(i, c);
+            return code_rank(i, code);
+        }
+
+        /* The pair (rank(i, wt[i]), wt[i]). */
+        std::pair<size_type, value_type> inverse_select(size_type i) const {
+            value_type c = (*this)[i];
+            return std::make_pair(rank(i, c), c);
+        }
+
+        /* Position of the i-th occurrence of c, counting from one. */
+        size_type select(size_type i, value_type c) const {
+            uint8_t code = code_of(c);
+
+            if (code == no_code) {
+                const std::vector<uint64_t>& runs = m_symbol_runs[c];
+                auto it = std::upper_bound(runs.begin(), runs.end(), i - 1,
+                                           [this](size_type j, uint64_t run) {
+                                               return j < m_run_symbol_before[run];
+                                           });
+                size_type r = *(it - 1);
+                return m_run_start[r] + (i - 1 - m_run_symbol_before[r]);
+            }
+
+            /* Tables built before the superblocks were sized to the
+               blocks may end in an empty superblock, so the search is
+               bounded by the superblock of the last block. */
+            size_type blocks = m_size / block_chars + 1;
+            size_type last = (blocks - 1) / super_blocks;
+            size_type sb = 0;
+            while (sb < last && m_super[4 * (sb + 1) + code] < i) sb++;
+            size_type remaining = i - m_super[4 * sb + code];
+
+            size_type lo = sb * super_blocks;
+            size_type hi = std::min(blocks, lo + super_blocks);
+            while (hi - lo > 1) {
+                size_type mid = lo + (hi - lo) / 2;
+                if (header_count(block(mid), code) < remaining) lo = mid;
+                else hi = mid;
+            }
+
+            const uint64_t* line = block(lo);
+            remaining -= header_count(line, code);
+            bool flagged = code == 0 && (line[0] & exception_flag);
+            for (size_type offset = 0; ; offset++) {
+                if (code_at(line, offset) != code) continue;
+                size_type pos = lo * block_chars + offset;
+                if (flagged && run_at(pos) != m_run_start.size()) continue;
+                if (--remaining == 0) return pos;
+            }
+        }
+
+        /*
+          For every symbol in [i, j) its rank at i and at j, listing
+          A, C, G and T before any other symbol.
+        */
+        void interval_symbols(size_type i, size_type j, size_type& k,
+                              std::vector<value_type>& cs,
+                              std::vector<size_type>& rank_c_i,
+                              std::vector<size_type>& rank_c_j) const {
+            k = 0;
+            if (i == j) return;
+
+            if (j - i == 1) {
+                auto rc = inverse_select(i);
+                cs[0] = rc.second;
+                rank_c_i[0] = rc.first;
+                rank_c_j[0] = rc.first + 1;
+                k = 1;
+                return;
+            }
+
+            std::array<size_type, 4> occ_i, occ_j;
+            code_ranks(i, occ_i);
+            code_ranks(j, occ_j);
+
+            size_type others = j - i;
+            for (uint8_t code = 0; code < 4; code++) {
+                if (occ_i[code] == occ_j[code]) continue;
+                others -= occ_j[code] - occ_i[code];
+                cs[k] = symbol_of(code);
+                rank_c_i[k] = occ_i[code];
+                rank_c_j[k] = occ_j[code];
+                k++;
+            }
+
+            if (others == 0) return;
+
+            for (value_type c : m_symbols) {
+                if (code_of(c) != no_code) continue;
+                size_type r_i = exception_rank(i, c);
+                size_type r_j = exception_rank(j, c);
+                if (r_i == r_j) continue;
+                cs[k] = c;
+                rank_c_i[k] = r_i;
+                rank_c_j[k] = r_j;
+                k++;
+            }
+        }
+
+        size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr,
+                            std::string name = "") const {
+            sdsl::structure_tree_node* child =
+                sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
+            uint64_t tag = format_tag;
+            size_type written = 0;
+            written += sdsl::write_member(tag, out, child, "format_tag");
+            written += sdsl::write_member(m_size, out, child, "size");
+            written += sdsl::write_member(m_sigma, out, child, "sigma");
+
+            uint64_t data_words = words();
+            written += sdsl::write_member(data_words, out, child, "words");
+            out.write(reinterpret_cast<const char*>(m_words.data() + m_first),
+                      data_words * sizeof(uint64_t));
+            written += data_words * sizeof(uint64_t);
+
+            written += sdsl::serialize(m_super, out, child, "super");
+            written += sdsl::serialize(m_run_start, out, child, "run_start");
+            written += sdsl::serialize(m_run_length, out, child, "run_length");
+            written += sdsl::serialize(m_run_symbol, out, child, "run_symbol");
+            written += sdsl::serialize(m_symbols, out, child, "symbols");
+            sdsl::structure_tree::add_size(child, written);
+            return written;
+        }
+
+        void load(std::istream& in) {
+            uint64_t tag = 0;
+            sdsl::read_member(tag, in);
+            if (tag != format_tag) {
+                throw std::runtime_error("index was not built with the DNA occurrence table,"
+                                         " remove it to rebuild");
+            }
+
+            sdsl::read_member(m_size, in);
+            sdsl::read_member(m_sigma, in);
+
+            uint64_t data_words;
+            sdsl::read_member(data_words, in);
+            allocate(data_words);
+            in.read(reinterpret_cast<char*>(m_words.data() + m_first), data_words * sizeof(uint64_t));
+
+            sdsl::load(m_super, in);
+            sdsl::load(m_run_start, in);
+            sdsl::load(m_run_length, in);
+            sdsl::load(m_run_symbol, in);
+            sdsl::load(m_symbols, in);
+
+            derive_runs();
+        }
+    };
+
+    typedef basic_wt_dna<> wt_dna;
+
+    /* Lets genome_index::resolve prefetch the next step of a walk. */
+    template <uint64_t t_super_blocks>
+    inline void prefetch_bwt(const basic_wt_dna<t_super_blocks>& wt, size_t i) {
+        wt.prefetch(i);
+    }
+};
+
+#endif /* WT_DNA_H */
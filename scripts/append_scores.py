@@ -95,6 +95,30 @@ def hex_to_offtargetinfo(hexstr, delim):
         out += zip(repeat(mainarr[end - 1]), mainarr[start + 1:end - 1])
     return out
 
+def read_varint(data, i):
+    n, shift = 0, 0
+    while True:
+        byte = data[i]
+        i += 1
+        n |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return n, i
+
+def compact_to_offtargetinfo(hexstr):
+    data = bytearray(binascii.unhexlify(hexstr))
+    out = []
+    i = 0
+    while i < len(data):
+        distance, i = read_varint(data, i)
+        count, i = read_varint(data, i)
+        key = 0
+        for _ in range(count):
+            delta, i = read_varint(data, i)
+            key += delta
+            out.append((distance, -(key >> 1) if key & 1 else key >> 1))
+    return out
+
 def map_int_to_coord(x, genome, onebased=False):
     strand = '+' if x > 0 else '-'
     x = abs(x)
@@ -135,9 +159,11 @@ def map_coord_to_30nt_context(fasta_record_dict, chr, start, end, antisense):
         pos_end = end + 4
         return revcom(fasta_record_dict[chr].seq[pos_start:pos_end].upper())
 
-def offtarget_hex_to_cfd_score(fasta_record_dict, genome, delim, ots_hex, sgrna):
+def offtarget_hex_to_cfd_score(fasta_record_dict, genome, delim, ots_hex, sgrna, compact=False):
     cfd = 0 
-    for distance, offtarget_pos in hex_to_offtargetinfo(ots_hex, delim=delim):
+    offtargets = (compact_to_offtargetinfo(ots_hex) if compact
+                  else hex_to_offtargetinfo(ots_hex, delim=delim))
+    for distance, offtarget_pos in offtargets:
         chr, pos, strand = map_int_to_coord(offtarget_pos, genome)
 
 
@@ -181,12 +207,14 @@ if __name__ == "__main__":
     delim = get_nonexist_int_coord(genome)
 
     def compute_cfd(guide_record):
-        if not guide_record.has_tag("of"):
+        compact = guide_record.has_tag("oc")
+        if not compact and not guide_record.has_tag("of"):
             return 1
 
-        ots_hex = guide_record.get_tag("of")
+        ots_hex = guide_record.get_tag("oc" if compact else "of")
         sgrna   = guide_record.query_name[:20]
-        cfd = offtarget_hex_to_cfd_score(fasta_record_dict, genome, delim, ots_hex, sgrna)
+        cfd = offtarget_hex_to_cfd_score(fasta_record_dict, genome, delim, ots_hex, sgrna,
+                                         compact=compact)
 
         return cfd
 
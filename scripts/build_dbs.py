@@ -128,7 +128,8 @@ def watcher_state(args):
             args.state = 'gen-idx'
             sp_args = unparse_to_list(args)
             bsub_args = get_bsub_args(args.state, args.bsub_files,
-                                      f'gen-idx-{args.job_id}' )
+                                      f'gen-idx-{args.job_id}',
+                                      threads=args.num_cores)
             start_bsub('watcher', args.state_file, bsub_args, sp_args)
             log_state(args.state_file, f'STARTED\tgen-idx\n')
 
@@ -191,17 +192,11 @@ def generate_kmers_state(args):
     log_state(args.state_file, f'COMPLETED\tgen-kmers\n')
 
 def generate_index_state(args):
-    tmp_kmers = f'tmp_kmers_{args.job_id}.txt'
-    tmp_out = f'tmp_kmers_{args.job_id}.txt'
-
-    tmp_fd = open(tmp_kmers, 'w')
-    tmp_fd.close()
-
+    mem, mem_unit = STATE_PARAMS['gen-idx']['mem']
     gs_args = [
-        'guidescan', 'build', 
-        '-f', tmp_kmers, 
-        '-n', '1', 
-        '-o', tmp_out,
+        'guidescan', 'index',
+        '-n', str(args.num_cores),
+        '--memory-budget', f'{mem}{mem_unit[0]}',
         args.organism
     ]
     
@@ -211,7 +206,6 @@ def generate_index_state(args):
         log_state(state_file, f'FAILED\tgen-idx\n')
         sys.exit(1)
     
-    os.remove(tmp_out)
     log_state(args.state_file, f'COMPLETED\tgen-idx\n')
 
 def build_dbs_state(args):
@@ -318,24 +312,21 @@ def append_scores_state(args):
     start_bsub('append-scores', args.state_file, bsub_args, sp_args)
 
 def merge_dbs_state(args):
-    guide_db = open(f'{args.results}/guide_db.sam', 'w')
-
     db_dir = f'{args.results}/split_dbs/'
 
-    sam_files = os.scandir(db_dir)
-    sam_db = next(sam_files)
+    sam_files = [f'{db_dir}/{path}' for path in os.listdir(db_dir) if path.endswith('.sam')]
 
-    with open(sam_db, 'r') as sf:
-        for line in sf:
-            guide_db.write(line)
-    
-    for sam_db in sam_files:
-        with open(sam_db, 'r') as sf:
-            for line in sf:
-                if line.startswith('@'): continue
-                guide_db.write(line)
+    sp_args = [
+        'guidescan', 'merge',
+        '-o', f'{args.results}/guide_db.sam'
+    ] + sam_files
+
+    try:
+        sp.run(sp_args, check=True)
+    except sp.CalledProcessError as e:
+        log_state(args.state_file, f'FAILED\tmerge-dbs\n')
+        sys.exit(1)
 
-    guide_db.close()
     log_state(args.state_file, f'COMPLETED\tmerge-dbs\n')
 
 STATE_MACHINE = {
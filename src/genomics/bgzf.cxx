@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "genomics/bgzf.hpp"
+
+namespace genomics {
+    namespace {
+        const size_t bgzf_header_size = 18;
+        const size_t bgzf_footer_size = 8;
+        const size_t bgzf_max_block_size = 1 << 16;
+
+        /* The empty block that ends every BGZF file. */
+        const char bgzf_eof[] = "\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00"
+                                "\x1b\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00";
+
+        void put_le(std::string& out, size_t at, uint32_t n, size_t bytes) {
+            for (size_t i = 0; i < bytes; i++, n >>= 8) out[at + i] = static_cast<char>(n & 0xff);
+        }
+
+        /* Deflates data into block, returning false if it does not
+           fit into a BGZF block at this level. */
+        bool deflate_block(const std::string& data, int level, std::string& block) {
+            block.assign(bgzf_max_block_size, '\0');
+
+            z_stream zs = z_stream();
+            if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::runtime_error("could not initialize zlib");
+            }
+
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+            zs.avail_in = static_cast<uInt>(data.size());
+            zs.next_out = reinterpret_cast<Bytef*>(&block[bgzf_header_size]);
+            zs.avail_out = static_cast<uInt>(bgzf_max_block_size - bgzf_header_size - bgzf_footer_size);
+
+            int status = deflate(&zs, Z_FINISH);
+            size_t compressed = zs.total_out;
+            deflateEnd(&zs);
+            if (status != Z_STREAM_END) return false;
+
+            size_t size = bgzf_header_size + compressed + bgzf_footer_size;
+            block.resize(size);
+
+            const char header[] = "\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00";
+            std::copy(header, header + 16, block.begin());
+            put_le(block, 16, static_cast<uint32_t>(size - 1), 2);
+
+            uint32_t crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(data.data()),
+                                 static_cast<uInt>(data.size()));
+            put_le(block, size - 8, crc, 4);
+            put_le(block, size - 4, static_cast<uint32_t>(data.size()), 4);
+            return true;
+        }
+
+        std::string compress_block(const std::string& data) {
+            std::string block;
+            if (!deflate_block(data, Z_DEFAULT_COMPRESSION, block)) {
+                deflate_block(data, Z_NO_COMPRESSION, block);
+            }
+
+            return block;
+        }
+    };
+
+    bgzf_streambuf::bgzf_streambuf(std::ostream& os, size_t threads)
+        : os(os),
+          jobs(4 * std::max<size_t>(threads, 1)),
+          max_pending(4 * std::max<size_t>(threads, 1))
+    {
+        block.reserve(bgzf_block_size);
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+            workers.push_back(std::thread([this]() {
+                compression_job job;
+                while (jobs.pop(job)) {
+                    try {
+                        job.block.set_value(compress_block(job.data));
+                    } catch (...) {
+                        job.block.set_exception(std::current_exception());
+                    }
+                }
+            }));
+        }
+    }
+
+    bgzf_streambuf::~bgzf_streambuf() {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    void bgzf_streambuf::close() {
+        if (closed) return;
+
+        sync();
+        os.write(bgzf_eof, sizeof(bgzf_eof) - 1);
+        os.flush();
+
+        jobs.close();
+        for (auto& worker : workers) worker.join();
+        closed = true;
+    }
+
+    std::streamsize bgzf_streambuf::xsputn(const char* s, std::streamsize n) {
+        std::streamsize written = 0;
+        while (written < n) {
+            size_t chunk = std::min<size_t>(n - written, bgzf_block_size - block.size());
+            block.append(s + written, chunk);
+            written += chunk;
+            if (block.size() == bgzf_block_size) submit_block();
+        }
+
+        return written;
+    }
+
+    bgzf_streambuf::int_type bgzf_streambuf::overflow(int_type c) {
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+
+        char ch = traits_type::to_char_type(c);
+        xsputn(&ch, 1);
+        return c;
+    }
+
+    int bgzf_streambuf::sync() {
+        if (!block.empty()) submit_block();
+        write_blocks(0);
+        os.flush();
+        return os ? 0 : -1;
+    }
+
+    /* Hands the current block to the pool, writing the oldest blocks
+       first if too many are in flight. */
+    void bgzf_streambuf::submit_block() {
+        compression_job job;
+        job.data.swap(block);
+        block.reserve(bgzf_block_size);
+
+        pending.push_back(job.block.get_future());
+        jobs.push(std::move(job));
+        write_blocks(max_pending);
+    }
+
+    /* Writes compressed blocks in order until at most keep remain in
+       flight. */
+    void bgzf_streambuf::write_blocks(size_t keep) {
+        while (pending.size() > keep) {
+            std::string compressed = pending.front().get();
+            pending.pop_front();
+            os.write(compressed.data(), compressed.size());
+        }
+    }
+};
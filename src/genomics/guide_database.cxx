@@ -0,0 +1,509 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "genomics/guide_database.hpp"
+#include "genomics/merge.hpp"
+
+namespace genomics {
+
+    /*
+      Every section starts at a multiple of 8 bytes. The genome and
+      PAM sections are text, one "name\tlength" or PAM per line. The
+      other sections are columns with one entry per guide, in the
+      order of the keys, except for the bucket directory: entry i is
+      the first guide whose key starts with the bucket_bits bits of i.
+    */
+    struct guide_database_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t protospacer_length;
+        uint32_t distances;
+        uint32_t bucket_bits;
+        uint32_t encoding;
+        uint32_t reserved;
+        uint64_t guides;
+
+        uint64_t genome_offset, genome_size;
+        uint64_t pams_offset, pams_size;
+        uint64_t buckets_offset;              // uint64_t[2^bucket_bits + 1]
+        uint64_t keys_offset;                 // uint64_t[guides]
+        uint64_t n_masks_offset;              // uint32_t[guides]
+        uint64_t references_offset;           // uint32_t[guides]
+        uint64_t positions_offset;            // uint32_t[guides]
+        uint64_t flags_offset;                // uint8_t[guides]
+        uint64_t counts_offset;               // uint32_t[guides * distances]
+        uint64_t off_target_offsets_offset;   // uint64_t[guides]
+        uint64_t off_target_lengths_offset;   // uint32_t[guides]
+        uint64_t off_targets_offset, off_targets_size;
+    };
+
+    namespace {
+        const char guide_database_magic[8] = {'G', 'S', 'G', 'U', 'I', 'D', 'E', 'S'};
+        const uint32_t guide_database_version = 1;
+        const uint32_t max_bucket_bits = 24;
+
+        /* Flags of a guide: the strand in the lowest bit, the index
+           of its PAM above it. */
+        const uint8_t negative_strand = 1;
+        const size_t max_pams = 128;
+
+        /*
+          Packs a protospacer into the leading 2 bits per base of a
+          key, so that keys sort like the protospacers, and marks the
+          bases that are N in n_mask. Returns false if it is not DNA.
+        */
+        bool pack_protospacer(const char* sequence, size_t length, uint64_t& key, uint32_t& n_mask) {
+            key = 0;
+            n_mask = 0;
+            for (size_t i = 0; i < length; i++) {
+                uint64_t code;
+                switch (std::toupper(static_cast<unsigned char>(sequence[i]))) {
+                case 'A': code = 0; break;
+                case 'C': code = 1; break;
+                case 'G': code = 2; break;
+                case 'T': code = 3; break;
+                case 'N': code = 0; n_mask |= 1u << i; break;
+                default: return false;
+                }
+
+                key |= code << (62 - 2 * i);
+            }
+
+            return true;
+        }
+
+        std::string unpack_protospacer(uint64_t key, uint32_t n_mask, size_t length) {
+            static const char bases[] = "ACGT";
+
+            std::string sequence(length, 'N');
+            for (size_t i = 0; i < length; i++) {
+                if (!(n_mask & (1u << i))) sequence[i] = bases[(key >> (62 - 2 * i)) & 3];
+            }
+
+            return sequence;
+        }
+
+        size_t bucket(uint64_t key, uint32_t bucket_bits) {
+            return bucket_bits == 0 ? 0 : key >> (64 - bucket_bits);
+        }
+
+        uint64_t align(uint64_t offset) {
+            return (offset + 7) & ~static_cast<uint64_t>(7);
+        }
+
+        /* A guide being packed; its counts are kept apart, at row. */
+        struct packed_guide {
+            uint64_t key;
+            uint32_t n_mask;
+            uint32_t reference;
+            uint32_t position;
+            uint32_t off_targets_length;
+            uint64_t off_targets_offset;
+            uint64_t row;
+            uint8_t flags;
+        };
+
+        bool operator<(const packed_guide& a, const packed_guide& b) {
+            if (a.key != b.key) return a.key < b.key;
+            if (a.n_mask != b.n_mask) return a.n_mask < b.n_mask;
+            if (a.reference != b.reference) return a.reference < b.reference;
+            if (a.position != b.position) return a.position < b.position;
+            return a.flags < b.flags;
+        }
+
+        std::vector<std::string> split_fields(const std::string& line) {
+            std::vector<std::string> fields;
+            size_t start = 0;
+            while (true) {
+                size_t end = line.find('\t', start);
+                fields.push_back(line.substr(start, end == std::string::npos ? end : end - start));
+                if (end == std::string::npos) return fields;
+                start = end + 1;
+            }
+        }
+
+        template <class T>
+        void write_column(std::ostream& os, const std::vector<T>& column) {
+            os.write(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(T));
+        }
+
+        void pad_to(std::ostream& os, uint64_t offset) {
+            static const char zeros[8] = {0};
+            os.write(zeros, offset - static_cast<uint64_t>(os.tellp()));
+        }
+    };
+
+    void pack_guide_database(const std::string& database, const std::string& output,
+                             size_t protospacer_length) {
+        if (protospacer_length == 0 || protospacer_length > 32) {
+            throw std::runtime_error("protospacers must be between 1 and 32 bases long");
+        }
+
+        std::ifstream is(database);
+        if (!is) throw std::runtime_error("could not read database \"" + database + "\"");
+        if (is.peek() == 0x1f) {
+            throw std::runtime_error("database \"" + database + "\" is BAM; pack takes SAM databases");
+        }
+
+        genome_structure gs;
+        std::unordered_map<std::string, uint32_t> references;
+        for (const auto& line : read_sam_header(is)) {
+            if (line.compare(0, 3, "@SQ") != 0) continue;
+
+            chromosome chr = {"", 0};
+            for (const auto& field : split_fields(line)) {
+                if (field.compare(0, 3, "SN:") == 0) chr.name = field.substr(3);
+                if (field.compare(0, 3, "LN:") == 0) chr.length = std::stoull(field.substr(3));
+            }
+
+            references[chr.name] = gs.size();
+            gs.push_back(chr);
+        }
+
+        std::vector<std::string> pams;
+        std::unordered_map<std::string, uint8_t> pam_indexes;
+        std::vector<packed_guide> guides;
+        std::vector<uint32_t> counts;
+        size_t distances = 0;
+
+        std::string off_targets_file = output + ".offtargets";
+        std::ofstream off_targets_os(off_targets_file, std::ios::binary);
+        if (!off_targets_os) {
+            throw std::runtime_error("could not create temporary file \"" + off_targets_file + "\"");
+        }
+
+        off_target_encoder encoder(0, off_target_encoding::compact);
+        off_target_encoding encoding = off_target_encoding::hex;
+        std::string encoded;
+        uint64_t off_targets_size = 0;
+
+        std::string line;
+        while (std::getline(is, line)) {
+            if (line.empty()) continue;
+
+            auto fields = split_fields(line);
+            packed_guide guide;
+            if (fields.size() < 11 || fields[0].length() < protospacer_length ||
+                !pack_protospacer(fields[0].data(), protospacer_length, guide.key, guide.n_mask)) {
+                throw std::runtime_error("malformed SAM record \"" + line.substr(0, 80) + "\"");
+            }
+
+            auto reference = references.find(fields[2]);
+            if (reference == references.end()) {
+                throw std::runtime_error("SAM record on unknown reference \"" + line.substr(0, 80) + "\"");
+            }
+
+            uint64_t position = std::stoull(fields[3]);
+            if (position == 0 || position > std::numeric_limits<uint32_t>::max()) {
+                throw std::runtime_error("SAM record out of range \"" + line.substr(0, 80) + "\"");
+            }
+
+            std::string pam = fields[0].substr(protospacer_length);
+            auto pam_index = pam_indexes.find(pam);
+            if (pam_index == pam_indexes.end()) {
+                if (pams.size() == max_pams) throw std::runtime_error("database has too many PAMs");
+                pam_index = pam_indexes.insert(std::make_pair(pam, pams.size())).first;
+                pams.push_back(pam);
+            }
+
+            std::vector<std::vector<int64_t>> off_targets;
+            for (size_t i = 11; i < fields.size(); i++) {
+                for (auto tag_encoding : {off_target_encoding::hex, off_target_encoding::compact}) {
+                    std::string tag = std::string(off_target_tag(tag_encoding)) + ":H:";
+                    if (fields[i].compare(0, tag.length(), tag) != 0) continue;
+                    off_targets = decode_off_targets(fields[i].substr(tag.length()), tag_encoding);
+                    encoding = tag_encoding;
+                }
+            }
+
+            /* The counts are stored distances per guide, which grows
+               with the first guide that has an off-target further away. */
+            if (off_targets.size() > distances) {
+                std::vector<uint32_t> wider(guides.size() * off_targets.size(), 0);
+                for (size_t row = 0; row < guides.size(); row++) {
+                    std::copy(counts.begin() + row * distances, counts.begin() + (row + 1) * distances,
+                              wider.begin() + row * off_targets.size());
+                }
+
+                counts.swap(wider);
+                distances = off_targets.size();
+            }
+
+            for (size_t distance = 0; distance < distances; distance++) {
+                counts.push_back(distance < off_targets.size() ? off_targets[distance].size() : 0);
+            }
+
+            encoded.clear();
+            encoder.append_binary(encoded, off_targets);
+            off_targets_os.write(encoded.data(), encoded.size());
+
+            guide.reference = reference->second;
+            guide.position = position - 1;
+            guide.off_targets_offset = off_targets_size;
+            guide.off_targets_length = encoded.size();
+            guide.row = guides.size();
+            guide.flags = pam_index->second << 1 | ((std::stoul(fields[1]) & 16) ? negative_strand : 0);
+            guides.push_back(guide);
+
+            off_targets_size += encoded.size();
+        }
+
+        off_targets_os.close();
+        if (!off_targets_os) {
+            throw std::runtime_error("could not write temporary file \"" + off_targets_file + "\"");
+        }
+
+        std::sort(guides.begin(), guides.end());
+
+        std::ostringstream genome_text, pams_text;
+        for (const auto& chr : gs) genome_text << chr.name << "\t" << chr.length << "\n";
+        for (const auto& pam : pams) pams_text << pam << "\n";
+
+        uint32_t bucket_bits = 0;
+        while (bucket_bits < std::min<size_t>(2 * protospacer_length, max_bucket_bits) &&
+               (1ull << bucket_bits) < guides.size()) {
+            bucket_bits++;
+        }
+
+        std::vector<uint64_t> buckets((1ull << bucket_bits) + 1, guides.size());
+        for (size_t row = guides.size(); row-- > 0;) buckets[bucket(guides[row].key, bucket_bits)] = row;
+        for (size_t i = buckets.size() - 1; i-- > 0;) buckets[i] = std::min(buckets[i], buckets[i + 1]);
+
+        size_t n = guides.size();
+        guide_database_header header;
+        std::memset(&header, 0, sizeof(header));
+        std::copy(guide_database_magic, guide_database_magic + 8, header.magic);
+        header.version = guide_database_version;
+        header.protospacer_length = protospacer_length;
+        header.distances = distances;
+        header.bucket_bits = bucket_bits;
+        header.encoding = static_cast<uint32_t>(encoding);
+        header.guides = n;
+
+        uint64_t offset = align(sizeof(header));
+        auto place = [&](uint64_t& section, uint64_t bytes) {
+            section = offset;
+            offset = align(offset + bytes);
+        };
+
+        header.genome_size = genome_text.str().size();
+        header.pams_size = pams_text.str().size();
+        header.off_targets_size = off_targets_size;
+        place(header.genome_offset, header.genome_size);
+        place(header.pams_offset, header.pams_size);
+        place(header.buckets_offset, buckets.size() * sizeof(uint64_t));
+        place(header.keys_offset, n * sizeof(uint64_t));
+        place(header.n_masks_offset, n * sizeof(uint32_t));
+        place(header.references_offset, n * sizeof(uint32_t));
+        place(header.positions_offset, n * sizeof(uint32_t));
+        place(header.flags_offset, n * sizeof(uint8_t));
+        place(header.counts_offset, n * distances * sizeof(uint32_t));
+        place(header.off_target_offsets_offset, n * sizeof(uint64_t));
+        place(header.off_target_lengths_offset, n * sizeof(uint32_t));
+        place(header.off_targets_offset, off_targets_size);
+
+        std::ofstream os(output, std::ios::binary);
+        if (!os) throw std::runtime_error("could not create guide database \"" + output + "\"");
+
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        pad_to(os, header.genome_offset);
+        os << genome_text.str();
+        pad_to(os, header.pams_offset);
+        os << pams_text.str();
+        pad_to(os, header.buckets_offset);
+        write_column(os, buckets);
+
+        /* Writes one column at a time, gathered from the sorted guides. */
+        auto write_guide_column = [&](uint64_t section, const std::function<void(const packed_guide&)>& f) {
+            pad_to(os, section);
+            for (const auto& guide : guides) f(guide);
+        };
+        auto write_value = [&](const void* value, size_t bytes) {
+            os.write(static_cast<const char*>(value), bytes);
+        };
+
+        write_guide_column(header.keys_offset, [&](const packed_guide& g) { write_value(&g.key, 8); });
+        write_guide_column(header.n_masks_offset, [&](const packed_guide& g) { write_value(&g.n_mask, 4); });
+        write_guide_column(header.references_offset, [&](const packed_guide& g) { write_value(&g.reference, 4); });
+        write_guide_column(header.positions_offset, [&](const packed_guide& g) { write_value(&g.position, 4); });
+        write_guide_column(header.flags_offset, [&](const packed_guide& g) { write_value(&g.flags, 1); });
+        write_guide_column(header.counts_offset, [&](const packed_guide& g) {
+            write_value(counts.data() + g.row * distances, distances * sizeof(uint32_t));
+        });
+        write_guide_column(header.off_target_offsets_offset, [&](const packed_guide& g) {
+            write_value(&g.off_targets_offset, 8);
+        });
+        write_guide_column(header.off_target_lengths_offset, [&](const packed_guide& g) {
+            write_value(&g.off_targets_length, 4);
+        });
+
+        pad_to(os, header.off_targets_offset);
+        std::ifstream off_targets_is(off_targets_file, std::ios::binary);
+        if (off_targets_size > 0) os << off_targets_is.rdbuf();
+        off_targets_is.close();
+        std::remove(off_targets_file.c_str());
+
+        if (!os.flush() || static_cast<uint64_t>(os.tellp()) != header.off_targets_offset + off_targets_size) {
+            throw std::runtime_error("could not write guide database \"" + output + "\"");
+        }
+    }
+
+    guide_database::guide_database(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("could not open guide database \"" + filename + "\"");
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(guide_database_header)) {
+            close(fd);
+            throw std::runtime_error("\"" + filename + "\" is not a guide database");
+        }
+
+        length = st.st_size;
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) throw std::runtime_error("could not map guide database \"" + filename + "\"");
+        data = static_cast<const char*>(mapped);
+
+        try {
+            read_header();
+        } catch (const std::runtime_error& e) {
+            munmap(const_cast<char*>(data), length);
+            throw std::runtime_error("\"" + filename + "\" is not a valid guide database: " + e.what());
+        }
+    }
+
+    guide_database::~guide_database() {
+        munmap(const_cast<char*>(data), length);
+    }
+
+    void guide_database::read_header() {
+        header = reinterpret_cast<const guide_database_header*>(data);
+        if (!std::equal(guide_database_magic, guide_database_magic + 8, header->magic)) {
+            throw std::runtime_error("bad magic number");
+        }
+
+        if (header->version != guide_database_version) {
+            throw std::runtime_error("unsupported version " + std::to_string(header->version));
+        }
+
+        if (header->bucket_bits > max_bucket_bits || header->protospacer_length == 0 ||
+            header->protospacer_length > 32 || header->encoding > 1) {
+            throw std::runtime_error("corrupt header");
+        }
+
+        off_targets_encoding = static_cast<off_target_encoding>(header->encoding);
+
+        /* Checks that every section lies within the file once, so
+           that lookups need not. */
+        uint64_t n = header->guides;
+        section<uint64_t>(header->buckets_offset, (1ull << header->bucket_bits) + 1);
+        section<uint64_t>(header->keys_offset, n);
+        section<uint32_t>(header->n_masks_offset, n);
+        section<uint32_t>(header->references_offset, n);
+        section<uint32_t>(header->positions_offset, n);
+        section<uint8_t>(header->flags_offset, n);
+        section<uint32_t>(header->counts_offset, n * header->distances);
+        section<uint64_t>(header->off_target_offsets_offset, n);
+        section<uint32_t>(header->off_target_lengths_offset, n);
+        section<char>(header->off_targets_offset, header->off_targets_size);
+
+        std::istringstream genome_text(std::string(section<char>(header->genome_offset, header->genome_size),
+                                                   header->genome_size));
+        chromosome chr;
+        while (genome_text >> chr.name >> chr.length) gs.push_back(chr);
+
+        std::istringstream pams_text(std::string(section<char>(header->pams_offset, header->pams_size),
+                                                 header->pams_size));
+        std::string pam;
+        while (std::getline(pams_text, pam)) pams.push_back(pam);
+    }
+
+    template <class T>
+    const T* guide_database::section(uint64_t offset, uint64_t count) const {
+        if (offset % alignof(T) != 0 || offset > length || count > (length - offset) / sizeof(T)) {
+            throw std::runtime_error("truncated section");
+        }
+
+        return reinterpret_cast<const T*>(data + offset);
+    }
+
+    size_t guide_database::protospacer_length() const {
+        return header->protospacer_length;
+    }
+
+    size_t guide_database::size() const {
+        return header->guides;
+    }
+
+    std::vector<guide_record> guide_database::find(const std::string& sequence) const {
+        uint64_t key;
+        uint32_t n_mask;
+        if (sequence.length() < header->protospacer_length ||
+            !pack_protospacer(sequence.data(), header->protospacer_length, key, n_mask)) {
+            throw std::runtime_error("\"" + sequence + "\" is not a protospacer of " +
+                                     std::to_string(header->protospacer_length) + " bases");
+        }
+
+        const uint64_t* buckets = section<uint64_t>(header->buckets_offset, (1ull << header->bucket_bits) + 1);
+        const uint64_t* keys = section<uint64_t>(header->keys_offset, header->guides);
+        const uint32_t* n_masks = section<uint32_t>(header->n_masks_offset, header->guides);
+
+        size_t b = bucket(key, header->bucket_bits);
+        size_t first = std::min(buckets[b], header->guides);
+        size_t last = std::min(std::max(buckets[b + 1], first), header->guides);
+        auto range = std::equal_range(keys + first, keys + last, key);
+
+        std::vector<guide_record> guides;
+        for (auto it = range.first; it != range.second; ++it) {
+            size_t row = it - keys;
+            if (n_masks[row] == n_mask) guides.push_back(read_guide(row));
+        }
+
+        return guides;
+    }
+
+    guide_record guide_database::read_guide(size_t row) const {
+        uint64_t n = header->guides;
+        uint64_t key = section<uint64_t>(header->keys_offset, n)[row];
+        uint32_t n_mask = section<uint32_t>(header->n_masks_offset, n)[row];
+        uint32_t reference = section<uint32_t>(header->references_offset, n)[row];
+        uint32_t position = section<uint32_t>(header->positions_offset, n)[row];
+        uint8_t flags = section<uint8_t>(header->flags_offset, n)[row];
+        const uint32_t* counts = section<uint32_t>(header->counts_offset, n * header->distances);
+        uint64_t off_targets_offset = section<uint64_t>(header->off_target_offsets_offset, n)[row];
+        uint32_t off_targets_length = section<uint32_t>(header->off_target_lengths_offset, n)[row];
+        const char* off_targets = section<char>(header->off_targets_offset, header->off_targets_size);
+
+        if (reference >= gs.size() || static_cast<size_t>(flags >> 1) >= pams.size() ||
+            off_targets_offset > header->off_targets_size ||
+            off_targets_length > header->off_targets_size - off_targets_offset) {
+            throw std::runtime_error("corrupt guide in guide database");
+        }
+
+        guide_record guide;
+        guide.k.sequence = unpack_protospacer(key, n_mask, header->protospacer_length);
+        guide.k.pam = pams[flags >> 1];
+        guide.k.dir = flags & negative_strand ? direction::negative : direction::positive;
+        guide.coords = {gs[reference], position};
+        guide.k.absolute_coords = resolve_relative(gs, guide.coords) + position;
+        guide.counts.assign(counts + row * header->distances, counts + (row + 1) * header->distances);
+
+        /* A guide may have fewer distances than the widest guide. */
+        guide.off_targets = decode_binary_off_targets(off_targets + off_targets_offset, off_targets_length);
+        if (guide.off_targets.size() < header->distances) guide.off_targets.resize(header->distances);
+        return guide;
+    }
+};
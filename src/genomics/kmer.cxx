@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <ostream>
 #include <functional>
 
@@ -6,43 +7,97 @@
 #include "genomics/seq_io.hpp"
 
 namespace genomics {
+    namespace {
+        /* Whether the characters at window match the pattern, with
+           'N' in the pattern matching anything. */
+        inline bool matches_at(const char* window, const std::string& pattern) {
+            for (size_t i = 0; i < pattern.length(); i++) {
+                if (pattern[i] != 'N' && window[i] != pattern[i]) return false;
+            }
+
+            return true;
+        }
+    };
+
     seq_kmer_producer::seq_kmer_producer(const std::string& sequence_file, genome_structure gs,
-                                         size_t k, const std::string &pam, size_t min_chr_length)
+                                         size_t k, const std::string &pam, size_t min_chr_length,
+                                         size_t start, size_t end)
         : sequence(new std::ifstream(sequence_file)),
           gs(gs),
           min_chr_length(min_chr_length),
 	  pam(pam),
+          pam_c(reverse_complement(pam)),
 	  k(k),
-	  kmer_buffer(k + pam.length())
+          stream_position(start),
+          end_position(end),
+          buffer_start(start)
     {
+        if (!this->gs.empty()) chr_end = this->gs[0].length;
+        if (start > 0) sequence->seekg(start, std::ios_base::beg);
     }
 
+    /* Drops the characters before stream_position and appends the
+       next block, returning false once nothing is left to read. */
+    bool seq_kmer_producer::fill_buffer() {
+        size_t keep = buffer_start + buffer_length - stream_position;
+        std::copy(buffer.end() - keep, buffer.end(), buffer.begin());
+
+        /* Nothing past the last window of the range is needed. */
+        size_t window = k + pam.length();
+        size_t wanted = block_size;
+        if (end_position - stream_position < block_size) {
+            wanted = end_position - stream_position + window - 1 - keep;
+        }
+
+        buffer.resize(keep + wanted);
+        sequence->read(buffer.data() + keep, wanted);
+        size_t read = sequence->gcount();
+
+        buffer.resize(keep + read);
+        buffer_start = stream_position;
+        buffer_length = keep + read;
+        return read > 0;
+    }
+
+    /*
+      A window on the antisense strand reads as the reverse complement
+      of kmer + PAM, so it starts with the reverse complement of the
+      PAM. Both strands are reported at the start of the window, and
+      the chromosome is that of the start as well.
+    */
     size_t seq_kmer_producer::get_next_kmer(kmer& out_kmer) {
-        while (kmer_queue.empty()) {
-            sequence->seekg(stream_position, std::ios_base::beg);
-            sequence->read(kmer_buffer.data(), kmer_buffer.size());
+        size_t window = k + pam.length();
 
-            if (!(*sequence)) return 0;
+        while (kmer_queue.empty()) {
+            if (stream_position >= end_position) return 0;
 
-            std::string kmer_str(kmer_buffer.data(), kmer_buffer.size());
-            std::string kmer_str_c = reverse_complement(kmer_str);
+            if (stream_position + window > buffer_start + buffer_length) {
+                if (!fill_buffer()) return 0;
+                continue;
+            }
 
-            if (pam_matches(kmer_str, pam)) {
-                kmer kmer = {kmer_str.substr(0, k),
-                             pam,
-                             stream_position,
-                             direction::positive};
-                coordinates c = resolve_absolute(gs, kmer.absolute_coords);
-                if (c.chr.length > min_chr_length) kmer_queue.push(kmer);
+            while (chr + 1 < gs.size() && stream_position >= chr_end) {
+                chr++;
+                chr_end += gs[chr].length;
             }
 
-            if (pam_matches(kmer_str_c, pam)) {
-                kmer kmer = {kmer_str_c.substr(0, k),
-                             pam,
-                             stream_position,
-                             direction::negative};
-                coordinates c = resolve_absolute(gs, kmer.absolute_coords);
-                if (c.chr.length > min_chr_length) kmer_queue.push(kmer);
+            const char* w = buffer.data() + (stream_position - buffer_start);
+            if (chr < gs.size() && gs[chr].length > min_chr_length) {
+                if (matches_at(w + k, pam)) {
+                    kmer kmer = {std::string(w, k),
+                                 pam,
+                                 stream_position,
+                                 direction::positive};
+                    kmer_queue.push(kmer);
+                }
+
+                if (matches_at(w, pam_c)) {
+                    kmer kmer = {reverse_complement(std::string(w + pam.length(), k)),
+                                 pam,
+                                 stream_position,
+                                 direction::negative};
+                    kmer_queue.push(kmer);
+                }
             }
 
             stream_position++;
@@ -54,6 +109,37 @@ namespace genomics {
     }
 
 
+    shard_kmer_producer::shard_kmer_producer(const std::string& sequence_file, genome_structure gs,
+                                             size_t k, const std::string &pam, size_t min_chr_length,
+                                             size_t shard, size_t shards, size_t stripe_size)
+        : sequence_file(sequence_file),
+          pam(pam),
+          gs(gs),
+          k(k),
+          min_chr_length(min_chr_length),
+          shard(shard),
+          shards(shards),
+          stripe_size(stripe_size),
+          sequence_length(0),
+          next_stripe(shard)
+    {
+        for (const chromosome& chr : this->gs) sequence_length += chr.length;
+    }
+
+    size_t shard_kmer_producer::get_next_kmer(kmer& out_kmer) {
+        while (!stripe || !stripe->get_next_kmer(out_kmer)) {
+            size_t start = next_stripe * stripe_size;
+            if (start >= sequence_length) return 0;
+
+            size_t end = std::min(start + stripe_size, sequence_length);
+            stripe.reset(new seq_kmer_producer(sequence_file, gs, k, pam, min_chr_length, start, end));
+            next_stripe += shards;
+        }
+
+        kmers++;
+        return 1;
+    }
+
     kmers_file_producer::kmers_file_producer(const std::string& kmers_file)
 	: kmers_stream(new std::ifstream(kmers_file))
     {}
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "genomics/merge.hpp"
+#include "genomics/off_targets.hpp"
+#include "genomics/seq_io.hpp"
+#include "genomics/sorted_output.hpp"
+#include "genomics/structures.hpp"
+
+namespace genomics {
+    namespace {
+        typedef std::unordered_map<std::string, size_t> reference_map;
+
+        /* A SAM record keyed by the rank of its reference sequence in
+           the header and its position. */
+        struct sam_record {
+            size_t reference;
+            size_t position;
+            std::string line;
+        };
+
+        /* Orders by coordinate, and records at the same coordinate by
+           their text so that the merged database is deterministic. */
+        bool operator<(const sam_record& a, const sam_record& b) {
+            if (a.reference != b.reference) return a.reference < b.reference;
+            if (a.position != b.position) return a.position < b.position;
+            return a.line < b.line;
+        }
+
+        bool operator>(const sam_record& a, const sam_record& b) {
+            return b < a;
+        }
+
+        sam_record parse_record(std::string line, const reference_map& references) {
+            size_t rname = line.find('\t', line.find('\t') + 1);
+            size_t pos = rname == std::string::npos ? rname : line.find('\t', rname + 1);
+            if (pos == std::string::npos) {
+                throw std::runtime_error("malformed SAM record \"" + line.substr(0, 80) + "\"");
+            }
+
+            auto reference = references.find(line.substr(rname + 1, pos - rname - 1));
+            if (reference == references.end()) {
+                throw std::runtime_error("SAM record on unknown reference \"" + line.substr(0, 80) + "\"");
+            }
+
+            size_t position = std::stoull(line.substr(pos + 1, line.find('\t', pos + 1) - pos - 1));
+            return {reference->second, position, std::move(line)};
+        }
+
+        /* Reads the next record of a sorted run, returning false at
+           its end. */
+        bool read_record(std::istream& is, const reference_map& references, sam_record& record) {
+            std::string line;
+            while (std::getline(is, line)) {
+                if (line.empty()) continue;
+                record = parse_record(std::move(line), references);
+                return true;
+            }
+
+            return false;
+        }
+
+        /* Rewrites the off-target tag of a record in the encoding of
+           the encoder, leaving records already in it untouched. */
+        void reencode_off_targets(std::string& line, const off_target_encoder& encoder,
+                                  std::string& reencoded) {
+            for (auto encoding : {off_target_encoding::hex, off_target_encoding::compact}) {
+                if (encoding == encoder.get_encoding()) continue;
+
+                std::string tag = std::string("\t") + off_target_tag(encoding) + ":H:";
+                size_t start = line.find(tag);
+                if (start == std::string::npos) continue;
+
+                size_t value = start + tag.length();
+                size_t end = std::min(line.find('\t', value), line.length());
+                auto off_targets = decode_off_targets(line.substr(value, end - value), encoding);
+
+                reencoded.assign(line, 0, start);
+                reencoded.append("\t").append(off_target_tag(encoder.get_encoding())).append(":H:");
+                encoder.append(reencoded, off_targets);
+                reencoded.append(line, end, std::string::npos);
+                line.swap(reencoded);
+            }
+        }
+
+        std::vector<std::string> reference_lines(const std::vector<std::string>& header) {
+            std::vector<std::string> lines;
+            for (const auto& line : header) {
+                if (line.compare(0, 3, "@SQ") == 0) lines.push_back(line);
+            }
+
+            return lines;
+        }
+    };
+
+    std::vector<std::string> read_sam_header(std::istream& sam_is) {
+        std::vector<std::string> header;
+        while (sam_is.peek() == '@') {
+            std::string line;
+            std::getline(sam_is, line);
+            header.push_back(line);
+        }
+
+        return header;
+    }
+
+    genome_structure read_sam_genome(const std::vector<std::string>& header) {
+        genome_structure gs;
+        for (const auto& line : reference_lines(header)) {
+            chromosome chr = {"", 0};
+            size_t field = 0;
+            while ((field = line.find('\t', field)) != std::string::npos) {
+                size_t end = std::min(line.find('\t', field + 1), line.length());
+                std::string value = line.substr(field + 4, end - field - 4);
+                if (line.compare(field + 1, 3, "SN:") == 0) chr.name = value;
+                if (line.compare(field + 1, 3, "LN:") == 0) chr.length = std::stoull(value);
+                field = end;
+            }
+
+            gs.push_back(chr);
+        }
+
+        return gs;
+    }
+
+    void check_shard_manifests(const std::vector<std::string>& databases) {
+        std::vector<shard_manifest> manifests;
+        std::vector<std::string> missing;
+        for (const auto& database : databases) {
+            shard_manifest manifest;
+            if (seq_io::load_from_file(manifest, database + ".manifest")) {
+                manifests.push_back(manifest);
+            } else {
+                missing.push_back(database);
+            }
+        }
+
+        if (manifests.empty()) return;
+
+        if (!missing.empty()) {
+            throw std::runtime_error("database \"" + missing[0] + "\" has no shard manifest,"
+                                     " its shard may not have completed");
+        }
+
+        const shard_manifest& first = manifests[0];
+        std::vector<bool> seen(first.shards, false);
+        for (size_t i = 0; i < manifests.size(); i++) {
+            const shard_manifest& m = manifests[i];
+            if (m.genome_length != first.genome_length || m.shards != first.shards ||
+                m.stripe_size != first.stripe_size || m.kmer_length != first.kmer_length ||
+                m.min_chr_length != first.min_chr_length || m.pam != first.pam ||
+                m.alt_pams != first.alt_pams || m.mismatches != first.mismatches ||
+                m.threshold != first.threshold) {
+                throw std::runtime_error("databases \"" + databases[0] + "\" and \"" + databases[i] +
+                                         "\" are shards of different builds");
+            }
+
+            if (m.shard >= m.shards) {
+                throw std::runtime_error("database \"" + databases[i] + "\" is shard " +
+                                         std::to_string(m.shard) + " of only " +
+                                         std::to_string(m.shards));
+            }
+
+            if (seen[m.shard]) {
+                throw std::runtime_error("shard " + std::to_string(m.shard) + "/" +
+                                         std::to_string(m.shards) + " is given twice");
+            }
+            seen[m.shard] = true;
+        }
+
+        for (size_t shard = 0; shard < seen.size(); shard++) {
+            if (!seen[shard]) {
+                throw std::runtime_error("shard " + std::to_string(shard) + "/" +
+                                         std::to_string(seen.size()) + " is missing");
+            }
+        }
+    }
+
+    void merge_sam_files(const std::vector<std::string>& databases, const std::string& output,
+                         size_t memory_budget, bool reencode, off_target_encoding encoding) {
+        std::vector<std::string> references_header;
+        for (const auto& database : databases) {
+            std::ifstream is(database);
+            if (!is) throw std::runtime_error("could not read database \"" + database + "\"");
+            if (is.peek() == 0x1f) {
+                throw std::runtime_error("database \"" + database +
+                                         "\" is BAM; merge takes SAM databases");
+            }
+
+            auto lines = reference_lines(read_sam_header(is));
+            if (&database == &databases[0]) {
+                references_header = lines;
+            } else if (lines != references_header) {
+                throw std::runtime_error("databases \"" + databases[0] + "\" and \"" + database +
+                                         "\" have different reference sequences");
+            }
+        }
+
+        /* Records are indexed by their absolute coordinate, from the
+           start of their reference sequence. */
+        genome_structure gs = read_sam_genome(references_header);
+        reference_map references;
+        std::vector<size_t> reference_starts;
+        int64_t genome_length = 0;
+        for (const auto& chr : gs) {
+            size_t rank = references.size();
+            references[chr.name] = rank;
+            reference_starts.push_back(genome_length);
+            genome_length += chr.length;
+        }
+
+        /* The delimiter of the hex encoding, as computed by get_delim. */
+        off_target_encoder encoder(-(genome_length + 1), encoding);
+        std::string reencoded;
+
+        std::ofstream os(output);
+        if (!os) throw std::runtime_error("could not create database \"" + output + "\"");
+
+        os << "@HD\tVN:1.0\tSO:coordinate\n";
+        for (const auto& line : references_header) os << line << "\n";
+
+        region_indexer indexer(gs);
+        uint64_t offset = os.tellp();
+        auto write_record = [&](const sam_record& record) {
+            indexer.add(reference_starts[record.reference] + record.position - 1, offset);
+            os << record.line << "\n";
+            offset += record.line.length() + 1;
+        };
+
+        /* The region index is written once the database is complete. */
+        auto finish = [&]() {
+            if (!os.flush()) throw std::runtime_error("could not write database \"" + output + "\"");
+            seq_io::write_to_file(indexer.finish(offset), output + ".regions");
+        };
+
+        /* Sorts the records read so far into a run, written to a
+           temporary file unless they are the only run. */
+        std::vector<sam_record> run;
+        size_t run_bytes = 0;
+        std::vector<std::string> run_files;
+
+        auto spill = [&]() {
+            std::sort(run.begin(), run.end());
+
+            std::string run_file = output + ".run" + std::to_string(run_files.size());
+            std::ofstream run_os(run_file);
+            for (const auto& record : run) run_os << record.line << "\n";
+            if (!run_os) throw std::runtime_error("could not write run file \"" + run_file + "\"");
+
+            run_files.push_back(run_file);
+            run.clear();
+            run_bytes = 0;
+        };
+
+        for (const auto& database : databases) {
+            std::ifstream is(database);
+            read_sam_header(is);
+
+            std::string line;
+            while (std::getline(is, line)) {
+                if (line.empty()) continue;
+                if (reencode) reencode_off_targets(line, encoder, reencoded);
+
+                run_bytes += line.capacity() + sizeof(sam_record);
+                run.push_back(parse_record(std::move(line), references));
+                if (run_bytes >= memory_budget) spill();
+            }
+        }
+
+        if (run_files.empty()) {
+            std::sort(run.begin(), run.end());
+            for (const auto& record : run) write_record(record);
+            finish();
+            return;
+        }
+
+        if (!run.empty()) spill();
+
+        typedef std::pair<sam_record, size_t> head;
+        auto later = [](const head& a, const head& b) { return a.first > b.first; };
+        std::priority_queue<head, std::vector<head>, decltype(later)> heads(later);
+
+        std::vector<std::unique_ptr<std::ifstream>> runs;
+        for (size_t i = 0; i < run_files.size(); i++) {
+            runs.emplace_back(new std::ifstream(run_files[i]));
+            sam_record record;
+            if (read_record(*runs[i], references, record)) heads.push(head(std::move(record), i));
+        }
+
+        while (!heads.empty()) {
+            head top = heads.top();
+            heads.pop();
+            write_record(top.first);
+
+            sam_record record;
+            if (read_record(*runs[top.second], references, record)) {
+                heads.push(head(std::move(record), top.second));
+            }
+        }
+
+        runs.clear();
+        for (const auto& run_file : run_files) std::remove(run_file.c_str());
+
+        finish();
+    }
+};
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "genomics/off_targets.hpp"
+
+namespace genomics {
+    namespace {
+        const char hex_digits[] = "0123456789abcdef";
+
+        void append_byte(std::string& out, uint8_t byte, bool hex = true) {
+            if (!hex) {
+                out += static_cast<char>(byte);
+                return;
+            }
+
+            out += hex_digits[byte >> 4];
+            out += hex_digits[byte & 0xf];
+        }
+
+        /* Appends n 7 bits at a time, lowest first, with the high bit
+           set on all but the last byte. */
+        void append_varint(std::string& out, uint64_t n, bool hex) {
+            while (n >= 0x80) {
+                append_byte(out, static_cast<uint8_t>(n & 0x7f) | 0x80, hex);
+                n >>= 7;
+            }
+
+            append_byte(out, static_cast<uint8_t>(n), hex);
+        }
+
+        /* Antisense positions are negative, and may be 0. */
+        uint64_t position_key(int64_t position) {
+            return position > 0 ? static_cast<uint64_t>(position) << 1
+                                : static_cast<uint64_t>(-position) << 1 | 1;
+        }
+
+        int64_t key_position(uint64_t key) {
+            int64_t position = static_cast<int64_t>(key >> 1);
+            return key & 1 ? -position : position;
+        }
+
+        int hex_value(char c) {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            throw std::runtime_error("malformed off-target tag: invalid hex digit");
+        }
+
+        /* Reads the bytes of a hex string, or of raw data, in order. */
+        class byte_reader {
+        public:
+            byte_reader(const char* data, size_t length, bool hex)
+                : data(data), length(length), hex(hex) {
+                if (hex && length % 2 != 0) {
+                    throw std::runtime_error("malformed off-target tag: odd number of hex digits");
+                }
+            }
+
+            bool done() const { return at == length; }
+
+            uint8_t byte() {
+                if (done()) throw std::runtime_error("malformed off-target tag: truncated value");
+                if (!hex) return static_cast<uint8_t>(data[at++]);
+
+                uint8_t b = static_cast<uint8_t>(hex_value(data[at]) << 4 | hex_value(data[at + 1]));
+                at += 2;
+                return b;
+            }
+
+            uint64_t varint() {
+                uint64_t n = 0;
+                for (size_t shift = 0; shift < 64; shift += 7) {
+                    uint8_t b = byte();
+                    n |= static_cast<uint64_t>(b & 0x7f) << shift;
+                    if (!(b & 0x80)) return n;
+                }
+
+                throw std::runtime_error("malformed off-target tag: varint too long");
+            }
+
+            int64_t little_endian() {
+                uint64_t n = 0;
+                for (size_t i = 0; i < 8; i++) n |= static_cast<uint64_t>(byte()) << (8 * i);
+                return static_cast<int64_t>(n);
+            }
+
+        private:
+            const char* data;
+            size_t length;
+            bool hex;
+            size_t at = 0;
+        };
+
+        std::vector<std::vector<int64_t>> decode_hex(const std::string& value) {
+            byte_reader reader(value.data(), value.length(), true);
+            std::vector<int64_t> numbers;
+            while (!reader.done()) numbers.push_back(reader.little_endian());
+            if (numbers.empty()) return {};
+
+            /* Every group ends with its distance and the delimiter, so
+               the last number is the delimiter. */
+            int64_t delim = numbers.back();
+            std::vector<std::vector<int64_t>> off_targets;
+            size_t group = 0;
+            for (size_t i = 0; i < numbers.size(); i++) {
+                if (numbers[i] != delim) continue;
+                if (i == group || numbers[i - 1] < 0) {
+                    throw std::runtime_error("malformed off-target tag: group without distance");
+                }
+
+                size_t distance = numbers[i - 1];
+                if (distance >= off_targets.size()) off_targets.resize(distance + 1);
+                off_targets[distance].insert(off_targets[distance].end(),
+                                             numbers.begin() + group, numbers.begin() + i - 1);
+                group = i + 1;
+            }
+
+            return off_targets;
+        }
+
+        std::vector<std::vector<int64_t>> decode_compact(byte_reader& reader, size_t length) {
+            std::vector<std::vector<int64_t>> off_targets;
+            while (!reader.done()) {
+                uint64_t distance = reader.varint();
+                uint64_t count = reader.varint();
+                if (distance > 0xff || count > length) {
+                    throw std::runtime_error("malformed off-target tag: invalid group");
+                }
+
+                if (distance >= off_targets.size()) off_targets.resize(distance + 1);
+                uint64_t key = 0;
+                for (uint64_t i = 0; i < count; i++) {
+                    key += reader.varint();
+                    off_targets[distance].push_back(key_position(key));
+                }
+            }
+
+            return off_targets;
+        }
+    };
+
+    const char* off_target_tag(off_target_encoding encoding) {
+        return encoding == off_target_encoding::compact ? "oc" : "of";
+    }
+
+    void off_target_encoder::append(std::string& out,
+                                    const std::vector<std::vector<int64_t>>& off_targets) const {
+        if (encoding == off_target_encoding::compact) {
+            append_compact(out, off_targets, true);
+            return;
+        }
+
+        /* Each number as its 8 bytes in little endian order. */
+        auto append_number = [&](uint64_t n) {
+            for (size_t i = 0; i < sizeof(n); i++, n >>= 8) append_byte(out, n & 0xff);
+        };
+
+        for (uint64_t distance = 0; distance < off_targets.size(); distance++) {
+            sort_keys(off_targets[distance]);
+            for (uint64_t key : keys) append_number(key_position(key));
+            append_number(distance);
+            append_number(delim);
+        }
+    }
+
+    void off_target_encoder::append_binary(std::string& out,
+                                           const std::vector<std::vector<int64_t>>& off_targets) const {
+        append_compact(out, off_targets, false);
+    }
+
+    void off_target_encoder::append_compact(std::string& out,
+                                            const std::vector<std::vector<int64_t>>& off_targets,
+                                            bool hex) const {
+        /* Empty groups are skipped but the last, which keeps the
+           number of distances. */
+        for (uint64_t distance = 0; distance < off_targets.size(); distance++) {
+            if (off_targets[distance].empty() && distance + 1 < off_targets.size()) continue;
+
+            sort_keys(off_targets[distance]);
+            append_varint(out, distance, hex);
+            append_varint(out, keys.size(), hex);
+            uint64_t previous = 0;
+            for (uint64_t key : keys) {
+                append_varint(out, key - previous, hex);
+                previous = key;
+            }
+        }
+    }
+
+    void off_target_encoder::sort_keys(const std::vector<int64_t>& positions) const {
+        keys.clear();
+        for (int64_t position : positions) keys.push_back(position_key(position));
+        std::sort(keys.begin(), keys.end());
+    }
+
+    std::vector<std::vector<int64_t>> decode_off_targets(const std::string& value,
+                                                         off_target_encoding encoding) {
+        if (encoding == off_target_encoding::hex) return decode_hex(value);
+
+        byte_reader reader(value.data(), value.length(), true);
+        return decode_compact(reader, value.length());
+    }
+
+    std::vector<std::vector<int64_t>> decode_binary_off_targets(const char* data, size_t length) {
+        byte_reader reader(data, length, false);
+        return decode_compact(reader, length);
+    }
+};
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <utility>
+
+#include "genomics/kmer.hpp"
+#include "genomics/scheduler.hpp"
+
+namespace genomics {
+    window_reader::window_reader(kmer_producer& kmer_p, size_t skip_windows, size_t threads,
+                                 bounded_queue<kmer_window>& windows)
+        : kmer_p(kmer_p),
+          skip_windows(skip_windows),
+          threads(std::max<size_t>(threads, 1)),
+          windows(windows)
+    {}
+
+    bool window_reader::read(std::vector<kmer>& kmers, size_t& number) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (; skip_windows > 0 && !exhausted; skip_windows--) {
+            exhausted = kmer_p.get_next_kmers(kmers, schedule_window) == 0;
+        }
+
+        if (exhausted || closed) return false;
+        if (kmer_p.get_next_kmers(kmers, schedule_window) == 0) {
+            exhausted = true;
+            return false;
+        }
+
+        number = windows_read++;
+        return true;
+    }
+
+    bool window_reader::hand_on(size_t number, kmer_window window) {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            turn.wait(lock, [&]() { return closed || windows_handed_on == number; });
+            if (closed) return false;
+        }
+
+        /* Only the thread whose turn it is gets here, so the window
+           is pushed outside the lock and the others can read on. */
+        bool pushed = windows.push(std::move(window));
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            windows_handed_on++;
+            closed = closed || !pushed;
+        }
+        turn.notify_all();
+        return pushed;
+    }
+
+    void window_reader::leave() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (--threads == 0) windows.close();
+    }
+
+    guide_scheduler::guide_scheduler(bounded_queue<kmer_window>& windows, size_t workers,
+                                     size_t first_window)
+        : windows(windows),
+          next_window(first_window)
+    {
+        for (size_t i = 0; i < std::max<size_t>(workers, 1); i++) {
+            queues.emplace_back(new worker_queue());
+        }
+    }
+
+    bool guide_scheduler::next(size_t worker, scheduled_kmer& out_kmer) {
+        while (true) {
+            if (take(worker, out_kmer)) return true;
+
+            std::lock_guard<std::mutex> lock(refill_mtx);
+
+            /* Another worker may have refilled the queues meanwhile.
+               Once the producer is exhausted queues only shrink, so
+               finding them empty means every guide was handed out. */
+            if (take(worker, out_kmer)) return true;
+            if (exhausted) return false;
+
+            refill();
+        }
+    }
+
+    /* Pops the front of the worker's own queue, or steals the back of
+       another one. */
+    bool guide_scheduler::take(size_t worker, scheduled_kmer& out_kmer) {
+        {
+            worker_queue& own = *queues[worker];
+            std::lock_guard<std::mutex> lock(own.mtx);
+            if (!own.kmers.empty()) {
+                out_kmer = std::move(own.kmers.front());
+                own.kmers.pop_front();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < queues.size(); i++) {
+            worker_queue& victim = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mtx);
+            if (!victim.kmers.empty()) {
+                out_kmer = std::move(victim.kmers.back());
+                victim.kmers.pop_back();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void guide_scheduler::refill() {
+        kmer_window window;
+        if (!windows.pop(window)) {
+            exhausted = true;
+            return;
+        }
+
+        size_t window_start = static_cast<size_t>(-1);
+        for (const auto& k : window) window_start = std::min(window_start, k.absolute_coords);
+
+        for (size_t i = 0; i < window.size(); i++) {
+            worker_queue& queue = *queues[i % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mtx);
+            queue.kmers.push_back({std::move(window[i]), next_window, window.size(), window_start});
+        }
+
+        next_window++;
+    }
+};
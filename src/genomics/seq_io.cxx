@@ -1,9 +1,12 @@
 #include <string>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <algorithm>
 #include <sstream>
 #include <vector>
 #include <iterator>
+#include <stdexcept>
 
 #include "genomics/sequences.hpp"
 #include "genomics/seq_io.hpp"
@@ -23,6 +26,26 @@ namespace genomics {
                                                            }).base(), s.end());
             }
 
+            /*
+              Writes a file through write(std::ostream&) to a .partial
+              file that is renamed over it once complete, so that the
+              file is either the old one or the whole new one. Throws a
+              std::runtime_error if it cannot be written or renamed.
+            */
+            template <class writer>
+            void write_replacing(const std::string& filename, writer write) {
+                std::string partial = filename + ".partial";
+                {
+                    std::ofstream fs(partial);
+                    write(fs);
+                    if (!fs.flush()) throw std::runtime_error("Could not write " + partial);
+                }
+
+                if (std::rename(partial.c_str(), filename.c_str()) != 0) {
+                    throw std::runtime_error("Could not rename " + partial + " to " + filename);
+                }
+            }
+
             inline char my_toupper(char ch)
             {
                 return static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
@@ -142,6 +165,109 @@ namespace genomics {
             return true;
         }
 
+        void write_to_file(const shard_manifest& manifest, const std::string& filename) {
+            write_replacing(filename, [&](std::ostream& fs) {
+                fs << "genome " << manifest.genome << "\n";
+                fs << "genome_length " << manifest.genome_length << "\n";
+                fs << "shard " << manifest.shard << "\n";
+                fs << "shards " << manifest.shards << "\n";
+                fs << "stripe_size " << manifest.stripe_size << "\n";
+                fs << "kmer_length " << manifest.kmer_length << "\n";
+                fs << "min_chr_length " << manifest.min_chr_length << "\n";
+                fs << "pam " << manifest.pam << "\n";
+                fs << "alt_pams";
+                for (const auto& pam : manifest.alt_pams) fs << " " << pam;
+                fs << "\n";
+                fs << "mismatches " << manifest.mismatches << "\n";
+                fs << "threshold " << manifest.threshold << "\n";
+                fs << "kmers " << manifest.kmers << "\n";
+            });
+        }
+
+        bool load_from_file(shard_manifest& manifest, const std::string& filename) {
+            std::ifstream fs(filename);
+
+            if (!fs) return false;
+
+            manifest = shard_manifest();
+            for (std::string line; std::getline(fs, line);) {
+                auto words = split(line, ' ');
+                if (words.empty()) continue;
+
+                const std::string& key = words[0];
+                std::string value = words.size() > 1 ? words[1] : "";
+                if (key == "genome") manifest.genome = value;
+                else if (key == "genome_length") manifest.genome_length = std::stoull(value);
+                else if (key == "shard") manifest.shard = std::stoull(value);
+                else if (key == "shards") manifest.shards = std::stoull(value);
+                else if (key == "stripe_size") manifest.stripe_size = std::stoull(value);
+                else if (key == "kmer_length") manifest.kmer_length = std::stoull(value);
+                else if (key == "min_chr_length") manifest.min_chr_length = std::stoull(value);
+                else if (key == "pam") manifest.pam = value;
+                else if (key == "alt_pams") manifest.alt_pams.assign(words.begin() + 1, words.end());
+                else if (key == "mismatches") manifest.mismatches = std::stoull(value);
+                else if (key == "threshold") manifest.threshold = std::stoi(value);
+                else if (key == "kmers") manifest.kmers = std::stoull(value);
+            }
+
+            return true;
+        }
+
+        void write_to_file(const build_checkpoint& checkpoint, const std::string& filename) {
+            write_replacing(filename, [&](std::ostream& fs) {
+                fs << "build " << checkpoint.build << "\n";
+                fs << "windows " << checkpoint.windows << "\n";
+                fs << "offset " << checkpoint.offset << "\n";
+            });
+        }
+
+        bool load_from_file(build_checkpoint& checkpoint, const std::string& filename) {
+            std::ifstream fs(filename);
+
+            if (!fs) return false;
+
+            checkpoint = build_checkpoint();
+            for (std::string line; std::getline(fs, line);) {
+                size_t space = line.find(' ');
+                if (space == std::string::npos) continue;
+
+                std::string key = line.substr(0, space), value = line.substr(space + 1);
+                if (key == "build") checkpoint.build = value;
+                else if (key == "windows") checkpoint.windows = std::stoull(value);
+                else if (key == "offset") checkpoint.offset = std::stoull(value);
+            }
+
+            return true;
+        }
+
+        void write_to_file(const region_index& index, const std::string& filename) {
+            write_replacing(filename, [&](std::ostream& fs) {
+                fs << "bin_size " << index.bin_size << "\n";
+                fs << "bins " << index.offsets.size() << "\n";
+                for (uint64_t offset : index.offsets) fs << offset << "\n";
+            });
+        }
+
+        bool load_from_file(region_index& index, const std::string& filename) {
+            std::ifstream fs(filename);
+
+            if (!fs) return false;
+
+            std::string key;
+            size_t bins;
+            if (!(fs >> key >> index.bin_size) || key != "bin_size" || index.bin_size == 0 ||
+                !(fs >> key >> bins) || key != "bins") {
+                return false;
+            }
+
+            index.offsets.resize(bins);
+            for (auto& offset : index.offsets) {
+                if (!(fs >> offset)) return false;
+            }
+
+            return true;
+        }
+
 	void write_to_file(const std::vector<kmer>& kmers, const std::string& filename) {
             std::ofstream fs;
             fs.open(filename);
@@ -154,17 +280,20 @@ namespace genomics {
             }
 	}
 
-        void write_to_file(kmer_producer& kmer_p, const std::string& filename) {
-            std::ofstream fs;
-            fs.open(filename);
-        
+        void write_kmers(kmer_producer& kmer_p, std::ostream& kmers_os) {
             kmer kmer;
             while (kmer_p.get_next_kmer(kmer)) {
-                fs << kmer.sequence << " ";
-                fs << kmer.pam << " ";
-                fs << kmer.absolute_coords << " ";
-                fs << (kmer.dir == direction::positive ? "+" : "-") << std::endl;
+                kmers_os << kmer.sequence << " ";
+                kmers_os << kmer.pam << " ";
+                kmers_os << kmer.absolute_coords << " ";
+                kmers_os << (kmer.dir == direction::positive ? "+" : "-") << "\n";
             }
+        }
+
+        void write_to_file(kmer_producer& kmer_p, const std::string& filename) {
+            std::ofstream fs;
+            fs.open(filename);
+            write_kmers(kmer_p, fs);
 	}
 
 	size_t parse_kmer(std::istream& kmers_stream, kmer& out_kmer) {
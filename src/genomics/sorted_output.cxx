@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "genomics/merge.hpp"
+#include "genomics/sorted_output.hpp"
+
+namespace genomics {
+    namespace {
+        typedef std::unordered_map<std::string, size_t> start_map;
+
+        /* Absolute coordinate of the first base of each chromosome. */
+        start_map chromosome_starts(const genome_structure& gs) {
+            start_map starts;
+            size_t start = 0;
+            for (const auto& chr : gs) {
+                starts[chr.name] = start;
+                start += chr.length;
+            }
+
+            return starts;
+        }
+
+        size_t record_coordinate(const std::string& line, const start_map& starts) {
+            size_t rname = line.find('\t', line.find('\t') + 1);
+            size_t pos = rname == std::string::npos ? rname : line.find('\t', rname + 1);
+            if (pos == std::string::npos) {
+                throw std::runtime_error("malformed SAM record \"" + line.substr(0, 80) + "\"");
+            }
+
+            auto start = starts.find(line.substr(rname + 1, pos - rname - 1));
+            if (start == starts.end()) {
+                throw std::runtime_error("SAM record on unknown reference \"" + line.substr(0, 80) + "\"");
+            }
+
+            return start->second + std::stoull(line.substr(pos + 1, line.find('\t', pos + 1) - pos - 1)) - 1;
+        }
+    };
+
+    region_indexer::region_indexer(const genome_structure& gs) {
+        size_t genome_length = 0;
+        for (const auto& chr : gs) genome_length += chr.length;
+
+        index.bin_size = region_bin_size;
+        bins = genome_length / region_bin_size + 1;
+    }
+
+    void region_indexer::add(size_t coordinate, uint64_t offset) {
+        size_t bin = std::min(coordinate / index.bin_size, bins - 1);
+        while (index.offsets.size() <= bin) index.offsets.push_back(offset);
+    }
+
+    region_index region_indexer::finish(uint64_t end_offset) {
+        while (index.offsets.size() < bins) index.offsets.push_back(end_offset);
+        return index;
+    }
+
+    reorder_buffer::reorder_buffer(std::ostream& output, size_t capacity,
+                                   region_indexer* indexer, uint64_t offset)
+        : output(output),
+          capacity(std::max<size_t>(capacity, 1)),
+          indexer(indexer),
+          offset(offset),
+          heap(later{this}) {}
+
+    bool reorder_buffer::later::operator()(const entry& a, const entry& b) const {
+        if (a.coordinate != b.coordinate) return a.coordinate > b.coordinate;
+        const std::string& text = buffer->window_records(a);
+        return text.compare(a.begin, a.end - a.begin, buffer->window_records(b), b.begin, b.end - b.begin) > 0;
+    }
+
+    void reorder_buffer::add(std::string&& records, const std::vector<record_key>& keys) {
+        if (keys.empty()) return;
+
+        size_t id = first_window + windows.size();
+        windows.push_back({std::move(records), keys.size()});
+
+        size_t begin = 0;
+        for (const auto& key : keys) {
+            if (written && key.coordinate < last_coordinate) {
+                throw std::runtime_error("records are too far out of coordinate order to sort with"
+                                         " a reorder buffer of " + std::to_string(capacity) + " records");
+            }
+
+            heap.push({key.coordinate, id, begin, key.end});
+            begin = key.end;
+            while (heap.size() > capacity) write_next();
+        }
+    }
+
+    void reorder_buffer::release(size_t coordinate) {
+        while (!heap.empty() && heap.top().coordinate < coordinate) write_next();
+    }
+
+    void reorder_buffer::release_all() {
+        while (!heap.empty()) write_next();
+    }
+
+    /* Windows are dropped in order once all their records are
+       written, and the records of a window behind others are freed as
+       soon as it is written. */
+    void reorder_buffer::write_next() {
+        entry next = heap.top();
+        heap.pop();
+
+        window& w = windows[next.window - first_window];
+        output.write(w.records.data() + next.begin, next.end - next.begin);
+        if (indexer) indexer->add(next.coordinate, offset);
+
+        offset += next.end - next.begin;
+        last_coordinate = next.coordinate;
+        written = true;
+
+        if (--w.pending == 0) std::string().swap(w.records);
+        while (!windows.empty() && windows.front().pending == 0) {
+            windows.pop_front();
+            first_window++;
+        }
+    }
+
+    void index_sam_records(std::istream& sam_is, const genome_structure& gs,
+                           uint64_t end_offset, region_indexer& indexer) {
+        start_map starts = chromosome_starts(gs);
+
+        read_sam_header(sam_is);
+        uint64_t offset = sam_is.tellg();
+        std::string line;
+        while (offset < end_offset && std::getline(sam_is, line)) {
+            if (!line.empty()) indexer.add(record_coordinate(line, starts), offset);
+            offset += line.length() + 1;
+        }
+    }
+
+    void write_region(std::istream& sam_is, const genome_structure& gs, const region_index& index,
+                      const std::string& chr, size_t start, size_t end, std::ostream& os) {
+        start_map starts = chromosome_starts(gs);
+        auto chr_start = starts.find(chr);
+        if (chr_start == starts.end()) throw std::runtime_error("unknown chromosome \"" + chr + "\"");
+
+        const chromosome& c = *std::find_if(gs.begin(), gs.end(), [&](const chromosome& other) {
+            return other.name == chr;
+        });
+        start = std::max<size_t>(start, 1);
+        end = std::min(end, c.length);
+        if (start > end) return;
+
+        size_t first = chr_start->second + start - 1;
+        size_t last = chr_start->second + end - 1;
+        size_t bin = first / index.bin_size;
+        if (bin >= index.offsets.size()) return;
+
+        sam_is.clear();
+        sam_is.seekg(index.offsets[bin]);
+        std::string line;
+        while (std::getline(sam_is, line)) {
+            if (line.empty()) continue;
+
+            size_t coordinate = record_coordinate(line, starts);
+            if (coordinate > last) break;
+            if (coordinate >= first) os << line << "\n";
+        }
+    }
+};
@@ -1,6 +1,20 @@
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
 #include <istream>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <sdsl/suffix_arrays.hpp>
 
@@ -8,15 +22,19 @@
 #include "httplib.h"
 #include "CLI/CLI.hpp"
 #include "genomics/index.hpp"
+#include "genomics/index_profile.hpp"
+#include "genomics/wt_dna.hpp"
+#include "genomics/bidirectional.hpp"
 #include "genomics/sam.hpp"
 #include "genomics/seq_io.hpp"
 #include "genomics/process.hpp"
 #include "genomics/kmer.hpp"
+#include "genomics/merge.hpp"
+#include "genomics/bgzf.hpp"
+#include "genomics/guide_database.hpp"
+#include "genomics/sorted_output.hpp"
 
-#define t_sa_dens 64
-#define t_isa_dens 8192
-
-typedef sdsl::wt_huff<> t_wt;
+typedef genomics::wt_dna t_wt;
 
 struct build_cmd_options {
     size_t kmer_length;
@@ -51,6 +69,42 @@ struct build_cmd_options {
 
     std::vector<std::string> alt_pams;
     CLI::Option* alt_pams_opt = nullptr;
+
+    bool bidirectional;
+    CLI::Option* bidirectional_opt = nullptr;
+
+    size_t table_depth;
+    CLI::Option* table_depth_opt = nullptr;
+
+    std::string index_profile;
+    CLI::Option* index_profile_opt = nullptr;
+
+    std::string shard;
+    CLI::Option* shard_opt = nullptr;
+
+    bool resume;
+    CLI::Option* resume_opt = nullptr;
+
+    size_t checkpoint_interval;
+    CLI::Option* checkpoint_interval_opt = nullptr;
+
+    std::string memory_budget;
+    CLI::Option* memory_budget_opt = nullptr;
+
+    std::string scratch_dir;
+    CLI::Option* scratch_dir_opt = nullptr;
+
+    std::string format;
+    CLI::Option* format_opt = nullptr;
+
+    std::string off_target_encoding;
+    CLI::Option* off_target_encoding_opt = nullptr;
+
+    bool sort;
+    CLI::Option* sort_opt = nullptr;
+
+    size_t reorder_buffer;
+    CLI::Option* reorder_buffer_opt = nullptr;
 };
 
 struct kmer_cmd_options {
@@ -68,6 +122,76 @@ struct kmer_cmd_options {
 
     std::string pam;
     CLI::Option* pam_opt;
+
+    size_t nthreads;
+    CLI::Option* nthreads_opt;
+};
+
+struct index_cmd_options {
+    std::string fasta_file;
+    CLI::Option* fasta_file_opt = nullptr;
+
+    size_t nthreads;
+    CLI::Option* nthreads_opt = nullptr;
+
+    bool bidirectional;
+    CLI::Option* bidirectional_opt = nullptr;
+
+    size_t table_depth;
+    CLI::Option* table_depth_opt = nullptr;
+
+    std::string index_profile;
+    CLI::Option* index_profile_opt = nullptr;
+
+    std::string memory_budget;
+    CLI::Option* memory_budget_opt = nullptr;
+
+    std::string scratch_dir;
+    CLI::Option* scratch_dir_opt = nullptr;
+};
+
+struct merge_cmd_options {
+    std::vector<std::string> databases;
+    CLI::Option* databases_opt = nullptr;
+
+    std::string database_file;
+    CLI::Option* database_file_opt = nullptr;
+
+    size_t memory;
+    CLI::Option* memory_opt = nullptr;
+
+    std::string off_target_encoding;
+    CLI::Option* off_target_encoding_opt = nullptr;
+};
+
+struct pack_cmd_options {
+    std::string database_file;
+    CLI::Option* database_file_opt = nullptr;
+
+    std::string output_file;
+    CLI::Option* output_file_opt = nullptr;
+
+    size_t kmer_length;
+    CLI::Option* kmer_length_opt = nullptr;
+};
+
+struct query_cmd_options {
+    std::string database_file;
+    CLI::Option* database_file_opt = nullptr;
+
+    std::vector<std::string> sequences;
+    CLI::Option* sequences_opt = nullptr;
+
+    std::string sequences_file;
+    CLI::Option* sequences_file_opt = nullptr;
+};
+
+struct view_cmd_options {
+    std::string database_file;
+    CLI::Option* database_file_opt = nullptr;
+
+    std::vector<std::string> regions;
+    CLI::Option* regions_opt = nullptr;
 };
 
 struct http_server_cmd_options {
@@ -79,8 +203,117 @@ struct http_server_cmd_options {
 
     size_t port;
     CLI::Option* port_opt = nullptr;
+
+    size_t table_depth;
+    CLI::Option* table_depth_opt = nullptr;
+
+    std::string index_profile;
+    CLI::Option* index_profile_opt = nullptr;
 };
 
+/*
+  Window starts are dealt to the shards of a sharded build in stripes
+  of this many positions.
+*/
+const size_t shard_stripe_size = 1 << 18;
+
+/* Parses a shard given as i/N, returning false unless 0 <= i < N. */
+bool parse_shard(const std::string& shard, size_t& i, size_t& n) {
+    size_t slash = shard.find('/');
+    if (slash == std::string::npos || slash == 0 || slash + 1 == shard.length()) return false;
+
+    std::string i_str = shard.substr(0, slash), n_str = shard.substr(slash + 1);
+    auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+    if (!std::all_of(i_str.begin(), i_str.end(), is_digit) ||
+        !std::all_of(n_str.begin(), n_str.end(), is_digit)) return false;
+
+    try {
+        i = std::stoull(i_str);
+        n = std::stoull(n_str);
+    } catch (const std::out_of_range&) {
+        return false;
+    }
+    return i < n;
+}
+
+/* Parses a size such as 512M or 8G into bytes, returning false if it
+   is malformed, zero or too large for size_t. */
+bool parse_memory_size(const std::string& size, size_t& bytes) {
+    size_t digits = 0;
+    while (digits < size.length() && size[digits] >= '0' && size[digits] <= '9') digits++;
+    if (digits == 0) return false;
+
+    std::string unit = size.substr(digits);
+    if (unit.length() == 2 && (unit[1] == 'B' || unit[1] == 'b')) unit.resize(1);
+
+    size_t shift;
+    if (unit.empty()) shift = 0;
+    else if (unit.length() > 1) return false;
+    else if (unit[0] == 'K' || unit[0] == 'k') shift = 10;
+    else if (unit[0] == 'M' || unit[0] == 'm') shift = 20;
+    else if (unit[0] == 'G' || unit[0] == 'g') shift = 30;
+    else if (unit[0] == 'T' || unit[0] == 't') shift = 40;
+    else return false;
+
+    unsigned long long value;
+    try {
+        value = std::stoull(size.substr(0, digits));
+    } catch (const std::out_of_range&) {
+        return false;
+    }
+    if (value > (SIZE_MAX >> shift)) return false;
+
+    bytes = static_cast<size_t>(value) << shift;
+    return bytes > 0;
+}
+
+/* Parses a region given as chr, chr:start or chr:start-end, 1-based
+   and inclusive, with optional commas in the positions. Returns false
+   if the positions are malformed. */
+bool parse_region(const std::string& region, std::string& chr, size_t& start, size_t& end) {
+    start = 1;
+    end = static_cast<size_t>(-1);
+
+    size_t colon = region.rfind(':');
+    chr = region.substr(0, colon);
+    if (colon == std::string::npos) return !chr.empty();
+
+    std::string range;
+    for (char c : region.substr(colon + 1)) {
+        if (c != ',') range.push_back(c);
+    }
+
+    size_t dash = range.find('-');
+    std::string start_str = range.substr(0, dash);
+    std::string end_str = dash == std::string::npos ? std::string() : range.substr(dash + 1);
+    auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+    if (chr.empty() || start_str.empty() ||
+        !std::all_of(start_str.begin(), start_str.end(), is_digit) ||
+        !std::all_of(end_str.begin(), end_str.end(), is_digit)) return false;
+
+    start = std::stoull(start_str);
+    if (!end_str.empty()) end = std::stoull(end_str);
+    else if (dash == std::string::npos) end = start;
+    return start <= end;
+}
+
+/* Adds the options controlling how missing index files are built. */
+void add_index_construction_options(CLI::App* app, std::string& memory_budget, CLI::Option*& memory_budget_opt,
+                                    std::string& scratch_dir, CLI::Option*& scratch_dir_opt) {
+    scratch_dir = ".";
+
+    memory_budget_opt = app->add_option("--memory-budget", memory_budget,
+                                        "Memory for building missing index files, such as 8G; above"
+                                        " it the suffix array is built on disk, several times slower")
+        ->check([](const std::string& size) {
+            size_t bytes;
+            return parse_memory_size(size, bytes) ? std::string() : std::string("Memory budget must be a size such as 512M or 8G");
+        });
+    scratch_dir_opt = app->add_option("--scratch-dir", scratch_dir,
+                                      "Directory for the temporary files of index construction", true)
+        ->check(CLI::ExistingDirectory);
+}
+
 CLI::App* build_cmd(CLI::App &guidescan, build_cmd_options& opts) {
     auto build = guidescan.add_subcommand("build", "Builds a gRNA database over the given genome.");
 
@@ -91,6 +324,15 @@ CLI::App* build_cmd(CLI::App &guidescan, build_cmd_options& opts) {
     opts.threshold   = 1;
     opts.mismatches  = 3;
     opts.chr_length  = 1000;
+    opts.bidirectional = false;
+    opts.table_depth = 0;
+    opts.index_profile = "balanced";
+    opts.resume = false;
+    opts.checkpoint_interval = 60;
+    opts.format = "sam";
+    opts.off_target_encoding = "hex";
+    opts.sort = false;
+    opts.reorder_buffer = 65536;
 
     opts.chr_length_opt  = build->add_option("--min-chr-length", opts.chr_length, "Minimum length of chromosomes to consider for gRNAs", true);
     opts.kmer_length_opt = build->add_option("-k,--kmer-length", opts.kmer_length, "Length of kmers excluding the PAM", true);
@@ -99,6 +341,17 @@ CLI::App* build_cmd(CLI::App &guidescan, build_cmd_options& opts) {
     opts.alt_pams_opt    = build->add_option("-a,--alt-pam", opts.alt_pams, "Alternative PAMs used to find off-targets", true);
     opts.mismatches_opt  = build->add_option("-m,--mismatches", opts.mismatches, "Number of mismatches to allow when finding off-targets", true);
     opts.threshold_opt   = build->add_option("-t,--threshold", opts.threshold, "Filters gRNAs with off-targets at a distance at or below this threshold", true);
+    opts.bidirectional_opt = build->add_flag("--bidirectional", opts.bidirectional,
+                                             "Also index the reverse complement strand, trading"
+                                             " memory for faster off-target searches");
+    opts.table_depth_opt = build->add_option("--table-depth", opts.table_depth,
+                                             "Length of the strings whose BWT intervals are precomputed"
+                                             " to skip the first steps of every search, 0 to disable", true)
+        ->check(CLI::Range(0, 13));
+    opts.index_profile_opt = build->add_option("--index-profile", opts.index_profile,
+                                               "SA sampling of the index: compact, balanced or fast,"
+                                               " trading memory for faster off-target resolution", true)
+        ->check(CLI::IsMember({"compact", "balanced", "fast"}));
     opts.kmers_file_opt  = build->add_option("-f,--kmers-file", opts.kmers_file,
 					     "File containing kmers to build gRNA database"
 					     " over, if not specified, will generate the database over all kmers with the given PAM")
@@ -108,6 +361,33 @@ CLI::App* build_cmd(CLI::App &guidescan, build_cmd_options& opts) {
 	->required();
     opts.database_file_opt = build->add_option("-o, --output", opts.database_file, "Output database file.")
 	->required();
+    opts.format_opt = build->add_option("--format", opts.format,
+                                        "Format of the database: sam, or bam compressed on --threads threads", true)
+        ->check(CLI::IsMember({"sam", "bam"}));
+    opts.off_target_encoding_opt = build->add_option("--off-target-encoding", opts.off_target_encoding,
+                                                     "Encoding of the off-targets: hex in the of tag, or"
+                                                     " compact, delta coded varints in the oc tag", true)
+        ->check(CLI::IsMember({"hex", "compact"}));
+    opts.sort_opt = build->add_flag("--sort", opts.sort,
+                                    "Writes the database sorted by coordinate, with a region index"
+                                    " next to SAM databases for view");
+    opts.reorder_buffer_opt = build->add_option("--reorder-buffer", opts.reorder_buffer,
+                                                "Number of records held back to sort the database", true);
+    opts.shard_opt = build->add_option("--shard", opts.shard,
+                                       "Builds shard i of N, given as i/N with 0 <= i < N, over kmers taken"
+                                       " from the genome, and writes a manifest next to the output")
+        ->excludes(opts.kmers_file_opt)
+        ->check([](const std::string& shard) {
+            size_t i, n;
+            return parse_shard(shard, i, n) ? std::string() : std::string("Shard must be i/N with 0 <= i < N");
+        });
+    opts.resume_opt = build->add_flag("--resume", opts.resume,
+                                      "Continues an interrupted build of the same database from its"
+                                      " last checkpoint instead of starting over");
+    opts.checkpoint_interval_opt = build->add_option("--checkpoint-interval", opts.checkpoint_interval,
+                                                     "Seconds between checkpoints of the build's progress", true);
+    add_index_construction_options(build, opts.memory_budget, opts.memory_budget_opt,
+                                   opts.scratch_dir, opts.scratch_dir_opt);
   
     return build;
 }
@@ -119,9 +399,11 @@ CLI::App* kmer_cmd(CLI::App &guidescan, kmer_cmd_options& opts) {
     opts.kmer_length = 20;
     opts.pam         = std::string("NGG");
     opts.chr_length  = 1000;
+    opts.nthreads    = std::thread::hardware_concurrency();
 
     opts.chr_length_opt  = kmers->add_option("--min-chr-length", opts.chr_length, "Minimum length of chromosone for kmers to be included in output", true);
     opts.kmer_length_opt = kmers->add_option("-k,--kmer-length", opts.kmer_length, "Length of kmers excluding the PAM", true);
+    opts.nthreads_opt    = kmers->add_option("-n,--threads", opts.nthreads, "Number of threads to parallelize over", true);
     opts.pam_opt         = kmers->add_option("-p,--pam", opts.pam, "PAM to generate kmers for", true);
     opts.fasta_file_opt  = kmers->add_option("genome", opts.fasta_file, "Genome in FASTA format")
 	->check(CLI::ExistingFile)
@@ -132,15 +414,132 @@ CLI::App* kmer_cmd(CLI::App &guidescan, kmer_cmd_options& opts) {
     return kmers;
 }
 
+CLI::App* index_cmd(CLI::App &guidescan, index_cmd_options& opts) {
+    auto index = guidescan.add_subcommand("index",
+                                          "Builds the index files of the given genome used by the"
+                                          " other subcommands.");
+    opts.nthreads = std::thread::hardware_concurrency();
+    opts.bidirectional = false;
+    opts.table_depth = 0;
+    opts.index_profile = "balanced";
+
+    opts.nthreads_opt = index->add_option("-n,--threads", opts.nthreads, "Number of threads to parallelize over", true);
+    opts.bidirectional_opt = index->add_flag("--bidirectional", opts.bidirectional,
+                                             "Also index the reverse complement strand");
+    opts.table_depth_opt = index->add_option("--table-depth", opts.table_depth,
+                                             "Length of the strings whose BWT intervals are precomputed"
+                                             " to skip the first steps of every search, 0 to disable", true)
+        ->check(CLI::Range(0, 13));
+    opts.index_profile_opt = index->add_option("--index-profile", opts.index_profile,
+                                               "SA sampling of the index: compact, balanced or fast,"
+                                               " trading memory for faster off-target resolution", true)
+        ->check(CLI::IsMember({"compact", "balanced", "fast"}));
+    add_index_construction_options(index, opts.memory_budget, opts.memory_budget_opt,
+                                   opts.scratch_dir, opts.scratch_dir_opt);
+    opts.fasta_file_opt = index->add_option("genome", opts.fasta_file, "Genome in FASTA format")
+	->check(CLI::ExistingFile)
+	->required();
+
+    return index;
+}
+
+CLI::App* merge_cmd(CLI::App &guidescan, merge_cmd_options& opts) {
+    auto merge = guidescan.add_subcommand("merge",
+                                          "Merges the gRNA databases of a sharded build into one"
+                                          " database sorted by coordinate.");
+    opts.memory = 1024;
+
+    opts.memory_opt = merge->add_option("--memory", opts.memory,
+                                        "Megabytes of records to sort in memory before spilling"
+                                        " sorted runs to disk", true)
+        ->check(CLI::Range(1, 1 << 20));
+    opts.off_target_encoding_opt = merge->add_option("--off-target-encoding", opts.off_target_encoding,
+                                                     "Rewrites the off-targets of every record in this"
+                                                     " encoding, hex or compact; kept as they are by default")
+        ->check(CLI::IsMember({"hex", "compact"}));
+    opts.databases_opt = merge->add_option("databases", opts.databases, "Databases to merge")
+	->check(CLI::ExistingFile)
+	->required();
+    opts.database_file_opt = merge->add_option("-o, --output", opts.database_file, "Output database file.")
+	->required();
+
+    return merge;
+}
+
+CLI::App* pack_cmd(CLI::App &guidescan, pack_cmd_options& opts) {
+    auto pack = guidescan.add_subcommand("pack",
+                                         "Packs a gRNA database into a binary guide database"
+                                         " for the query subcommand.");
+    opts.kmer_length = 20;
+
+    opts.kmer_length_opt = pack->add_option("-k,--kmer-length", opts.kmer_length,
+                                            "Length of kmers excluding the PAM", true)
+        ->check(CLI::Range(1, 32));
+    opts.database_file_opt = pack->add_option("database", opts.database_file, "Database in SAM format")
+	->check(CLI::ExistingFile)
+	->required();
+    opts.output_file_opt = pack->add_option("-o, --output", opts.output_file, "Output guide database file.")
+	->required();
+
+    return pack;
+}
+
+CLI::App* query_cmd(CLI::App &guidescan, query_cmd_options& opts) {
+    auto query = guidescan.add_subcommand("query",
+                                          "Looks up gRNAs in a guide database written by pack and"
+                                          " writes their records to stdout.");
+
+    opts.database_file_opt = query->add_option("database", opts.database_file, "Guide database")
+	->check(CLI::ExistingFile)
+	->required();
+    opts.sequences_opt = query->add_option("sequences", opts.sequences,
+                                           "Protospacers to look up, optionally followed by their PAM");
+    opts.sequences_file_opt = query->add_option("-f,--sequences-file", opts.sequences_file,
+                                                "File containing protospacers to look up, one per line")
+	->check(CLI::ExistingFile);
+
+    return query;
+}
+
+CLI::App* view_cmd(CLI::App &guidescan, view_cmd_options& opts) {
+    auto view = guidescan.add_subcommand("view",
+                                         "Writes the records of a sorted gRNA database in the given"
+                                         " regions to stdout.");
+
+    opts.database_file_opt = view->add_option("database", opts.database_file,
+                                              "Database in SAM format written by build --sort or merge")
+	->check(CLI::ExistingFile)
+	->required();
+    opts.regions_opt = view->add_option("regions", opts.regions,
+                                        "Regions given as chr, chr:pos or chr:start-end, 1-based and inclusive")
+        ->check([](const std::string& region) {
+            std::string chr;
+            size_t start, end;
+            return parse_region(region, chr, start, end) ? std::string() : std::string("Region must be chr, chr:pos or chr:start-end");
+        })
+        ->required();
+
+    return view;
+}
+
 CLI::App* http_cmd(CLI::App &guidescan, http_server_cmd_options& opts) {
     auto http = guidescan.add_subcommand("http-server",
                                          "Starts a local HTTP server to receive gRNA processing requests.");
     opts.mismatches  = 3;
     opts.port = 4500;
-
+    opts.table_depth = 0;
+    opts.index_profile = "balanced";
 
     opts.port_opt       = http->add_option("--port", opts.port, "HTTP Server Port", true);
     opts.mismatches_opt = http->add_option("-m,--mismatches", opts.mismatches, "Number of mismatches to allow when finding off-targets", true);
+    opts.table_depth_opt = http->add_option("--table-depth", opts.table_depth,
+                                            "Length of the strings whose BWT intervals are precomputed"
+                                            " to skip the first steps of every search, 0 to disable", true)
+        ->check(CLI::Range(0, 13));
+    opts.index_profile_opt = http->add_option("--index-profile", opts.index_profile,
+                                              "SA sampling of the index: compact, balanced or fast,"
+                                              " trading memory for faster off-target resolution", true)
+        ->check(CLI::IsMember({"compact", "balanced", "fast"}));
     opts.fasta_file_opt = http->add_option("genome", opts.fasta_file, "Genome in FASTA format")
 	->check(CLI::ExistingFile)
 	->required();
@@ -160,49 +559,45 @@ bool file_exists(const std::string& fileName)
     return infile.good();
 }
 
-int do_build_cmd(const build_cmd_options& opts) {
+/* Each index profile has its own instantiation of the index, and
+   the commands below are dispatched to one of them at runtime. */
+template <genomics::index_profile t_profile>
+using profile_genome_index = genomics::genome_index<t_wt,
+                                                    genomics::profile_densities<t_profile>::sa_dens,
+                                                    genomics::profile_densities<t_profile>::isa_dens>;
+template <genomics::index_profile t_profile>
+using profile_bidirectional_index = genomics::bidirectional_index<t_wt,
+                                                                  genomics::profile_densities<t_profile>::sa_dens,
+                                                                  genomics::profile_densities<t_profile>::isa_dens>;
+
+/*
+  Parses the FASTA file into the raw sequence and genome structure
+  files next to it, and the raw sequence of the reverse complement
+  strand if asked for, unless they exist. Returns the genome
+  structure.
+*/
+genomics::genome_structure prepare_sequence_files(const std::string& fasta_file, bool reverse) {
     using namespace std;
 
-    string genome_structure_file = opts.fasta_file + ".gs";
-    string forward_raw_sequence_file = opts.fasta_file + ".forward.dna";
-    string reverse_raw_sequence_file = opts.fasta_file + ".reverse.dna";
-    string forward_fm_index_file = opts.fasta_file + ".forward.csa";
-    string reverse_fm_index_file = opts.fasta_file + ".reverse.csa";
-    
-    ifstream fasta_is(opts.fasta_file);
+    string genome_structure_file = fasta_file + ".gs";
+    string forward_raw_sequence_file = fasta_file + ".forward.dna";
+    string reverse_raw_sequence_file = fasta_file + ".reverse.dna";
+
+    ifstream fasta_is(fasta_file);
     if (!fasta_is) {
-        cerr << "ERROR: FASTA file \"" << opts.fasta_file
-             << "\" does not exist." << endl;
-        return 1;
+        throw runtime_error("FASTA file \"" + fasta_file + "\" does not exist.");
     }
 
     cout << "Reading sequence file..." << endl;
     if (!file_exists(forward_raw_sequence_file)) {
         ofstream os(forward_raw_sequence_file);
-        if (!os) {
-            cerr << "ERROR: Could not create forward raw sequence file." << endl;
-            return 1;
-        }
+        if (!os) throw runtime_error("Could not create forward raw sequence file.");
 
         cout << "No raw sequence file \"" << forward_raw_sequence_file
              << "\". Building now..." << endl;
         genomics::seq_io::parse_sequence(fasta_is, os);
     }
 
-    if (!file_exists(reverse_raw_sequence_file)) {
-        ofstream os(reverse_raw_sequence_file);
-        if (!os) {
-            cerr << "ERROR: Could not create reverse raw sequence file." << endl;
-            return 1;
-        }
-
-        cout << "No raw sequence file \"" << reverse_raw_sequence_file
-             << "\". Building now..." << endl;
-        ifstream is(forward_raw_sequence_file);
-        genomics::seq_io::reverse_complement_stream(is, os);
-    }
-
-    cout << "Loading genome index..." << endl;
     genomics::genome_structure gs;
     if (!genomics::seq_io::load_from_file(gs, genome_structure_file)) {
         cout << "No genome structure file \"" << genome_structure_file
@@ -214,61 +609,592 @@ int do_build_cmd(const build_cmd_options& opts) {
         genomics::seq_io::write_to_file(gs, genome_structure_file);
     }
 
-    sdsl::csa_wt<t_wt, t_sa_dens, t_isa_dens> forward_fm_index;
-    if (!load_from_file(forward_fm_index, forward_fm_index_file)) {
+    if (reverse && !file_exists(reverse_raw_sequence_file)) {
+        ofstream os(reverse_raw_sequence_file);
+        if (!os) throw runtime_error("Could not create reverse raw sequence file.");
+
+        cout << "No raw sequence file \"" << reverse_raw_sequence_file
+             << "\". Building now..." << endl;
+        ifstream is(forward_raw_sequence_file);
+        genomics::seq_io::reverse_complement_stream(is, os);
+    }
+
+    return gs;
+}
+
+/* How the index files that are missing are built. A memory budget
+   of 0 leaves memory unbounded. */
+struct index_construction {
+    size_t nthreads;
+    size_t memory_budget;
+    std::string scratch_dir;
+};
+
+index_construction make_index_construction(size_t nthreads, const std::string& memory_budget,
+                                            const std::string& scratch_dir) {
+    index_construction construction = {nthreads, 0, scratch_dir};
+    if (!memory_budget.empty()) parse_memory_size(memory_budget, construction.memory_budget);
+    return construction;
+}
+
+/*
+  Peak memory of building an index over a text of n characters with
+  libdivsufsort, which holds the text and its suffix array in memory,
+  with 32 bit entries below 2^31 characters and 64 bit ones above.
+*/
+size_t in_memory_construction_bytes(size_t n) {
+    return n * (n < (1ULL << 31) ? 5 : 9);
+}
+
+/*
+  Peak memory of building an index with the semi-external SA-IS
+  algorithm, which streams the suffix array through files and keeps
+  little more than the text in memory.
+*/
+size_t semi_external_construction_bytes(size_t n) {
+    return 2 * n;
+}
+
+/*
+  Constructs an index over a raw sequence file, with its temporary
+  files in the scratch directory. The suffix sort runs on nthreads
+  threads when libdivsufsort is built with OpenMP. The temporary
+  files are named after the sequence file, so indexes over different
+  files can be constructed at the same time.
+*/
+template <class t_index>
+void construct_index(t_index& idx, const std::string& sequence_file, size_t nthreads,
+                     const std::string& scratch_dir) {
+#ifdef _OPENMP
+    omp_set_num_threads(static_cast<int>(std::max<size_t>(nthreads, 1)));
+#else
+    (void) nthreads;
+#endif
+
+    sdsl::cache_config config(true, scratch_dir, sdsl::util::basename(sequence_file) + "_" +
+                              sdsl::util::to_string(sdsl::util::pid()));
+    construct(idx, sequence_file, config, 1);
+}
+
+/*
+  Loads the forward index of the genome, its interval table if
+  table_depth is positive and, if reverse is given, the BWT of its
+  reverse complement, building those that are missing.
+
+  Indexes are built in memory unless that would exceed the memory
+  budget, in which case the suffix array is built semi-externally on
+  disk in the scratch directory, on one thread and several times
+  slower. When both strands are missing and the budget allows, they
+  are built at the same time with the threads split between them.
+*/
+template <genomics::index_profile t_profile>
+void load_genome_indexes(const std::string& fasta_file, size_t table_depth,
+                         const index_construction& construction,
+                         typename profile_genome_index<t_profile>::t_csa& forward_fm_index,
+                         genomics::interval_table& table,
+                         typename profile_bidirectional_index<t_profile>::t_rc_csa* reverse_bwt) {
+    using namespace std;
+
+    string forward_raw_sequence_file = fasta_file + ".forward.dna";
+    string reverse_raw_sequence_file = fasta_file + ".reverse.dna";
+    string forward_fm_index_file = fasta_file + ".forward." + genomics::profile_name(t_profile) + ".csa";
+    string reverse_bwt_file = fasta_file + ".reverse.bwt";
+    string interval_table_file = fasta_file + ".forward." + to_string(table_depth) + ".table";
+
+    cout << "Loading genome index..." << endl;
+    bool build_forward = !genomics::load_index(forward_fm_index, t_profile, forward_fm_index_file);
+    if (build_forward) {
         cout << "No forward index file \"" << forward_fm_index_file
              << "\" located. Building now..." << endl;
+    }
+
+    bool build_reverse = reverse_bwt && !sdsl::load_from_file(*reverse_bwt, reverse_bwt_file);
+    if (build_reverse) {
+        cout << "No reverse index file \"" << reverse_bwt_file
+             << "\" located. Building now..." << endl;
+    }
 
-        construct(forward_fm_index, forward_raw_sequence_file, 1);
-        store_to_file(forward_fm_index, forward_fm_index_file);
-    }   
+    size_t budget = construction.memory_budget;
+    size_t n = 0;
+    if (build_forward || build_reverse) {
+        ifstream is(forward_raw_sequence_file, ios::binary | ios::ate);
+        n = static_cast<size_t>(is.tellg()) + 1;
+    }
 
-    sdsl::csa_wt<t_wt, t_sa_dens, t_isa_dens> reverse_fm_index;
-    if (!load_from_file(reverse_fm_index, reverse_fm_index_file)) {
-        cout << "No reverse index file \"" << reverse_fm_index_file
+    size_t index_bytes = in_memory_construction_bytes(n);
+    bool semi_external = budget > 0 && index_bytes > budget;
+    if (semi_external) {
+        index_bytes = semi_external_construction_bytes(n);
+        sdsl::construct_config::byte_algo_sa = sdsl::SE_SAIS;
+        cout << "Building the suffix array semi-externally in \"" << construction.scratch_dir
+             << "\" to stay within the memory budget..." << endl;
+        if (index_bytes > budget) {
+            cerr << "WARNING: Building the index takes about " << (index_bytes >> 20)
+                 << "MB even semi-externally, more than the memory budget." << endl;
+        }
+    } else {
+        sdsl::construct_config::byte_algo_sa = sdsl::LIBDIVSUFSORT;
+    }
+
+    bool concurrent = build_forward && build_reverse && (budget == 0 || 2 * index_bytes <= budget);
+    size_t nthreads = construction.nthreads;
+
+    auto timed = [](const string& name, const function<void()>& build) {
+        auto start = chrono::steady_clock::now();
+        build();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        cout << "Built " << name << " in " << static_cast<size_t>(elapsed.count()) << "s." << endl;
+    };
+
+    auto construct_forward = [&](size_t threads) {
+        timed("forward index", [&]() {
+            construct_index(forward_fm_index, forward_raw_sequence_file, threads, construction.scratch_dir);
+            genomics::store_index(forward_fm_index, t_profile, forward_fm_index_file);
+        });
+    };
+
+    auto construct_reverse = [&](size_t threads) {
+        timed("reverse index", [&]() {
+            construct_index(*reverse_bwt, reverse_raw_sequence_file, threads, construction.scratch_dir);
+            sdsl::store_to_file(*reverse_bwt, reverse_bwt_file);
+        });
+    };
+
+    if (concurrent) {
+        exception_ptr reverse_error;
+        thread reverse_builder([&]() {
+            try {
+                construct_reverse(max<size_t>(nthreads - nthreads / 2, 1));
+            } catch (...) {
+                reverse_error = current_exception();
+            }
+        });
+
+        try {
+            construct_forward(max<size_t>(nthreads / 2, 1));
+        } catch (...) {
+            reverse_builder.join();
+            throw;
+        }
+
+        reverse_builder.join();
+        if (reverse_error) rethrow_exception(reverse_error);
+    } else {
+        if (build_forward) construct_forward(nthreads);
+        if (build_reverse) construct_reverse(nthreads);
+    }
+
+    if (table_depth > 0 && !sdsl::load_from_file(table, interval_table_file)) {
+        cout << "No interval table file \"" << interval_table_file
              << "\" located. Building now..." << endl;
 
-        construct(reverse_fm_index, reverse_raw_sequence_file, 1);
-        store_to_file(reverse_fm_index, reverse_fm_index_file);
-    }   
+        table.construct(forward_fm_index, table_depth);
+        sdsl::store_to_file(table, interval_table_file);
+    }
+}
+
+/*
+  Runs the build as a pipeline of three stages connected by bounded
+  queues: a thread for every few workers reads the kmers and orders
+  them by cost, the workers search them, and one thread writes their
+  SAM lines. A stage that runs ahead blocks until the next one
+  catches up.
+*/
+template <genomics::index_profile t_profile, class t_searcher, class t_record_writer>
+void process_kmers_in_parallel(const profile_genome_index<t_profile>& gi, const t_searcher& searcher,
+                               const build_cmd_options& opts,
+                               const std::vector<std::string>& pams,
+                               const t_record_writer& record_writer,
+                               std::unique_ptr<genomics::kmer_producer>& kmer_p,
+                               size_t first_window,
+                               const std::function<void(size_t)>& window_written,
+                               std::ostream& output,
+                               genomics::reorder_buffer* reorder) {
+    using namespace std;
+
+    size_t workers = max<size_t>(opts.nthreads, 1);
+    auto start = genomics::stage_stats::clock::now();
+
+    genomics::bounded_queue<genomics::kmer_window> windows(2);
+    genomics::bounded_queue<genomics::record_batch> batches(4 * workers);
+    genomics::guide_scheduler scheduler(windows, workers, first_window);
+    genomics::stage_stats production_stats, search_stats, writing_stats;
+
+    /* Estimating costs takes a fraction of the time of the searches,
+       but done in one thread it starves many workers. */
+    size_t window_threads = (workers + genomics::workers_per_window_thread - 1) /
+                            genomics::workers_per_window_thread;
+    genomics::window_reader reader(*kmer_p, first_window, window_threads, windows);
+    vector<thread> producers;
+    for (size_t i = 0; i < window_threads; i++) {
+        producers.emplace_back(genomics::produce_kmer_windows<t_wt,
+                                                              genomics::profile_densities<t_profile>::sa_dens,
+                                                              genomics::profile_densities<t_profile>::isa_dens>,
+                               cref(gi), ref(reader), ref(production_stats));
+    }
+
+    /* An error in the writer, such as records too far out of order
+       to sort, closes the queues so that the other stages wind down
+       after the guides already handed out. */
+    exception_ptr writer_error;
+    thread writer([&]() {
+        try {
+            genomics::write_batches(batches, output, first_window, window_written, writing_stats, reorder);
+        } catch (...) {
+            writer_error = current_exception();
+            windows.close();
+            batches.close();
+        }
+    });
+
+    vector<thread> threads;
+    for (size_t i = 0; i < workers; i++) {
+        thread t(genomics::process_kmers_to_stream<t_wt,
+                                                   genomics::profile_densities<t_profile>::sa_dens,
+                                                   genomics::profile_densities<t_profile>::isa_dens,
+                                                   t_searcher, t_record_writer>,
+                 cref(gi), cref(searcher),
+                 cref(pams), opts.mismatches, opts.threshold,
+                 cref(record_writer), ref(scheduler), i,
+		 ref(batches), ref(search_stats));
+        threads.push_back(move(t));
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (auto &producer : producers) {
+        producer.join();
+    }
+    batches.close();
+    writer.join();
+    if (writer_error) rethrow_exception(writer_error);
+
+    auto elapsed = genomics::stage_stats::clock::now() - start;
+    cout << "Stage utilization: kmers " << static_cast<int>(100 * production_stats.utilization(elapsed))
+         << "%, search " << static_cast<int>(100 * search_stats.utilization(elapsed))
+         << "%, output " << static_cast<int>(100 * writing_stats.utilization(elapsed)) << "%" << endl;
+}
+
+/*
+  Describes the options that determine the database a build writes,
+  which must not change when the build is resumed.
+*/
+std::string build_description(const build_cmd_options& opts) {
+    std::ostringstream description;
+    description << opts.fasta_file;
+    if (opts.kmers_file_opt->count() > 0) description << " --kmers-file " << opts.kmers_file;
+    if (opts.shard_opt->count() > 0) description << " --shard " << opts.shard;
+    description << " -k " << opts.kmer_length << " --min-chr-length " << opts.chr_length
+                << " -p " << opts.pam;
+    for (const auto& pam : opts.alt_pams) description << " -a " << pam;
+    description << " -m " << opts.mismatches << " -t " << opts.threshold;
+    if (opts.format != "sam") description << " --format " << opts.format;
+    if (opts.off_target_encoding != "hex") {
+        description << " --off-target-encoding " << opts.off_target_encoding;
+    }
+    if (opts.sort) description << " --sort";
+    return description.str();
+}
+
+/* Cuts the file back to its first size bytes, returning false if it
+   is shorter or cannot be truncated. */
+bool truncate_file(const std::string& filename, size_t size) {
+    std::ifstream is(filename, std::ios::binary | std::ios::ate);
+    if (!is || static_cast<size_t>(is.tellg()) < size) return false;
+    return truncate(filename.c_str(), size) == 0;
+}
+
+template <genomics::index_profile t_profile>
+int build_with_profile(const build_cmd_options& opts) {
+    using namespace std;
+    typedef profile_genome_index<t_profile> t_genome_index;
+    typedef profile_bidirectional_index<t_profile> t_bidirectional_index;
+
+    string forward_raw_sequence_file = opts.fasta_file + ".forward.dna";
+
+    genomics::genome_structure gs = prepare_sequence_files(opts.fasta_file, opts.bidirectional);
+
+    typename t_genome_index::t_csa forward_fm_index;
+    typename t_bidirectional_index::t_rc_csa reverse_bwt;
+    genomics::interval_table table;
+    load_genome_indexes<t_profile>(opts.fasta_file, opts.table_depth,
+                                   make_index_construction(opts.nthreads, opts.memory_budget, opts.scratch_dir),
+                                   forward_fm_index, table,
+                                   opts.bidirectional ? &reverse_bwt : nullptr);
+
+    t_genome_index gi(std::move(forward_fm_index), gs, std::move(table));
+
+    std::unique_ptr<t_bidirectional_index> bi;
+    if (opts.bidirectional) {
+        bi = make_unique<t_bidirectional_index>(gi, std::move(reverse_bwt));
+    }
 
-    genomics::genome_index<t_wt, t_sa_dens, t_isa_dens> gi_forward(forward_fm_index, gs);
-    genomics::genome_index<t_wt, t_sa_dens, t_isa_dens> gi_reverse(reverse_fm_index, gs);
     cout << "Successfully loaded index." << endl;
 
-    ofstream output(opts.database_file);
-    genomics::write_sam_header(output, gi_forward.gs);
+    string checkpoint_file = opts.database_file + ".checkpoint";
+    string regions_file = opts.database_file + ".regions";
+    string manifest_file = opts.database_file + ".manifest";
+    genomics::build_checkpoint checkpoint = {build_description(opts), 0, 0};
+
+    /* A BAM database is written through a BGZF stream buffer over the
+       file, and checkpoints record offsets in the compressed file. */
+    ofstream file;
+    std::unique_ptr<genomics::bgzf_streambuf> bgzf;
+    ostream output(file.rdbuf());
+    auto open_output = [&](ios::openmode mode) {
+        file.open(opts.database_file, mode);
+        if (opts.format == "bam") {
+            bgzf = make_unique<genomics::bgzf_streambuf>(file, opts.nthreads);
+            output.rdbuf(bgzf.get());
+        }
+    };
+
+    genomics::build_checkpoint previous;
+    if (opts.resume && genomics::seq_io::load_from_file(previous, checkpoint_file)) {
+        if (previous.build != checkpoint.build) {
+            cerr << "ERROR: Checkpoint \"" << checkpoint_file
+                 << "\" is of a build with different options." << endl;
+            return 1;
+        }
+
+        if (!truncate_file(opts.database_file, previous.offset)) {
+            cerr << "ERROR: Database \"" << opts.database_file
+                 << "\" is shorter than its checkpoint or cannot be truncated." << endl;
+            return 1;
+        }
+
+        cout << "Resuming after " << previous.windows << " windows of kmers..." << endl;
+        checkpoint = previous;
+        open_output(ios::out | ios::app | ios::ate);
+    } else {
+        if (opts.resume) {
+            cout << "No checkpoint file \"" << checkpoint_file
+                 << "\" located. Building from the start..." << endl;
+        }
+
+        /* The manifest of an earlier build would vouch for this one
+           until it completes, so merge could take a partial shard. */
+        remove(checkpoint_file.c_str());
+        remove(regions_file.c_str());
+        remove(manifest_file.c_str());
+        open_output(ios::out);
+        if (opts.format == "bam") {
+            genomics::write_bam_header(output, gi.gs, opts.sort);
+        } else {
+            genomics::write_sam_header(output, gi.gs, opts.sort);
+        }
+    }
+
+    /* A sorted SAM database is indexed by region as its records are
+       written, and a resumed build indexes the records it kept. */
+    std::unique_ptr<genomics::region_indexer> indexer;
+    std::unique_ptr<genomics::reorder_buffer> reorder;
+    if (opts.sort) {
+        output.flush();
+        if (opts.format == "sam") {
+            indexer = make_unique<genomics::region_indexer>(gi.gs);
+            if (checkpoint.windows > 0) {
+                ifstream database(opts.database_file, ios::binary);
+                genomics::index_sam_records(database, gi.gs, checkpoint.offset, *indexer);
+            }
+        }
+
+        reorder = make_unique<genomics::reorder_buffer>(output, opts.reorder_buffer, indexer.get(),
+                                                        file.tellp());
+    }
+
+    /* Records the windows written so far once the output holding
+       them is flushed. Writes go through output, which holds the
+       error if the file or the BGZF stream fails. */
+    auto last_checkpoint = chrono::steady_clock::now();
+    auto save_checkpoint = [&]() {
+        if (!output.flush()) {
+            throw runtime_error("Could not write database \"" + opts.database_file + "\".");
+        }
+        checkpoint.offset = file.tellp();
+        genomics::seq_io::write_to_file(checkpoint, checkpoint_file);
+        last_checkpoint = chrono::steady_clock::now();
+    };
+
+    std::function<void(size_t)> window_written = [&](size_t windows) {
+        checkpoint.windows = windows;
+        if (chrono::steady_clock::now() - last_checkpoint >= chrono::seconds(opts.checkpoint_interval)) {
+            save_checkpoint();
+        }
+    };
 
     std::unique_ptr<genomics::kmer_producer> kmer_p;
+    genomics::shard_kmer_producer* shard_p = nullptr;
+    genomics::shard_manifest manifest;
 
     if (opts.kmers_file_opt->count() > 0) {
 	kmer_p = make_unique<genomics::kmers_file_producer>(opts.kmers_file);
+    } else if (opts.shard_opt->count() > 0) {
+        parse_shard(opts.shard, manifest.shard, manifest.shards);
+        shard_p = new genomics::shard_kmer_producer(forward_raw_sequence_file, gs, opts.kmer_length,
+                                                    opts.pam, opts.chr_length,
+                                                    manifest.shard, manifest.shards, shard_stripe_size);
+        kmer_p.reset(shard_p);
     } else {
 	kmer_p = make_unique<genomics::seq_kmer_producer>(forward_raw_sequence_file, gs, opts.kmer_length,
                                                           opts.pam, opts.chr_length);
     }
 
-    std::mutex output_mtx;
-    std::mutex kmer_mtx;
-
     std::vector<std::string> pams = opts.alt_pams;
     pams.push_back(opts.pam);
 
+    genomics::off_target_encoding encoding = opts.off_target_encoding == "compact"
+        ? genomics::off_target_encoding::compact
+        : genomics::off_target_encoding::hex;
+    genomics::sam_writer sam(gi.gs, encoding);
+    genomics::bam_writer bam(gi.gs, encoding);
+
+    size_t first_window = checkpoint.windows;
+    if (bi && opts.format == "bam") {
+        process_kmers_in_parallel<t_profile, t_bidirectional_index>(
+            gi, *bi, opts, pams, bam, kmer_p, first_window, window_written, output, reorder.get());
+    } else if (bi) {
+        process_kmers_in_parallel<t_profile, t_bidirectional_index>(
+            gi, *bi, opts, pams, sam, kmer_p, first_window, window_written, output, reorder.get());
+    } else if (opts.format == "bam") {
+        process_kmers_in_parallel<t_profile, t_genome_index>(
+            gi, gi, opts, pams, bam, kmer_p, first_window, window_written, output, reorder.get());
+    } else {
+        process_kmers_in_parallel<t_profile, t_genome_index>(
+            gi, gi, opts, pams, sam, kmer_p, first_window, window_written, output, reorder.get());
+    }
+
+    /* The last checkpoint comes before the end of file block, which a
+       resumed build writes again. */
+    save_checkpoint();
+    if (bgzf) bgzf->close();
+    file.close();
+    if (!output || !file) {
+        cerr << "ERROR: Could not write database \"" << opts.database_file << "\"." << endl;
+        return 1;
+    }
+
+    if (indexer) genomics::seq_io::write_to_file(indexer->finish(checkpoint.offset), regions_file);
+
+    if (shard_p) {
+
+        manifest.genome = opts.fasta_file;
+        manifest.genome_length = 0;
+        for (const auto& chr : gs) manifest.genome_length += chr.length;
+        manifest.stripe_size = shard_stripe_size;
+        manifest.kmer_length = opts.kmer_length;
+        manifest.min_chr_length = opts.chr_length;
+        manifest.pam = opts.pam;
+        manifest.alt_pams = opts.alt_pams;
+        manifest.mismatches = opts.mismatches;
+        manifest.threshold = opts.threshold;
+        manifest.kmers = shard_p->produced();
+        genomics::seq_io::write_to_file(manifest, manifest_file);
+    }
+
+    /* The build is complete, so there is nothing left to resume. */
+    remove(checkpoint_file.c_str());
+    return 0;
+}
+
+int do_build_cmd(const build_cmd_options& opts) {
+    switch (genomics::parse_index_profile(opts.index_profile)) {
+    case genomics::index_profile::compact:
+        return build_with_profile<genomics::index_profile::compact>(opts);
+    case genomics::index_profile::balanced:
+        return build_with_profile<genomics::index_profile::balanced>(opts);
+    case genomics::index_profile::fast:
+        return build_with_profile<genomics::index_profile::fast>(opts);
+    }
+
+    return 1;
+}
+
+template <genomics::index_profile t_profile>
+int index_with_profile(const index_cmd_options& opts) {
+    typedef profile_genome_index<t_profile> t_genome_index;
+    typedef profile_bidirectional_index<t_profile> t_bidirectional_index;
+
+    prepare_sequence_files(opts.fasta_file, opts.bidirectional);
+
+    typename t_genome_index::t_csa forward_fm_index;
+    typename t_bidirectional_index::t_rc_csa reverse_bwt;
+    genomics::interval_table table;
+    load_genome_indexes<t_profile>(opts.fasta_file, opts.table_depth,
+                                   make_index_construction(opts.nthreads, opts.memory_budget, opts.scratch_dir),
+                                   forward_fm_index, table,
+                                   opts.bidirectional ? &reverse_bwt : nullptr);
+
+    std::cout << "Successfully built index." << std::endl;
+    return 0;
+}
+
+int do_index_cmd(const index_cmd_options& opts) {
+    switch (genomics::parse_index_profile(opts.index_profile)) {
+    case genomics::index_profile::compact:
+        return index_with_profile<genomics::index_profile::compact>(opts);
+    case genomics::index_profile::balanced:
+        return index_with_profile<genomics::index_profile::balanced>(opts);
+    case genomics::index_profile::fast:
+        return index_with_profile<genomics::index_profile::fast>(opts);
+    }
+
+    return 1;
+}
+
+/*
+  Number of window starts enumerated by a single task of the kmers
+  subcommand. Chunks overlap by k + |PAM| - 1 characters, so a kmer
+  on a chunk boundary is found exactly once.
+*/
+const size_t kmer_chunk_size = 1 << 24;
+
+/* Threads take chunks in genome order and wait for their turn to
+   write them, so the output matches that of a single producer while
+   at most one chunk per thread is held in memory. */
+void write_kmers_in_parallel(const kmer_cmd_options& opts, const std::string& raw_sequence_file,
+                             const genomics::genome_structure& gs, std::ostream& output) {
+    using namespace std;
+
+    size_t genome_length = 0;
+    for (const auto& chr : gs) genome_length += chr.length;
+    size_t chunks = (genome_length + kmer_chunk_size - 1) / kmer_chunk_size;
+
+    atomic<size_t> next_chunk(0);
+    size_t next_write = 0;
+    mutex write_mtx;
+    condition_variable write_cv;
+
+    auto enumerate_chunks = [&]() {
+        while (true) {
+            size_t chunk = next_chunk++;
+            if (chunk >= chunks) break;
+
+            size_t start = chunk * kmer_chunk_size;
+            size_t end = min(start + kmer_chunk_size, genome_length);
+            genomics::seq_kmer_producer kmer_p(raw_sequence_file, gs, opts.kmer_length,
+                                               opts.pam, opts.chr_length, start, end);
+            ostringstream chunk_os;
+            genomics::seq_io::write_kmers(kmer_p, chunk_os);
+
+            unique_lock<mutex> lock(write_mtx);
+            write_cv.wait(lock, [&]() { return next_write == chunk; });
+            output << chunk_os.str();
+            next_write++;
+            write_cv.notify_all();
+        }
+    };
+
     vector<thread> threads;
-    for (int i = 0; i < opts.nthreads; i++) {
-        thread t(genomics::process_kmers_to_stream<t_wt, t_sa_dens, t_isa_dens>,
-                 cref(gi_forward), cref(gi_reverse),
-                 cref(pams), opts.mismatches, opts.threshold,
-		 ref(kmer_p), ref(kmer_mtx),
-		 ref(output), ref(output_mtx));
-        threads.push_back(move(t));
+    for (size_t i = 0; i < max<size_t>(opts.nthreads, 1); i++) {
+        threads.push_back(thread(enumerate_chunks));
     }
 
     for (auto &thread : threads) {
         thread.join();
     }
- 
-    return 0;
 }
 
 int do_kmers_cmd(const kmer_cmd_options& opts) {
@@ -309,95 +1235,37 @@ int do_kmers_cmd(const kmer_cmd_options& opts) {
         genomics::seq_io::write_to_file(gs, genome_structure_file);
     }
 
-    cout << "Loading kmers from sequence..." << endl;
-    genomics::seq_kmer_producer kmer_p(raw_sequence_file, gs, opts.kmer_length,
-                                       opts.pam, opts.chr_length);
+    ofstream kmers_os(opts.kmers_file);
+    if (!kmers_os) {
+        cerr << "ERROR: Could not create kmers file \"" << opts.kmers_file << "\"." << endl;
+        return 1;
+    }
 
     cout << "Writing kmers to file..." << endl;
-    genomics::seq_io::write_to_file(kmer_p, opts.kmers_file);
+    write_kmers_in_parallel(opts, raw_sequence_file, gs, kmers_os);
 
     return 0;
 }
 
-int do_http_server_cmd(const http_server_cmd_options& opts) {
+template <genomics::index_profile t_profile>
+int serve_with_profile(const http_server_cmd_options& opts) {
     using namespace std;
     using json = nlohmann::json;
+    typedef profile_genome_index<t_profile> t_genome_index;
 
-    string genome_structure_file = opts.fasta_file + ".gs";
-    string forward_raw_sequence_file = opts.fasta_file + ".forward.dna";
-    string reverse_raw_sequence_file = opts.fasta_file + ".reverse.dna";
-    string forward_fm_index_file = opts.fasta_file + ".forward.csa";
-    string reverse_fm_index_file = opts.fasta_file + ".reverse.csa";
-    
-    ifstream fasta_is(opts.fasta_file);
-    if (!fasta_is) {
-        cerr << "ERROR: FASTA file \"" << opts.fasta_file
-             << "\" does not exist." << endl;
-        return 1;
-    }
+    genomics::genome_structure gs = prepare_sequence_files(opts.fasta_file, false);
 
-    cout << "Reading sequence file..." << endl;
-    if (!file_exists(forward_raw_sequence_file)) {
-        ofstream os(forward_raw_sequence_file);
-        if (!os) {
-            cerr << "ERROR: Could not create forward raw sequence file." << endl;
-            return 1;
-        }
+    typename t_genome_index::t_csa forward_fm_index;
+    genomics::interval_table table;
+    load_genome_indexes<t_profile>(opts.fasta_file, opts.table_depth,
+                                   index_construction{std::thread::hardware_concurrency(), 0, "."},
+                                   forward_fm_index, table, nullptr);
 
-        cout << "No raw sequence file \"" << forward_raw_sequence_file
-             << "\". Building now..." << endl;
-        genomics::seq_io::parse_sequence(fasta_is, os);
-    }
-
-    if (!file_exists(reverse_raw_sequence_file)) {
-        ofstream os(reverse_raw_sequence_file);
-        if (!os) {
-            cerr << "ERROR: Could not create reverse raw sequence file." << endl;
-            return 1;
-        }
-
-        cout << "No raw sequence file \"" << reverse_raw_sequence_file
-             << "\". Building now..." << endl;
-        ifstream is(forward_raw_sequence_file);
-        genomics::seq_io::reverse_complement_stream(is, os);
-    }
-
-    cout << "Loading genome index..." << endl;
-    genomics::genome_structure gs;
-    if (!genomics::seq_io::load_from_file(gs, genome_structure_file)) {
-        cout << "No genome structure file \"" << genome_structure_file
-             << "\" located. Building now..." << endl;
-
-        fasta_is.clear();
-        fasta_is.seekg(0);
-        gs = genomics::seq_io::parse_genome_structure(fasta_is);
-        genomics::seq_io::write_to_file(gs, genome_structure_file);
-    }
-
-    sdsl::csa_wt<t_wt, t_sa_dens, t_isa_dens> forward_fm_index;
-    if (!load_from_file(forward_fm_index, forward_fm_index_file)) {
-        cout << "No forward index file \"" << forward_fm_index_file
-             << "\" located. Building now..." << endl;
-
-        construct(forward_fm_index, forward_raw_sequence_file, 1);
-        store_to_file(forward_fm_index, forward_fm_index_file);
-    }   
-
-    sdsl::csa_wt<t_wt, t_sa_dens, t_isa_dens> reverse_fm_index;
-    if (!load_from_file(reverse_fm_index, reverse_fm_index_file)) {
-        cout << "No reverse index file \"" << reverse_fm_index_file
-             << "\" located. Building now..." << endl;
-
-        construct(reverse_fm_index, reverse_raw_sequence_file, 1);
-        store_to_file(reverse_fm_index, reverse_fm_index_file);
-    }   
-
-    genomics::genome_index<t_wt, t_sa_dens, t_isa_dens> gi_forward(forward_fm_index, gs);
-    genomics::genome_index<t_wt, t_sa_dens, t_isa_dens> gi_reverse(reverse_fm_index, gs);
+    t_genome_index gi(std::move(forward_fm_index), gs, std::move(table));
     cout << "Successfully loaded index." << endl;
 
     httplib::Server svr;
-    svr.Get("/search", [&gi_forward, &gi_reverse, &opts](const httplib::Request& req, httplib::Response& res){
+    svr.Get("/search", [&gi, &opts](const httplib::Request& req, httplib::Response& res){
         if (!req.has_param("sequence")) {
             return;
         }
@@ -405,7 +1273,7 @@ int do_http_server_cmd(const http_server_cmd_options& opts) {
         auto sequence = req.get_param_value("sequence");
         if (sequence.length() == 0) return;
 
-        json result = search_kmer(gi_forward, gi_reverse, sequence, opts.mismatches);
+        json result = search_kmer(gi, sequence, opts.mismatches);
         res.set_content(result.dump(), "application/json");
     });
 
@@ -415,6 +1283,102 @@ int do_http_server_cmd(const http_server_cmd_options& opts) {
     return 0;
 }
 
+int do_merge_cmd(const merge_cmd_options& opts) {
+    using namespace std;
+
+    cout << "Checking shard manifests..." << endl;
+    genomics::check_shard_manifests(opts.databases);
+
+    cout << "Merging " << opts.databases.size() << " databases..." << endl;
+    genomics::merge_sam_files(opts.databases, opts.database_file, opts.memory << 20,
+                              opts.off_target_encoding_opt->count() > 0,
+                              opts.off_target_encoding == "compact"
+                                  ? genomics::off_target_encoding::compact
+                                  : genomics::off_target_encoding::hex);
+
+    return 0;
+}
+
+int do_pack_cmd(const pack_cmd_options& opts) {
+    using namespace std;
+
+    cout << "Packing database..." << endl;
+    genomics::pack_guide_database(opts.database_file, opts.output_file, opts.kmer_length);
+
+    return 0;
+}
+
+int do_query_cmd(const query_cmd_options& opts) {
+    using namespace std;
+
+    vector<string> sequences = opts.sequences;
+    if (opts.sequences_file_opt->count() > 0) {
+        ifstream is(opts.sequences_file);
+        string line;
+        while (getline(is, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) sequences.push_back(line);
+        }
+    }
+
+    genomics::guide_database database(opts.database_file);
+    genomics::sam_writer records(database.genome(), database.encoding());
+
+    string output;
+    for (const auto& sequence : sequences) {
+        auto guides = database.find(sequence);
+        if (guides.empty()) cerr << "No gRNA with protospacer " << sequence << endl;
+
+        for (const auto& guide : guides) {
+            records.append_record(output, guide.k, guide.coords, guide.off_targets);
+        }
+    }
+
+    cout << output;
+    return 0;
+}
+
+int do_view_cmd(const view_cmd_options& opts) {
+    using namespace std;
+
+    string regions_file = opts.database_file + ".regions";
+    genomics::region_index index;
+    if (!genomics::seq_io::load_from_file(index, regions_file)) {
+        cerr << "ERROR: No region index \"" << regions_file << "\" located."
+             << " Build the database with --sort or merge it to sort and index it." << endl;
+        return 1;
+    }
+
+    ifstream is(opts.database_file, ios::binary);
+    if (is.peek() == 0x1f) {
+        throw runtime_error("database \"" + opts.database_file + "\" is BAM; view takes SAM databases");
+    }
+
+    genomics::genome_structure gs = genomics::read_sam_genome(genomics::read_sam_header(is));
+
+    for (const auto& region : opts.regions) {
+        string chr;
+        size_t start, end;
+        parse_region(region, chr, start, end);
+        genomics::write_region(is, gs, index, chr, start, end, cout);
+    }
+
+    return 0;
+}
+
+int do_http_server_cmd(const http_server_cmd_options& opts) {
+    switch (genomics::parse_index_profile(opts.index_profile)) {
+    case genomics::index_profile::compact:
+        return serve_with_profile<genomics::index_profile::compact>(opts);
+    case genomics::index_profile::balanced:
+        return serve_with_profile<genomics::index_profile::balanced>(opts);
+    case genomics::index_profile::fast:
+        return serve_with_profile<genomics::index_profile::fast>(opts);
+    }
+
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
     CLI::App guidescan("Guidescan all-in-one interface.\n");
@@ -423,13 +1387,24 @@ int main(int argc, char *argv[])
 
     build_cmd_options build_opts;
     kmer_cmd_options kmer_opts;
+    index_cmd_options index_opts;
+    merge_cmd_options merge_opts;
+    pack_cmd_options pack_opts;
+    query_cmd_options query_opts;
+    view_cmd_options view_opts;
     http_server_cmd_options http_opts;
 
     auto build = build_cmd(guidescan, build_opts);
     auto kmer  = kmer_cmd(guidescan, kmer_opts);
+    auto index = index_cmd(guidescan, index_opts);
+    auto merge = merge_cmd(guidescan, merge_opts);
+    auto pack  = pack_cmd(guidescan, pack_opts);
+    auto query = query_cmd(guidescan, query_opts);
+    auto view  = view_cmd(guidescan, view_opts);
     auto http  = http_cmd(guidescan, http_opts);
 
-    (void) build; (void) http; (void) kmer; // supress unused variable warnings
+    (void) build; (void) http; (void) kmer; (void) index; (void) merge; // supress unused variable warnings
+    (void) pack; (void) query; (void) view;
 
     try {
 	guidescan.parse(argc, argv);
@@ -437,16 +1412,41 @@ int main(int argc, char *argv[])
 	return guidescan.exit(e);
     }
     
-    if (guidescan.got_subcommand("kmers")) {
-	return do_kmers_cmd(kmer_opts);
-    }
+    try {
+        if (guidescan.got_subcommand("kmers")) {
+            return do_kmers_cmd(kmer_opts);
+        }
 
-    if (guidescan.got_subcommand("build")) {
-	return do_build_cmd(build_opts);
-    }
+        if (guidescan.got_subcommand("index")) {
+            return do_index_cmd(index_opts);
+        }
 
-    if (guidescan.got_subcommand("http-server")) {
-        return do_http_server_cmd(http_opts);
+        if (guidescan.got_subcommand("build")) {
+            return do_build_cmd(build_opts);
+        }
+
+        if (guidescan.got_subcommand("merge")) {
+            return do_merge_cmd(merge_opts);
+        }
+
+        if (guidescan.got_subcommand("pack")) {
+            return do_pack_cmd(pack_opts);
+        }
+
+        if (guidescan.got_subcommand("query")) {
+            return do_query_cmd(query_opts);
+        }
+
+        if (guidescan.got_subcommand("view")) {
+            return do_view_cmd(view_opts);
+        }
+
+        if (guidescan.got_subcommand("http-server")) {
+            return do_http_server_cmd(http_opts);
+        }
+    } catch (const std::runtime_error &e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
     }
 
     return 1;
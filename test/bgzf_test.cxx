@@ -0,0 +1,310 @@
+/*
+   Checks BAM databases against the format: the BGZF blocks the stream
+   buffer writes are decompressed with zlib and checked against their
+   headers, and the BAM records are decoded field by field and
+   compared with the SAM records of the same guides.
+*/
+
+#include <zlib.h>
+
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "genomics/bam.hpp"
+#include "genomics/bgzf.hpp"
+#include "genomics/sam.hpp"
+
+namespace {
+    const char bgzf_eof[] = "\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00"
+                            "\x1b\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00";
+
+    uint32_t get_le(const std::string& s, size_t at, size_t bytes) {
+        uint32_t n = 0;
+        for (size_t i = bytes; i > 0; i--) n = n << 8 | static_cast<uint8_t>(s[at + i - 1]);
+        return n;
+    }
+
+    /*
+      Splits BGZF data into its blocks, checking the header, size and
+      checksum of each, and returns the decompressed data of each.
+    */
+    std::vector<std::string> read_blocks(const std::string& bgzf) {
+        std::vector<std::string> blocks;
+        size_t at = 0;
+        while (at < bgzf.size()) {
+            CHECK(bgzf.size() - at >= 28);
+            CHECK(bgzf.compare(at, 4, "\x1f\x8b\x08\x04", 4) == 0);
+            CHECK(get_le(bgzf, at + 10, 2) == 6);
+            CHECK(bgzf.compare(at + 12, 4, "BC\x02\x00", 4) == 0);
+
+            size_t size = get_le(bgzf, at + 16, 2) + 1;
+            CHECK(size <= 1 << 16 && at + size <= bgzf.size());
+            if (size > 1 << 16 || at + size > bgzf.size()) break;
+
+            std::string data(get_le(bgzf, at + size - 4, 4), '\0');
+            CHECK(data.size() <= genomics::bgzf_block_size);
+
+            z_stream zs = z_stream();
+            inflateInit2(&zs, -15);
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(&bgzf[at + 18]));
+            zs.avail_in = static_cast<uInt>(size - 26);
+            Bytef empty;
+            zs.next_out = data.empty() ? &empty : reinterpret_cast<Bytef*>(&data[0]);
+            zs.avail_out = static_cast<uInt>(data.size());
+            CHECK(inflate(&zs, Z_FINISH) == Z_STREAM_END);
+            CHECK(zs.total_out == data.size());
+            inflateEnd(&zs);
+
+            uint32_t crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(data.data()),
+                                 static_cast<uInt>(data.size()));
+            CHECK(get_le(bgzf, at + size - 8, 4) == crc);
+
+            blocks.push_back(data);
+            at += size;
+        }
+
+        return blocks;
+    }
+
+    std::string join(const std::vector<std::string>& blocks) {
+        std::string data;
+        for (const auto& block : blocks) data += block;
+        return data;
+    }
+
+    bool ends_with_eof(const std::string& bgzf) {
+        size_t eof = sizeof(bgzf_eof) - 1;
+        return bgzf.size() >= eof && bgzf.compare(bgzf.size() - eof, eof, bgzf_eof, eof) == 0;
+    }
+
+    void test_empty() {
+        std::ostringstream os;
+        {
+            genomics::bgzf_streambuf buf(os, 2);
+            buf.close();
+        }
+
+        CHECK(os.str() == std::string(bgzf_eof, sizeof(bgzf_eof) - 1));
+        CHECK(read_blocks(os.str()) == std::vector<std::string>(1));
+    }
+
+    /* Text that compresses, random bytes that do not, and writes of
+       every size from single characters to several blocks at once. */
+    void test_blocks(std::mt19937& rng) {
+        std::string data;
+        for (size_t i = 0; data.size() < 200000; i++) data += "guide " + std::to_string(i) + "\n";
+        std::uniform_int_distribution<int> byte(0, 255);
+        for (size_t i = 0; i < 150000; i++) data += static_cast<char>(byte(rng));
+
+        std::ostringstream os;
+        genomics::bgzf_streambuf buf(os, 3);
+        std::ostream output(&buf);
+
+        std::uniform_int_distribution<size_t> chunk(0, 3 * genomics::bgzf_block_size);
+        for (size_t at = 0; at < data.size();) {
+            size_t n = std::min(chunk(rng), data.size() - at);
+            if (n % 7 == 0 && n > 0) {
+                output.put(data[at]);
+                n = 1;
+            } else {
+                output.write(&data[at], n);
+            }
+            at += n;
+        }
+        buf.close();
+        CHECK(output);
+
+        std::string bgzf = os.str();
+        CHECK(ends_with_eof(bgzf));
+
+        auto blocks = read_blocks(bgzf);
+        CHECK(join(blocks) == data);
+
+        /* Without flushes every block but the last two is full. */
+        CHECK(blocks.size() == (data.size() + genomics::bgzf_block_size - 1) / genomics::bgzf_block_size + 1);
+        for (size_t i = 0; i + 2 < blocks.size(); i++) {
+            CHECK(blocks[i].size() == genomics::bgzf_block_size);
+        }
+        CHECK(blocks.back().empty());
+    }
+
+    /* A flush ends the block, so the output then ends on a block
+       boundary, which is what checkpoints record. */
+    void test_flush() {
+        std::ostringstream os;
+        genomics::bgzf_streambuf buf(os, 2);
+        std::ostream output(&buf);
+
+        output << "first window\n";
+        CHECK(output.flush());
+        auto blocks = read_blocks(os.str());
+        CHECK(blocks == std::vector<std::string>(1, "first window\n"));
+        CHECK(!ends_with_eof(os.str()));
+
+        output.flush();
+        CHECK(read_blocks(os.str()).size() == 1);
+
+        output << "second window\n";
+        buf.close();
+        blocks = read_blocks(os.str());
+        CHECK(blocks.size() == 3);
+        CHECK(blocks[1] == "second window\n" && blocks[2].empty());
+    }
+
+    /* Reads a BAM record field by field from data at at. */
+    struct bam_record {
+        int32_t reference, position;
+        uint16_t bin, cigar_ops, flag;
+        uint8_t mapq;
+        std::string name, sequence, qualities, tag, tag_value;
+        uint32_t cigar;
+        int32_t next_reference, next_position, template_length;
+    };
+
+    bam_record read_record(const std::string& data, size_t& at) {
+        bam_record r;
+        size_t end = at + 4 + get_le(data, at, 4);
+        r.reference = static_cast<int32_t>(get_le(data, at + 4, 4));
+        r.position = static_cast<int32_t>(get_le(data, at + 8, 4));
+        size_t name_length = static_cast<uint8_t>(data[at + 12]);
+        r.mapq = static_cast<uint8_t>(data[at + 13]);
+        r.bin = get_le(data, at + 14, 2);
+        r.cigar_ops = get_le(data, at + 16, 2);
+        r.flag = get_le(data, at + 18, 2);
+        size_t length = get_le(data, at + 20, 4);
+        r.next_reference = static_cast<int32_t>(get_le(data, at + 24, 4));
+        r.next_position = static_cast<int32_t>(get_le(data, at + 28, 4));
+        r.template_length = static_cast<int32_t>(get_le(data, at + 32, 4));
+        at += 36;
+
+        r.name = data.substr(at, name_length);
+        at += name_length;
+        r.cigar = get_le(data, at, 4);
+        at += 4 * r.cigar_ops;
+
+        const char* codes = "=ACMGRSVTWYHKDBN";
+        for (size_t i = 0; i < length; i++) {
+            uint8_t byte = static_cast<uint8_t>(data[at + i / 2]);
+            r.sequence += codes[i % 2 == 0 ? byte >> 4 : byte & 0xf];
+        }
+        at += (length + 1) / 2;
+        r.qualities = data.substr(at, length);
+        at += length;
+
+        if (at < end) {
+            r.tag = data.substr(at, 3);
+            r.tag_value = data.substr(at + 3, end - at - 4);
+            CHECK(data[end - 1] == '\0');
+        }
+
+        CHECK(at <= end);
+        at = end;
+        return r;
+    }
+
+    std::vector<std::string> sam_fields(const std::string& line) {
+        std::vector<std::string> fields;
+        std::istringstream is(line);
+        for (std::string field; std::getline(is, field, '\t');) fields.push_back(field);
+        return fields;
+    }
+
+    void test_bam_records() {
+        genomics::genome_structure gs = {{"chr1", 100000}, {"chrX", 20000}};
+
+        std::vector<genomics::kmer> kmers = {
+            {"ACGTACGTACGTACGTACGT", "AGG", 0, genomics::direction::positive},
+            {"TTGCANNNNACGTACGTACG", "TGG", 0, genomics::direction::negative},
+            {"CCCCCGGGGGAAAAATTTTA", "CGG", 0, genomics::direction::positive},
+        };
+        std::vector<genomics::coordinates> coords = {
+            {gs[0], 0}, {gs[0], 16380}, {gs[1], 19977},
+        };
+        std::vector<std::vector<std::vector<int64_t>>> off_targets = {
+            {{}, {16384, -5}, {}},
+            {{}, {}, {}},
+            {{7}, {}, {100001, -120000}},
+        };
+
+        genomics::sam_writer sam(gs);
+        genomics::bam_writer bam(gs);
+
+        std::ostringstream os;
+        genomics::bgzf_streambuf buf(os, 2);
+        std::ostream output(&buf);
+        genomics::write_bam_header(output, gs, true);
+
+        std::string records;
+        for (size_t i = 0; i < kmers.size(); i++) {
+            bam.append_record(records, kmers[i], coords[i], off_targets[i]);
+        }
+        output.write(records.data(), records.size());
+        buf.close();
+
+        std::string data = join(read_blocks(os.str()));
+
+        std::ostringstream sam_header;
+        genomics::write_sam_header(sam_header, gs, true);
+        std::string text = sam_header.str();
+
+        CHECK(data.compare(0, 4, "BAM\1", 4) == 0);
+        CHECK(get_le(data, 4, 4) == text.size());
+        CHECK(data.compare(8, text.size(), text) == 0);
+
+        size_t at = 8 + text.size();
+        CHECK(get_le(data, at, 4) == gs.size());
+        at += 4;
+        for (const auto& chr : gs) {
+            CHECK(get_le(data, at, 4) == chr.name.size() + 1);
+            CHECK(data.compare(at + 4, chr.name.size() + 1, chr.name.c_str(), chr.name.size() + 1) == 0);
+            CHECK(get_le(data, at + 5 + chr.name.size(), 4) == chr.length);
+            at += 9 + chr.name.size();
+        }
+
+        for (size_t i = 0; i < kmers.size(); i++) {
+            std::string line;
+            sam.append_record(line, kmers[i], coords[i], off_targets[i]);
+            auto fields = sam_fields(line.substr(0, line.size() - 1));
+
+            bam_record r = read_record(data, at);
+            size_t length = kmers[i].sequence.size() + kmers[i].pam.size();
+
+            CHECK(r.name == fields[0] + std::string(1, '\0'));
+            CHECK(std::to_string(r.flag) == fields[1]);
+            CHECK(r.reference == (coords[i].chr.name == "chr1" ? 0 : 1));
+            CHECK(std::to_string(r.position + 1) == fields[3]);
+            CHECK(std::to_string(r.mapq) == fields[4]);
+            CHECK(r.bin == genomics::bam_bin(r.position, r.position + length));
+            CHECK(r.cigar_ops == 1 && r.cigar == (length << 4));
+            CHECK(r.next_reference == -1 && r.next_position == -1 && r.template_length == 0);
+            CHECK(r.sequence == fields[9]);
+            CHECK(r.qualities == std::string(length, '\xff'));
+
+            if (fields.size() > 11) {
+                CHECK(r.tag == "ofH");
+                CHECK("of:H:" + r.tag_value == fields[11]);
+            } else {
+                CHECK(r.tag.empty());
+            }
+        }
+
+        /* The record at 16380 crosses from one 16kbp bin into the
+           next, so it falls in the first 128kbp bin. */
+        CHECK(genomics::bam_bin(16380, 16403) == 585);
+        CHECK(genomics::bam_bin(0, 23) == 4681);
+        CHECK(at == data.size());
+    }
+};
+
+int main() {
+    std::mt19937 rng(22);
+    test_empty();
+    test_blocks(rng);
+    test_flush();
+    test_bam_records();
+    return test::result();
+}
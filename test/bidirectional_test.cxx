@@ -0,0 +1,153 @@
+/*
+   Checks the bidirectional index against the backtracking search of
+   the forward index it is built on: over a small random genome, both
+   must visit the same intervals with the same number of mismatches
+   for every budget and on both sides of the PAM, whether the search
+   runs in one go or is extended from a frontier.
+*/
+
+#include <sdsl/suffix_arrays.hpp>
+
+#include <random>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "check.hpp"
+#include "genomics/bidirectional.hpp"
+#include "genomics/index.hpp"
+#include "genomics/sequences.hpp"
+#include "genomics/wt_dna.hpp"
+
+namespace {
+    typedef genomics::genome_index<genomics::wt_dna, 32, 64> t_index;
+    typedef genomics::bidirectional_index<genomics::wt_dna, 32, 64> t_bidirectional_index;
+
+    /* The mismatches and forward interval of each visit. */
+    typedef std::multiset<std::tuple<size_t, size_t, size_t>> visits;
+
+    const size_t max_mismatches = 4;
+
+    /* Random DNA with a few runs of N, and repeats copied from earlier
+       in the text so that queries have more than one match. */
+    std::string random_genome(size_t length, std::mt19937& rng) {
+        const char* dna = "ACGT";
+        std::uniform_int_distribution<int> base(0, 3), event(0, 999);
+        std::uniform_int_distribution<size_t> run(1, 50), repeat(20, 60);
+
+        std::string genome;
+        while (genome.size() < length) {
+            int e = event(rng);
+            if (e == 0) {
+                genome += std::string(run(rng), 'N');
+            } else if (e < 5 && genome.size() > 100) {
+                size_t n = repeat(rng);
+                genome += genome.substr(std::uniform_int_distribution<size_t>(0, genome.size() - n)(rng), n);
+            } else {
+                genome += dna[base(rng)];
+            }
+        }
+
+        return genome.substr(0, length);
+    }
+
+    template <class t_searcher>
+    visits search(const t_searcher& searcher, const std::string& query,
+                  const std::vector<std::string>& pams, genomics::pam_side side, size_t mismatches) {
+        visits found;
+        auto all = [&found](size_t sp, size_t ep, size_t k) {
+            found.insert(std::make_tuple(k, sp, ep));
+            return true;
+        };
+
+        searcher.inexact_search(query, pams, side, mismatches, all);
+        return found;
+    }
+
+    /* Searches to a lower budget first and extends the search from
+       its frontier, returning the visits of both. */
+    template <class t_searcher>
+    visits extended_search(const t_searcher& searcher, const std::string& query,
+                           const std::vector<std::string>& pams, genomics::pam_side side,
+                           size_t threshold, size_t mismatches) {
+        visits found;
+        auto all = [&found](size_t sp, size_t ep, size_t k) {
+            found.insert(std::make_tuple(k, sp, ep));
+            return true;
+        };
+
+        genomics::search_frontier frontier;
+        searcher.inexact_search(query, pams, side, threshold, all, &frontier);
+        searcher.extend_search(query, pams, side, mismatches, frontier, all);
+        return found;
+    }
+
+    void check_searches(const t_index& forward, const t_bidirectional_index& bidirectional,
+                        const std::string& genome, std::mt19937& rng) {
+        using genomics::pam_side;
+
+        const std::vector<std::string> sense_pams = {"NGG", "NAG"};
+        std::vector<std::string> antisense_pams;
+        for (const auto& pam : sense_pams) antisense_pams.push_back(genomics::reverse_complement(pam));
+
+        const char* dna = "ACGT";
+        std::uniform_int_distribution<size_t> length(8, 20), base(0, 3), mutations(0, 2);
+        size_t matches = 0;
+
+        for (size_t q = 0; q < 60; q++) {
+            /* A substring of the genome with a few bases changed, so
+               that it matches at several distances. */
+            std::string query;
+            while (query.empty() || query.find('N') != std::string::npos) {
+                size_t n = length(rng);
+                query = genome.substr(std::uniform_int_distribution<size_t>(0, genome.size() - n)(rng), n);
+            }
+            for (size_t i = mutations(rng); i > 0; i--) {
+                query[std::uniform_int_distribution<size_t>(0, query.size() - 1)(rng)] = dna[base(rng)];
+            }
+
+            for (pam_side side : {pam_side::left, pam_side::right}) {
+                const auto& pams = side == pam_side::left ? antisense_pams : sense_pams;
+
+                for (size_t m = 0; m <= max_mismatches; m++) {
+                    visits expected = search(forward, query, pams, side, m);
+                    CHECK(search(bidirectional, query, pams, side, m) == expected);
+                    matches += expected.size();
+
+                    for (size_t threshold = 0; threshold < m; threshold++) {
+                        CHECK(extended_search(bidirectional, query, pams, side, threshold, m) == expected);
+                        CHECK(extended_search(forward, query, pams, side, threshold, m) == expected);
+                    }
+                }
+            }
+        }
+
+        /* The queries must find something for the comparison to mean
+           anything. */
+        CHECK(matches > 1000);
+    }
+};
+
+int main() {
+    std::mt19937 rng(4);
+
+    std::string genome = random_genome(30000, rng);
+
+    t_index::t_csa csa;
+    sdsl::construct_im(csa, genome, 1);
+    t_index forward(std::move(csa), genomics::genome_structure());
+
+    t_bidirectional_index::t_rc_csa rc_csa;
+    sdsl::construct_im(rc_csa, genomics::reverse_complement(genome), 1);
+    t_bidirectional_index bidirectional(forward, std::move(rc_csa));
+
+    check_searches(forward, bidirectional, genome, rng);
+
+    /* The interval table takes over the first steps of the forward
+       search and must not change what either search finds. */
+    forward.table.construct(forward.csa, 4);
+    check_searches(forward, bidirectional, genome, rng);
+
+    return test::result();
+}
@@ -0,0 +1,41 @@
+/*
+   Checks for the test programs. A failed check is reported with its
+   location and makes the program exit with an error, but the test
+   goes on so that one run reports every failure.
+*/
+
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <iostream>
+
+namespace test {
+    inline int& failures() {
+        static int count = 0;
+        return count;
+    }
+
+    inline void fail(const char* file, int line, const char* expression) {
+        std::cerr << file << ":" << line << ": check failed: " << expression << std::endl;
+        failures()++;
+    }
+
+    /* The exit code of the test program. */
+    inline int result() {
+        if (failures() > 0) std::cerr << failures() << " checks failed" << std::endl;
+        return failures() > 0 ? 1 : 0;
+    }
+};
+
+#define CHECK(expression) \
+    do { if (!(expression)) test::fail(__FILE__, __LINE__, #expression); } while (0)
+
+/* Checks that the statement throws an exception of the given type. */
+#define CHECK_THROWS(statement, exception)                              \
+    do {                                                                \
+        bool thrown = false;                                            \
+        try { statement; } catch (const exception&) { thrown = true; }  \
+        if (!thrown) test::fail(__FILE__, __LINE__, #statement " throws " #exception); \
+    } while (0)
+
+#endif /* TEST_CHECK_H */
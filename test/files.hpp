@@ -0,0 +1,32 @@
+/*
+   Files for the test programs, which write their inputs next to
+   themselves and read back what the code under test wrote. Files
+   are read and written as bytes, so binary formats survive.
+*/
+
+#ifndef TEST_FILES_H
+#define TEST_FILES_H
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace test {
+    inline std::string read_file(const std::string& filename) {
+        std::ifstream fs(filename, std::ios::binary);
+        std::stringstream ss;
+        ss << fs.rdbuf();
+        return ss.str();
+    }
+
+    inline void write_file(const std::string& filename, const std::string& contents) {
+        std::ofstream fs(filename, std::ios::binary);
+        fs << contents;
+    }
+
+    inline bool exists(const std::string& filename) {
+        return std::ifstream(filename).good();
+    }
+};
+
+#endif /* TEST_FILES_H */
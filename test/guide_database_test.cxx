@@ -0,0 +1,195 @@
+/*
+   Checks that a packed guide database gives back every guide of the
+   SAM database it was packed from, field for field, including N bases,
+   the antisense strand and both off-target encodings, that it finds
+   nothing for protospacers it does not hold, and that truncated or
+   corrupt files are rejected when they are opened.
+*/
+
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "files.hpp"
+#include "genomics/guide_database.hpp"
+#include "genomics/off_targets.hpp"
+#include "genomics/sam.hpp"
+
+namespace {
+    const std::string database_file = "guide_database_test.sam";
+    const std::string packed_file = "guide_database_test.gdb";
+    const std::string corrupt_file = "guide_database_test.corrupt.gdb";
+
+    struct guide {
+        genomics::kmer k;
+        genomics::coordinates coords;
+        std::vector<std::vector<int64_t>> off_targets;
+    };
+
+    std::vector<guide> make_guides(const genomics::genome_structure& gs) {
+        using genomics::direction;
+
+        return {
+            {{"ACGTACGTACGTACGTACGT", "AGG", 0, direction::positive}, {gs[0], 10}, {{}, {-900}, {31, 2, -2}}},
+            {{"ACGTACGTACGTACGTACGT", "TGG", 0, direction::negative}, {gs[1], 0}, {{}, {}, {17}}},
+            {{"ACGTACGTACGTACGTACGT", "AGG", 0, direction::positive}, {gs[1], 4970}, {{}, {5}, {}}},
+            {{"ACGTNNACGTACGTACGTAC", "CGG", 0, direction::negative}, {gs[0], 500}, {{}, {}, {}}},
+            {{"ACGTAAACGTACGTACGTAC", "AGG", 0, direction::positive}, {gs[0], 700}, {{}, {3}, {}}},
+            {{"TTTTTTTTTTTTTTTTTTTT", "GGG", 0, direction::positive}, {gs[0], 99975}, {{0}, {}, {}}},
+            {{"NNNNNNNNNNNNNNNNNNNN", "AGG", 0, direction::negative}, {gs[1], 2000}, {{}, {}, {-1}}},
+        };
+    }
+
+    /* Writes the guides as build does, in the given encoding, and
+       returns their records. */
+    std::vector<std::string> write_database(const genomics::genome_structure& gs,
+                                            const std::vector<guide>& guides,
+                                            genomics::off_target_encoding encoding) {
+        genomics::sam_writer sam(gs, encoding);
+        std::ostringstream os;
+        genomics::write_sam_header(os, gs);
+
+        std::vector<std::string> records;
+        for (const auto& g : guides) {
+            std::string record;
+            sam.append_record(record, g.k, g.coords, g.off_targets);
+            records.push_back(record);
+            os << record;
+        }
+
+        test::write_file(database_file, os.str());
+        return records;
+    }
+
+    void test_round_trip(genomics::off_target_encoding encoding) {
+        genomics::genome_structure gs = {{"chr1", 100000}, {"chr2", 5000}};
+        auto guides = make_guides(gs);
+        auto records = write_database(gs, guides, encoding);
+
+        genomics::pack_guide_database(database_file, packed_file, 20);
+        genomics::guide_database database(packed_file);
+        CHECK(database.size() == guides.size());
+        CHECK(database.protospacer_length() == 20);
+        CHECK(database.encoding() == encoding);
+        CHECK(database.genome().size() == 2 && database.genome()[1].name == "chr2" &&
+              database.genome()[1].length == 5000);
+
+        genomics::sam_writer sam(database.genome(), database.encoding());
+        for (size_t i = 0; i < guides.size(); i++) {
+            const guide& g = guides[i];
+
+            /* A guide is found by its protospacer, with or without its
+               PAM, among the guides sharing it. */
+            size_t matches = 0;
+            for (const auto& query : {g.k.sequence, g.k.sequence + g.k.pam}) {
+                for (const auto& found : database.find(query)) {
+                    if (found.coords.chr.name != g.coords.chr.name || found.coords.offset != g.coords.offset) {
+                        continue;
+                    }
+
+                    matches++;
+                    CHECK(found.k.sequence == g.k.sequence);
+                    CHECK(found.k.pam == g.k.pam);
+                    CHECK(found.k.dir == g.k.dir);
+                    CHECK(found.k.absolute_coords == genomics::resolve_relative(gs, g.coords) + g.coords.offset);
+                    CHECK(found.off_targets.size() == g.off_targets.size());
+                    for (size_t d = 0; d < g.off_targets.size() && d < found.counts.size(); d++) {
+                        CHECK(found.counts[d] == g.off_targets[d].size());
+                    }
+
+                    std::string record;
+                    sam.append_record(record, found.k, found.coords, found.off_targets);
+                    CHECK(record == records[i]);
+                }
+            }
+            CHECK(matches == 2);
+        }
+
+        CHECK(database.find("ACGTACGTACGTACGTACGT").size() == 3);
+
+        /* N is stored apart from the base it packs as. */
+        CHECK(database.find("ACGTNNACGTACGTACGTAC").size() == 1);
+        CHECK(database.find("ACGTAAACGTACGTACGTAC").size() == 1);
+        CHECK(database.find("ACGTAAACGTACGTACGTAC")[0].coords.offset == 700);
+
+        CHECK(database.find("AAAAAAAAAAAAAAAAAAAA").empty());
+        CHECK(database.find("ACGTACGTACGTACGTACGA").empty());
+        CHECK(database.find("GGGGGGGGGGGGGGGGGGGG").empty());
+        CHECK(database.find("acgtacgtacgtacgtacgt").size() == 3);
+
+        CHECK_THROWS(database.find("ACGTACGT"), std::runtime_error);
+        CHECK_THROWS(database.find("ACGTACGTACGTACGTACGX"), std::runtime_error);
+    }
+
+    void test_empty() {
+        genomics::genome_structure gs = {{"chr1", 100000}};
+        write_database(gs, {}, genomics::off_target_encoding::hex);
+
+        genomics::pack_guide_database(database_file, packed_file, 20);
+        genomics::guide_database database(packed_file);
+        CHECK(database.size() == 0);
+        CHECK(database.find("ACGTACGTACGTACGTACGT").empty());
+    }
+
+    void check_rejected(const std::string& contents) {
+        test::write_file(corrupt_file, contents);
+        CHECK_THROWS(genomics::guide_database database(corrupt_file), std::runtime_error);
+    }
+
+    void test_corrupt() {
+        genomics::genome_structure gs = {{"chr1", 100000}, {"chr2", 5000}};
+        write_database(gs, make_guides(gs), genomics::off_target_encoding::compact);
+        genomics::pack_guide_database(database_file, packed_file, 20);
+        std::string packed = test::read_file(packed_file);
+
+        CHECK_THROWS(genomics::guide_database database("guide_database_test.missing.gdb"), std::runtime_error);
+        check_rejected("");
+        check_rejected(packed.substr(0, 40));
+
+        /* Every section must lie within the file, so cutting off even
+           the last byte of the off-targets is caught. */
+        check_rejected(packed.substr(0, packed.size() / 2));
+        check_rejected(packed.substr(0, packed.size() - 1));
+
+        std::string corrupt = packed;
+        corrupt[0] = 'X';
+        check_rejected(corrupt);
+
+        /* The version follows the magic number. */
+        corrupt = packed;
+        corrupt[8] = 99;
+        check_rejected(corrupt);
+
+        /* A protospacer length of 0, then of 33. */
+        corrupt = packed;
+        corrupt.replace(12, 4, std::string("\0\0\0\0", 4));
+        check_rejected(corrupt);
+        corrupt[12] = 33;
+        check_rejected(corrupt);
+
+        /* The offset of the keys, past the end of the file. */
+        corrupt = packed;
+        corrupt.replace(80, 8, std::string("\xff\xff\xff\xff\xff\xff\xff\x00", 8));
+        check_rejected(corrupt);
+
+        CHECK_THROWS(genomics::pack_guide_database("guide_database_test.missing.sam", packed_file, 20),
+                     std::runtime_error);
+
+        test::write_file(database_file, "@SQ\tSN:chr1\tLN:100\n"
+                         "ACGTACGTACGTACGTACGTAGG\t0\tchr9\t1\t100\t23M\t*\t0\t0\tACGTACGTACGTACGTACGTAGG\t*\n");
+        CHECK_THROWS(genomics::pack_guide_database(database_file, packed_file, 20), std::runtime_error);
+    }
+};
+
+int main() {
+    test_round_trip(genomics::off_target_encoding::hex);
+    test_round_trip(genomics::off_target_encoding::compact);
+    test_empty();
+    test_corrupt();
+
+    for (const auto& file : {database_file, packed_file, corrupt_file}) std::remove(file.c_str());
+    return test::result();
+}
@@ -0,0 +1,183 @@
+/*
+   Checks the merge of sharded databases: a merge that spills every
+   record to its own run must produce the same database and region
+   index as one that sorts in memory, and shard manifests must be
+   complete and agree before shards are merged.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "check.hpp"
+#include "files.hpp"
+#include "genomics/merge.hpp"
+#include "genomics/seq_io.hpp"
+#include "genomics/structures.hpp"
+
+namespace {
+    const std::string header =
+        "@HD\tVN:1.0\tSO:unknown\n"
+        "@SQ\tSN:chrB\tLN:40000\n"
+        "@SQ\tSN:chrA\tLN:300\n"
+        "@PG\tID:guidescan\tPN:guidescan\n";
+
+    /* A record in the layout of a database, at the given position. */
+    std::string record(const std::string& name, const std::string& chr, size_t position) {
+        return name + "\t0\t" + chr + "\t" + std::to_string(position) + "\t255\t20M\t*\t0\t0\t" +
+               "ACGTACGTACGTACGTACGT\t*";
+    }
+
+    /* The rank of the chromosome of a record, its position and its
+       text, the order of a merged database. */
+    std::tuple<int, size_t, std::string> coordinate_key(const std::string& line) {
+        std::istringstream is(line);
+        std::string name, flag, chr;
+        size_t position;
+        is >> name >> flag >> chr >> position;
+        return std::make_tuple(chr == "chrB" ? 0 : 1, position, line);
+    }
+
+    /* Records the merged database must contain in order. chrB comes
+       first as it does in the header, and records at the same
+       coordinate are ordered by their text. */
+    std::vector<std::string> sorted_records(std::mt19937& rng) {
+        std::vector<std::string> records;
+        std::uniform_int_distribution<size_t> b(1, 40000 - 20), a(1, 300 - 20);
+        for (size_t i = 0; i < 200; i++) {
+            records.push_back(record("b" + std::to_string(i), "chrB", b(rng)));
+        }
+        for (size_t i = 0; i < 30; i++) {
+            records.push_back(record("a" + std::to_string(i), "chrA", a(rng)));
+        }
+
+        /* Ties at one coordinate, split across the shards. */
+        for (size_t i = 0; i < 6; i++) records.push_back(record("t" + std::to_string(i), "chrB", 777));
+
+        std::sort(records.begin(), records.end(), [](const std::string& x, const std::string& y) {
+            return coordinate_key(x) < coordinate_key(y);
+        });
+        return records;
+    }
+
+    /* Deals the records out to the shards in a random order. */
+    std::vector<std::string> write_shards(std::vector<std::string> records, size_t shards,
+                                          std::mt19937& rng) {
+        std::shuffle(records.begin(), records.end(), rng);
+
+        std::vector<std::string> contents(shards, header), databases;
+        for (size_t i = 0; i < records.size(); i++) contents[i % shards] += records[i] + "\n";
+        for (size_t i = 0; i < shards; i++) {
+            databases.push_back("merge_test.shard" + std::to_string(i) + ".sam");
+            test::write_file(databases.back(), contents[i]);
+        }
+
+        return databases;
+    }
+
+    void test_merge(std::mt19937& rng) {
+        auto records = sorted_records(rng);
+        auto databases = write_shards(records, 3, rng);
+
+        std::string expected = "@HD\tVN:1.0\tSO:coordinate\n"
+                               "@SQ\tSN:chrB\tLN:40000\n"
+                               "@SQ\tSN:chrA\tLN:300\n";
+        for (const auto& line : records) expected += line + "\n";
+
+        genomics::merge_sam_files(databases, "merge_test.memory.sam", 1 << 30);
+        CHECK(test::read_file("merge_test.memory.sam") == expected);
+
+        /* A budget of one byte spills a run per record. */
+        genomics::merge_sam_files(databases, "merge_test.spill.sam", 1);
+        CHECK(test::read_file("merge_test.spill.sam") == expected);
+        CHECK(!test::exists("merge_test.spill.sam.run0"));
+        CHECK(test::read_file("merge_test.spill.sam.regions") ==
+              test::read_file("merge_test.memory.sam.regions"));
+
+        genomics::region_index index;
+        CHECK(genomics::seq_io::load_from_file(index, "merge_test.spill.sam.regions"));
+        CHECK(index.offsets.size() == (40000 + 300) / index.bin_size + 1);
+
+        /* Each bin starts at the first record at or after its start. */
+        for (size_t bin = 0; bin < index.offsets.size(); bin++) {
+            std::string first;
+            for (const auto& line : records) {
+                auto key = coordinate_key(line);
+                size_t coordinate = std::get<1>(key) - 1 + (std::get<0>(key) == 1 ? 40000 : 0);
+                if (coordinate >= bin * index.bin_size) {
+                    first = line;
+                    break;
+                }
+            }
+            CHECK(index.offsets[bin] == expected.find(first + "\n"));
+        }
+
+        /* Shards of different genomes are not merged. */
+        test::write_file(databases[1], "@SQ\tSN:chrB\tLN:40000\n" + records[0] + "\n");
+        CHECK_THROWS(genomics::merge_sam_files(databases, "merge_test.bad.sam", 1 << 30),
+                     std::runtime_error);
+
+        for (const auto& database : databases) std::remove(database.c_str());
+        for (const auto& output : {"merge_test.memory.sam", "merge_test.spill.sam"}) {
+            std::remove(output);
+            std::remove((std::string(output) + ".regions").c_str());
+        }
+        std::remove("merge_test.bad.sam");
+    }
+
+    genomics::shard_manifest manifest(size_t shard, size_t shards) {
+        genomics::shard_manifest m = {"genome.fa", 5300, shard, shards, 262144,
+                                      20, 0, "NGG", {"NAG"}, 3, -1, 100};
+        return m;
+    }
+
+    void test_manifests() {
+        std::vector<std::string> databases;
+        for (size_t i = 0; i < 3; i++) {
+            databases.push_back("merge_test.manifest" + std::to_string(i) + ".sam");
+        }
+
+        /* Databases without manifests are not checked. */
+        genomics::check_shard_manifests(databases);
+
+        for (size_t i = 0; i < 3; i++) {
+            genomics::seq_io::write_to_file(manifest(i, 3), databases[i] + ".manifest");
+        }
+        genomics::check_shard_manifests(databases);
+
+        genomics::shard_manifest loaded;
+        CHECK(genomics::seq_io::load_from_file(loaded, databases[1] + ".manifest"));
+        CHECK(loaded.shard == 1 && loaded.shards == 3 && loaded.alt_pams.size() == 1 &&
+              loaded.threshold == -1 && loaded.kmers == 100);
+
+        CHECK_THROWS(genomics::check_shard_manifests({databases[0], databases[1]}), std::runtime_error);
+        CHECK_THROWS(genomics::check_shard_manifests({databases[0], databases[1], databases[1]}),
+                     std::runtime_error);
+        CHECK_THROWS(genomics::check_shard_manifests({databases[0], databases[1], databases[2],
+                                                      "merge_test.unfinished.sam"}),
+                     std::runtime_error);
+
+        /* A shard beyond the count of its build. */
+        genomics::seq_io::write_to_file(manifest(3, 3), databases[2] + ".manifest");
+        CHECK_THROWS(genomics::check_shard_manifests(databases), std::runtime_error);
+
+        genomics::shard_manifest other = manifest(2, 3);
+        other.mismatches = 2;
+        genomics::seq_io::write_to_file(other, databases[2] + ".manifest");
+        CHECK_THROWS(genomics::check_shard_manifests(databases), std::runtime_error);
+
+        for (const auto& database : databases) std::remove((database + ".manifest").c_str());
+    }
+};
+
+int main() {
+    std::mt19937 rng(17);
+    test_merge(rng);
+    test_manifests();
+    return test::result();
+}
@@ -0,0 +1,133 @@
+/*
+   Checks that off-targets survive both encodings and the binary form
+   of the compact encoding, including the positions and groups that
+   the varint and delta coding treat specially, and that converting
+   between the encodings gives back the same value.
+*/
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "genomics/off_targets.hpp"
+
+namespace {
+    typedef std::vector<std::vector<int64_t>> off_target_list;
+
+    const int64_t delim = -3100000001;
+
+    /* The off-targets in the order both encodings list them: by
+       position, and the sense strand first. */
+    off_target_list sorted(off_target_list off_targets) {
+        for (auto& group : off_targets) {
+            std::sort(group.begin(), group.end(), [](int64_t a, int64_t b) {
+                if (std::llabs(a) != std::llabs(b)) return std::llabs(a) < std::llabs(b);
+                return a > 0 && b <= 0;
+            });
+        }
+
+        return off_targets;
+    }
+
+    std::string encode(const off_target_list& off_targets, genomics::off_target_encoding encoding) {
+        std::string value;
+        genomics::off_target_encoder(delim, encoding).append(value, off_targets);
+        return value;
+    }
+
+    void check_round_trip(const off_target_list& off_targets) {
+        using genomics::off_target_encoding;
+
+        off_target_list expected = sorted(off_targets);
+
+        std::string hex = encode(off_targets, off_target_encoding::hex);
+        std::string compact = encode(off_targets, off_target_encoding::compact);
+        CHECK(genomics::decode_off_targets(hex, off_target_encoding::hex) == expected);
+        CHECK(genomics::decode_off_targets(compact, off_target_encoding::compact) == expected);
+
+        std::string binary;
+        genomics::off_target_encoder(delim, off_target_encoding::compact).append_binary(binary, off_targets);
+        CHECK(genomics::decode_binary_off_targets(binary.data(), binary.size()) == expected);
+        CHECK(binary.size() * 2 == compact.size());
+
+        /* Converting as merge does reproduces the other encoding. */
+        CHECK(encode(genomics::decode_off_targets(hex, off_target_encoding::hex),
+                     off_target_encoding::compact) == compact);
+        CHECK(encode(genomics::decode_off_targets(compact, off_target_encoding::compact),
+                     off_target_encoding::hex) == hex);
+    }
+
+    void test_layout() {
+        using genomics::off_target_encoding;
+
+        /* 5 and -3 are keys 10 and 7, written in order as 7 and 3. */
+        CHECK(encode({{5, -3}}, off_target_encoding::compact) == "00020703");
+
+        /* Empty groups are skipped but for the last. */
+        CHECK(encode({{}, {}, {5}, {}}, off_target_encoding::compact) == "0201" "0a" "0300");
+
+        /* A delta of 300 takes two bytes of varint. */
+        CHECK(encode({{1, 151}}, off_target_encoding::compact) == "000202ac02");
+
+        CHECK(encode({{-1}}, off_target_encoding::hex) ==
+              "ffffffffffffffff" "0000000000000000" "ffc03947ffffffff");
+        CHECK(encode({}, off_target_encoding::hex).empty());
+        CHECK(encode({}, off_target_encoding::compact).empty());
+    }
+
+    void test_round_trips(std::mt19937& rng) {
+        check_round_trip({{0}});
+        check_round_trip({{0, -1, 1}});
+        check_round_trip({{-7, 7, -7}});
+        check_round_trip({{1, 3000000000, -2999999999}});
+        check_round_trip({{}, {}, {12}});
+        check_round_trip({{12}, {}, {}});
+        check_round_trip({{}, {}, {}, {}});
+        check_round_trip({{4, 2}, {}, {-9}, {}});
+        check_round_trip({});
+
+        std::uniform_int_distribution<int64_t> position(-3000000000, 3000000000);
+        std::uniform_int_distribution<size_t> count(0, 20), distances(1, 5);
+        for (size_t i = 0; i < 200; i++) {
+            off_target_list off_targets(distances(rng));
+            for (auto& group : off_targets) {
+                for (size_t n = count(rng) * (i % 3 == 0 ? 0 : 1); n > 0; n--) {
+                    group.push_back(position(rng));
+                }
+            }
+            check_round_trip(off_targets);
+        }
+    }
+
+    void test_malformed() {
+        using genomics::off_target_encoding;
+
+        CHECK_THROWS(genomics::decode_off_targets("000", off_target_encoding::compact), std::runtime_error);
+        CHECK_THROWS(genomics::decode_off_targets("0g", off_target_encoding::compact), std::runtime_error);
+        CHECK_THROWS(genomics::decode_off_targets("0002", off_target_encoding::compact), std::runtime_error);
+        CHECK_THROWS(genomics::decode_off_targets("000280", off_target_encoding::compact),
+                     std::runtime_error);
+        CHECK_THROWS(genomics::decode_off_targets("00" + std::string(22, 'f') + "01",
+                                                  off_target_encoding::compact),
+                     std::runtime_error);
+        CHECK_THROWS(genomics::decode_off_targets("ffc03947ffffffff", off_target_encoding::hex),
+                     std::runtime_error);
+        CHECK_THROWS(genomics::decode_off_targets("0500000000000000", off_target_encoding::hex),
+                     std::runtime_error);
+
+        const char truncated[] = {0x00, 0x03, 0x02};
+        CHECK_THROWS(genomics::decode_binary_off_targets(truncated, sizeof(truncated)), std::runtime_error);
+    }
+};
+
+int main() {
+    std::mt19937 rng(23);
+    test_layout();
+    test_round_trips(rng);
+    test_malformed();
+    return test::result();
+}
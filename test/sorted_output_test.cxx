@@ -0,0 +1,340 @@
+/*
+   Checks sorted output: the order in which the reorder buffer writes
+   records, released or pushed out by overflow, the region index built
+   as they are written or read back after a resume, and region lookups
+   in databases written by the buffer and by merge.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "genomics/merge.hpp"
+#include "genomics/seq_io.hpp"
+#include "genomics/sorted_output.hpp"
+
+namespace {
+    const size_t bin = genomics::region_bin_size;
+
+    /* A genome whose first chromosome ends just past its fourth bin. */
+    const genomics::genome_structure gs = {{"chr1", 3 * bin + 5}, {"chr2", 1000}, {"chr3", bin}};
+
+    struct sam_record {
+        size_t coordinate;
+        std::string line;
+    };
+
+    bool operator<(const sam_record& a, const sam_record& b) {
+        if (a.coordinate != b.coordinate) return a.coordinate < b.coordinate;
+        return a.line < b.line;
+    }
+
+    /* A record at the 1-based position of the chromosome. */
+    sam_record record(const std::string& name, size_t chr, size_t position) {
+        size_t start = 0;
+        for (size_t i = 0; i < chr; i++) start += gs[i].length;
+
+        return {start + position - 1, name + "\t0\t" + gs[chr].name + "\t" + std::to_string(position) +
+                                      "\t100\t23M\t*\t0\t0\tACGTACGTACGTACGTACGTAGG\t*\n"};
+    }
+
+    std::string header() {
+        std::string text = "@HD\tVN:1.0\tSO:coordinate\n";
+        for (const auto& chr : gs) text += "@SQ\tSN:" + chr.name + "\tLN:" + std::to_string(chr.length) + "\n";
+        return text;
+    }
+
+    /* Adds the records to the buffer as one window, as write_batches
+       does. */
+    void add(genomics::reorder_buffer& buffer, const std::vector<sam_record>& records) {
+        std::string text;
+        std::vector<genomics::record_key> keys;
+        for (const auto& r : records) {
+            text += r.line;
+            keys.push_back({r.coordinate, text.size()});
+        }
+
+        buffer.add(std::move(text), keys);
+    }
+
+    typedef std::vector<sam_record>::const_iterator record_iterator;
+
+    std::string lines(record_iterator begin, record_iterator end) {
+        std::string text;
+        for (auto it = begin; it != end; ++it) text += it->line;
+        return text;
+    }
+
+    std::string lines(const std::vector<sam_record>& records) {
+        return lines(records.begin(), records.end());
+    }
+
+    void test_release_and_overflow() {
+        std::ostringstream os;
+        genomics::reorder_buffer buffer(os, 3);
+
+        auto r1 = record("r1", 0, 2), r3 = record("r3", 0, 4), r5 = record("r5", 0, 6);
+        auto r7 = record("r7", 0, 8), r9 = record("r9", 0, 10);
+
+        add(buffer, {r5, r1, r9});
+        CHECK(os.str().empty());
+
+        /* Each record past the capacity pushes out the first one. */
+        add(buffer, {r7, r3});
+        CHECK(os.str() == lines({r1, r3}));
+
+        buffer.release(r7.coordinate);
+        CHECK(os.str() == lines({r1, r3, r5}));
+        buffer.release(r7.coordinate);
+        CHECK(os.str() == lines({r1, r3, r5}));
+        CHECK(!buffer.empty());
+
+        /* A record before one already written cannot be sorted. */
+        CHECK_THROWS(add(buffer, {record("r2", 0, 3)}), std::runtime_error);
+
+        std::ostringstream tail;
+        genomics::reorder_buffer rest(tail, 3);
+        add(rest, {r9, r7});
+        add(rest, {});
+        rest.release_all();
+        CHECK(tail.str() == lines({r7, r9}));
+        CHECK(rest.empty());
+    }
+
+    /* Records at one coordinate come out by their text, whichever
+       window they came in and whenever that window was released. */
+    void test_ties() {
+        std::ostringstream os;
+        genomics::reorder_buffer buffer(os, 3);
+
+        auto c = record("c", 1, 50), a = record("a", 1, 50), b = record("b", 1, 50);
+        auto before = record("before", 1, 49), after = record("after", 1, 51);
+
+        add(buffer, {c, after});
+        add(buffer, {before, a});
+        CHECK(os.str() == lines({before}));
+
+        /* b pushes out a from the window after c's, then the rest are
+           released. */
+        add(buffer, {b});
+        CHECK(os.str() == lines({before, a}));
+        buffer.release(b.coordinate + 1);
+        CHECK(os.str() == lines({before, a, b, c}));
+        buffer.release_all();
+        CHECK(os.str() == lines({before, a, b, c, after}));
+    }
+
+    /*
+      Windows of records that reach into the windows after them, as
+      guides near the end of a window do, released at the start of
+      each next window, come out sorted and indexed.
+    */
+    void test_windows(std::mt19937& rng) {
+        std::string head = header();
+        std::ostringstream os;
+        os << head;
+
+        genomics::region_indexer indexer(gs);
+        genomics::reorder_buffer buffer(os, 1000, &indexer, head.size());
+
+        std::vector<sam_record> all;
+        size_t genome_length = 3 * bin + 5 + 1000 + bin;
+        size_t step = 997;
+        std::uniform_int_distribution<size_t> spread(0, 3 * step), count(0, 12);
+        for (size_t start = 0, w = 0; start < genome_length; start += step, w++) {
+            std::vector<sam_record> window;
+            for (size_t n = count(rng); n > 0; n--) {
+                size_t coordinate = std::min(start + spread(rng), genome_length - 1);
+                size_t chr = 0, position = coordinate;
+                while (position >= gs[chr].length) position -= gs[chr++].length;
+
+                window.push_back(record("w" + std::to_string(w) + "." + std::to_string(n), chr, position + 1));
+            }
+
+            /* The last bases of the first chromosome, next to an
+               empty run of bins. */
+            if (w == 5) window.push_back(record("end", 0, gs[0].length));
+
+            add(buffer, window);
+            buffer.release(start + step);
+            all.insert(all.end(), window.begin(), window.end());
+        }
+        buffer.release_all();
+
+        std::sort(all.begin(), all.end());
+        std::string database = os.str();
+        CHECK(database == head + lines(all));
+
+        /* Each bin points at its first record, or the record after it
+           if it has none, and the index is the one read back. */
+        genomics::region_index index = indexer.finish(database.size());
+        CHECK(index.offsets.size() == genome_length / bin + 1);
+        for (size_t b = 0; b < index.offsets.size(); b++) {
+            auto first = std::lower_bound(all.begin(), all.end(), sam_record{b * bin, ""});
+            CHECK(index.offsets[b] == head.size() + lines(all.begin(), first).size());
+        }
+
+        genomics::region_indexer reread(gs);
+        std::istringstream is(database);
+        genomics::index_sam_records(is, gs, database.size(), reread);
+        CHECK(reread.finish(database.size()).offsets == index.offsets);
+    }
+
+    void test_empty_bins() {
+        genomics::region_indexer empty(gs);
+        auto index = empty.finish(123);
+        CHECK(index.bin_size == bin);
+        CHECK(index.offsets == std::vector<uint64_t>(index.offsets.size(), 123));
+
+        genomics::region_indexer indexer(gs);
+        indexer.add(5, 100);
+        indexer.add(7, 150);
+        indexer.add(3 * bin + 2, 200);
+        indexer.add(100 * bin, 250);
+        index = indexer.finish(300);
+        CHECK(index.offsets.size() == 5);
+        CHECK(index.offsets[0] == 100 && index.offsets[1] == 200 && index.offsets[2] == 200);
+        CHECK(index.offsets[3] == 200 && index.offsets[4] == 250);
+    }
+
+    /*
+      A resumed build indexes the records it kept from the file, up
+      to the checkpoint, and the records written after it as they
+      come, which must give the index of an uninterrupted build.
+    */
+    void test_resume() {
+        std::vector<sam_record> records;
+        for (size_t i = 0; i < 40; i++) records.push_back(record("g" + std::to_string(i), 0, 1 + i * 1200));
+        records.push_back(record("g40", 0, gs[0].length));
+        records.push_back(record("g41", 2, 1));
+
+        std::string head = header();
+        std::ostringstream whole_os;
+        whole_os << head;
+        genomics::region_indexer whole_indexer(gs);
+        {
+            genomics::reorder_buffer buffer(whole_os, 8, &whole_indexer, head.size());
+            add(buffer, records);
+            buffer.release_all();
+        }
+        std::string whole = whole_os.str();
+        auto whole_index = whole_indexer.finish(whole.size());
+
+        for (size_t kept : {0, 1, 17, 41, 42}) {
+            std::string database = head + lines(records.begin(), records.begin() + kept);
+            uint64_t checkpoint = database.size();
+
+            genomics::region_indexer indexer(gs);
+            std::istringstream is(database);
+            genomics::index_sam_records(is, gs, checkpoint, indexer);
+
+            std::ostringstream os;
+            os << database;
+            genomics::reorder_buffer buffer(os, 8, &indexer, checkpoint);
+            add(buffer, std::vector<sam_record>(records.begin() + kept, records.end()));
+            buffer.release_all();
+
+            CHECK(os.str() == whole);
+            CHECK(indexer.finish(os.str().size()).offsets == whole_index.offsets);
+        }
+
+        /* Records past the checkpoint, cut off by the resume, are not
+           indexed. */
+        genomics::region_indexer cut(gs);
+        std::istringstream is(whole);
+        genomics::index_sam_records(is, gs, head.size() + lines({records[0]}).size(), cut);
+        CHECK(cut.finish(0).offsets[1] == 0);
+        CHECK(cut.finish(0).offsets[0] == head.size());
+    }
+
+    std::string brute_force_region(const std::vector<sam_record>& records, size_t chr,
+                                   size_t start, size_t end) {
+        std::string text;
+        for (const auto& r : records) {
+            std::istringstream is(r.line);
+            std::string name, flag, rname;
+            size_t position;
+            is >> name >> flag >> rname >> position;
+            if (rname == gs[chr].name && position >= start && position <= end) text += r.line;
+        }
+
+        return text;
+    }
+
+    /* Looks up regions in a database written by merge, through the
+       region index merge writes next to it. */
+    void test_merged_regions(std::mt19937& rng) {
+        std::vector<sam_record> records;
+        std::uniform_int_distribution<size_t> position(1, 3 * bin + 5);
+        for (size_t i = 0; i < 150; i++) records.push_back(record("m" + std::to_string(i), 0, position(rng)));
+        for (size_t i = 0; i < 5; i++) records.push_back(record("e" + std::to_string(i), 0, gs[0].length - i));
+        records.push_back(record("c2", 1, 1000));
+        records.push_back(record("c3", 2, 1));
+        std::shuffle(records.begin(), records.end(), rng);
+
+        {
+            std::ofstream shard("sorted_output_test.shard.sam");
+            shard << header() << lines(records);
+        }
+        genomics::merge_sam_files({"sorted_output_test.shard.sam"}, "sorted_output_test.merged.sam", 1 << 20);
+        std::sort(records.begin(), records.end());
+
+        genomics::region_index index;
+        CHECK(genomics::seq_io::load_from_file(index, "sorted_output_test.merged.sam.regions"));
+
+        std::ifstream database("sorted_output_test.merged.sam");
+        std::stringstream contents;
+        contents << database.rdbuf();
+        genomics::region_indexer reread(gs);
+        std::istringstream is(contents.str());
+        genomics::index_sam_records(is, gs, contents.str().size(), reread);
+        CHECK(reread.finish(contents.str().size()).offsets == index.offsets);
+
+        auto region = [&](const std::string& chr, size_t start, size_t end) {
+            std::ostringstream os;
+            genomics::write_region(database, gs, index, chr, start, end, os);
+            return os.str();
+        };
+
+        CHECK(region("chr1", 1, gs[0].length) == brute_force_region(records, 0, 1, gs[0].length));
+        CHECK(region("chr1", bin - 10, 2 * bin + 10) == brute_force_region(records, 0, bin - 10, 2 * bin + 10));
+
+        /* The end of a chromosome, and a region past it, which is cut
+           to the chromosome. */
+        CHECK(region("chr1", gs[0].length - 2, gs[0].length) ==
+              brute_force_region(records, 0, gs[0].length - 2, gs[0].length));
+        CHECK(region("chr1", gs[0].length - 2, gs[0].length + 5000) ==
+              brute_force_region(records, 0, gs[0].length - 2, gs[0].length));
+        CHECK(!region("chr1", gs[0].length, gs[0].length).empty());
+        CHECK(region("chr1", gs[0].length + 1, gs[0].length + 100).empty());
+
+        CHECK(region("chr2", 1, 1000) == brute_force_region(records, 1, 1, 1000));
+        CHECK(region("chr3", 1, 1) == brute_force_region(records, 2, 1, 1));
+        CHECK(!region("chr3", 1, 1).empty());
+        CHECK(region("chr3", 2, bin).empty());
+        CHECK(region("chr1", 20, 10).empty());
+        CHECK_THROWS(region("chr4", 1, 10), std::runtime_error);
+
+        database.close();
+        std::remove("sorted_output_test.shard.sam");
+        std::remove("sorted_output_test.merged.sam");
+        std::remove("sorted_output_test.merged.sam.regions");
+    }
+};
+
+int main() {
+    std::mt19937 rng(25);
+    test_release_and_overflow();
+    test_ties();
+    test_windows(rng);
+    test_empty_bins();
+    test_resume();
+    test_merged_regions(rng);
+    return test::result();
+}
@@ -0,0 +1,185 @@
+/*
+   Checks the DNA occurrence table against the sdsl wavelet tree it
+   replaces, over random DNA with runs of N and a few other symbols,
+   both on its own and as the BWT of a suffix array.
+*/
+
+#include <sdsl/suffix_arrays.hpp>
+#include <sdsl/wavelet_trees.hpp>
+
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "genomics/wt_dna.hpp"
+
+namespace {
+    typedef sdsl::wt_huff<> t_reference;
+
+    /* Random DNA of the given length, with runs of N, a few IUPAC
+       codes and, if sentinel is set, a single 0 as in a BWT. */
+    sdsl::int_vector<8> random_text(size_t length, bool sentinel, std::mt19937& rng) {
+        const char* dna = "ACGT";
+        std::uniform_int_distribution<int> base(0, 3);
+        std::uniform_int_distribution<int> event(0, 999);
+        std::uniform_int_distribution<size_t> run(1, 500);
+
+        sdsl::int_vector<8> text(length);
+        for (size_t i = 0; i < length; i++) {
+            int e = event(rng);
+            if (e == 0) {
+                size_t end = std::min(length, i + run(rng));
+                for (; i < end; i++) text[i] = 'N';
+                i--;
+            } else if (e == 1) {
+                text[i] = 'R';
+            } else if (e == 2) {
+                text[i] = 'Y';
+            } else {
+                text[i] = dna[base(rng)];
+            }
+        }
+
+        if (sentinel && length > 0) text[std::uniform_int_distribution<size_t>(0, length - 1)(rng)] = 0;
+        return text;
+    }
+
+    template <class t_wt>
+    void build(t_wt& wt, const sdsl::int_vector<8>& text) {
+        sdsl::construct_im(wt, text, 0);
+    }
+
+    template <class t_wt = genomics::wt_dna>
+    void check_against_reference(const sdsl::int_vector<8>& text, std::mt19937& rng) {
+        t_wt wt;
+        t_reference reference;
+        build(wt, text);
+        build(reference, text);
+
+        CHECK(wt.size() == text.size());
+        CHECK(wt.sigma == reference.sigma);
+
+        const std::vector<uint8_t> symbols = {0, 'A', 'C', 'G', 'T', 'N', 'R', 'Y', 'W'};
+        std::vector<size_t> count(256, 0);
+
+        for (size_t i = 0; i <= text.size(); i++) {
+            for (uint8_t c : symbols) {
+                if (wt.rank(i, c) != count[c]) {
+                    CHECK(wt.rank(i, c) == count[c]);
+                    return;
+                }
+            }
+            if (i == text.size()) break;
+
+            CHECK(wt[i] == text[i]);
+            auto rc = wt.inverse_select(i);
+            CHECK(rc.first == count[text[i]] && rc.second == text[i]);
+            count[text[i]]++;
+            CHECK(wt.select(count[text[i]], text[i]) == i);
+        }
+
+        if (text.size() == 0) return;
+
+        std::uniform_int_distribution<size_t> position(0, text.size());
+        std::vector<uint8_t> cs(256), ref_cs(256);
+        std::vector<uint64_t> rank_i(256), rank_j(256), ref_rank_i(256), ref_rank_j(256);
+        for (size_t q = 0; q < 2000; q++) {
+            size_t i = position(rng), j = position(rng);
+            if (i > j) std::swap(i, j);
+            if (q % 4 == 0) j = std::min(text.size(), i + 1);
+
+            size_t k, ref_k;
+            wt.interval_symbols(i, j, k, cs, rank_i, rank_j);
+            reference.interval_symbols(i, j, ref_k, ref_cs, ref_rank_i, ref_rank_j);
+            CHECK(k == ref_k);
+
+            /* The table lists A, C, G and T first, the wavelet tree
+               in its own order. */
+            for (size_t a = 0; a < k; a++) {
+                bool found = false;
+                for (size_t b = 0; b < ref_k; b++) {
+                    if (ref_cs[b] != cs[a]) continue;
+                    found = ref_rank_i[b] == rank_i[a] && ref_rank_j[b] == rank_j[a];
+                }
+                CHECK(found);
+            }
+        }
+
+        std::stringstream stream;
+        wt.serialize(stream);
+        t_wt loaded;
+        loaded.load(stream);
+        CHECK(loaded.size() == wt.size() && loaded.sigma == wt.sigma);
+        for (size_t q = 0; q < 2000; q++) {
+            size_t i = position(rng);
+            for (uint8_t c : symbols) CHECK(loaded.rank(i, c) == wt.rank(i, c));
+        }
+    }
+
+    /* A table serialized by something else, such as an index built
+       with a wavelet tree, is refused. */
+    void check_format_tag(std::mt19937& rng) {
+        t_reference reference;
+        build(reference, random_text(1000, true, rng));
+
+        std::stringstream stream;
+        reference.serialize(stream);
+        genomics::wt_dna wt;
+        CHECK_THROWS(wt.load(stream), std::runtime_error);
+    }
+
+    /* Backward search through suffix arrays over either BWT. */
+    template <class t_wt = genomics::wt_dna>
+    void check_suffix_array(size_t size, std::mt19937& rng) {
+        sdsl::int_vector<8> text = random_text(size, false, rng);
+        std::string sequence(text.begin(), text.end());
+
+        sdsl::csa_wt<t_wt, 32, 64> csa;
+        sdsl::csa_wt<t_reference, 32, 64> reference;
+        sdsl::construct_im(csa, sequence, 1);
+        sdsl::construct_im(reference, sequence, 1);
+        CHECK(csa.size() == reference.size());
+
+        std::uniform_int_distribution<size_t> position(0, sequence.size() - 12);
+        std::uniform_int_distribution<size_t> length(1, 12);
+        for (size_t q = 0; q < 5000; q++) {
+            std::string pattern = sequence.substr(position(rng), length(rng));
+            size_t sp, ep, ref_sp, ref_ep;
+            size_t count = sdsl::backward_search(csa, 0, csa.size() - 1, pattern.begin(), pattern.end(), sp, ep);
+            size_t ref_count = sdsl::backward_search(reference, 0, reference.size() - 1,
+                                                     pattern.begin(), pattern.end(), ref_sp, ref_ep);
+            CHECK(count == ref_count && sp == ref_sp && ep == ref_ep);
+            if (count > 0) CHECK(csa[sp] == reference[sp]);
+        }
+    }
+};
+
+int main() {
+    std::mt19937 rng(20);
+
+    /* Sizes around the block boundaries. */
+    for (size_t length : {1, 2, 191, 192, 193, 384, 1000, 100000}) {
+        check_against_reference(random_text(length, true, rng), rng);
+    }
+
+    /* Superblocks of four blocks, so that texts of a few hundred
+       characters span several of them. Texts of 576 to 767
+       characters take 4 blocks, the rank block past the end
+       included, and fill their superblocks exactly. */
+    typedef genomics::basic_wt_dna<4> t_small_super;
+    for (size_t length : {575, 576, 700, 767, 768, 1535, 1536, 5000}) {
+        check_against_reference<t_small_super>(random_text(length, true, rng), rng);
+    }
+
+    check_format_tag(rng);
+    check_suffix_array(200000, rng);
+
+    /* The BWT holds the sentinel as well. */
+    check_suffix_array<t_small_super>(766, rng);
+    check_suffix_array<t_small_super>(1534, rng);
+    check_suffix_array<t_small_super>(20000, rng);
+
+    return test::result();
+}